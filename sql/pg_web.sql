@@ -1,3 +1,88 @@
 
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
-\echo Use "CREATE EXTENSION pg_web" to load this file. \quit
\ No newline at end of file
+\echo Use "CREATE EXTENSION pg_web" to load this file. \quit
+
+-- request counters of the HTTP workers, summed over the workers
+CREATE FUNCTION pg_web_stats(
+  OUT route text,
+  OUT requests bigint,
+  OUT bytes_in bigint,
+  OUT bytes_out bigint,
+  OUT status_1xx bigint,
+  OUT status_2xx bigint,
+  OUT status_3xx bigint,
+  OUT status_4xx bigint,
+  OUT status_5xx bigint,
+  OUT latency_avg float8,
+  OUT latency_p50 float8,
+  OUT latency_p90 float8,
+  OUT latency_p99 float8,
+  OUT latency_max float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_web_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_web_worker_stats(
+  OUT worker int,
+  OUT pid int,
+  OUT connections_active bigint,
+  OUT connections_total bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_web_worker_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_web_latency_histogram(
+  OUT route text,
+  OUT le float8,
+  OUT count bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_web_latency_histogram'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_web_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_web_stats_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_web_stats_reset() FROM PUBLIC;
+
+-- named queries served at /q/<name>; $1, $2, ... are bound to the request
+-- parameters named in params, converted to the corresponding types
+CREATE TABLE pg_web_endpoints (
+  name text PRIMARY KEY CHECK (length(name) < 64),
+  query text NOT NULL,
+  params text[] NOT NULL DEFAULT '{}',
+  types regtype[] NOT NULL DEFAULT '{}',
+  CHECK (cardinality(params) = cardinality(types))
+);
+
+SELECT pg_catalog.pg_extension_config_dump('pg_web_endpoints', '');
+
+-- tells the workers to drop the plans of changed endpoints
+CREATE FUNCTION pg_web_endpoints_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_web_endpoints_changed'
+LANGUAGE C;
+
+CREATE TRIGGER pg_web_endpoints_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON pg_web_endpoints
+FOR EACH STATEMENT EXECUTE PROCEDURE pg_web_endpoints_changed();
+
+-- writes the rows of the query as JSON the given number of times, with the
+-- generic and the type-specialized writer
+CREATE FUNCTION pg_web_json_bench(
+  query text,
+  loops int DEFAULT 10,
+  OUT rows bigint,
+  OUT bytes bigint,
+  OUT generic_ms float8,
+  OUT fast_ms float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_web_json_bench'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_web_json_bench(text, int) FROM PUBLIC;
@@ -11,6 +11,7 @@
   #include <winsock2.h>
   #include <ws2tcpip.h>
   #include <windows.h>
+  #include <io.h>
 #else
   #define _POSIX_C_SOURCE 200809L
   #ifdef __APPLE__
@@ -25,14 +26,25 @@
   #include <netinet/in.h>
   #include <netinet/tcp.h>
   #include <arpa/inet.h>
+  #include <sys/uio.h>
+  #ifdef __linux__
+    #include <sys/sendfile.h>
+  #endif
+  #if defined(__linux__) && !defined(DYAD_NO_EPOLL)
+    #define DYAD_USE_EPOLL
+    #include <sys/epoll.h>
+  #endif
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include "dyad.h"
 
 #define DYAD_VERSION "0.1.0"
@@ -91,19 +103,26 @@ static void dyad_free(void *ptr) {
 /* Vector                                                                    */
 /*===========================================================================*/
 
-static void dyad_vectorExpand(
-  char **data, int *length, int *capacity, int memsz
+static void dyad_vectorReserve(
+  char **data, int *length, int *capacity, int memsz, int n
 ) {
-  if (*length + 1 > *capacity) {
+  if (*length + n > *capacity) {
     if (*capacity == 0) {
       *capacity = 1;
-    } else {
+    }
+    while (*length + n > *capacity) {
       *capacity <<= 1;
     }
     *data = dyad_realloc(*data, *capacity * memsz);
   }
 }
 
+static void dyad_vectorExpand(
+  char **data, int *length, int *capacity, int memsz
+) {
+  dyad_vectorReserve(data, length, capacity, memsz, 1);
+}
+
 static void dyad_vectorSplice(
   char **data, int *length, int *capacity, int memsz, int start, int count
 ) {
@@ -139,12 +158,334 @@ static void dyad_vectorSplice(
     (v)->data[(v)->length++] = (val) )
 
 
+#define dyad_vectorPushArr(v, arr, count)\
+  ( dyad_vectorReserve(dyad_vectorUnpack(v), (count)),\
+    memcpy((v)->data + (v)->length, (arr), (count) * sizeof(*(v)->data)),\
+    (v)->length += (count) )
+
+
 #define dyad_vectorSplice(v, start, count)\
   ( dyad_vectorSplice(dyad_vectorUnpack(v), start, count),\
     (v)->length -= (count) )
 
 
 
+/*===========================================================================*/
+/* Pool                                                                      */
+/*===========================================================================*/
+
+/* Free lists of fixed-size objects (streams and write buffer chunks), which
+ * save a malloc() and free() per object when connections come and go
+ * quickly. A pool keeps at most `max` spare objects; the spares are given
+ * back to the system once the pools have gone unused for a while (see
+ * dyad_updatePools()) */
+
+#define DYAD_POOL_IDLE_TIME 10
+
+typedef struct dyad_PoolItem dyad_PoolItem;
+
+struct dyad_PoolItem {
+  dyad_PoolItem *next;
+};
+
+typedef struct {
+  int size, max;
+  void (*destroy)(void*);   /* frees what a spare object still owns */
+  dyad_PoolItem *items;
+  int count;
+  int used;                 /* set on every alloc and free */
+  int64_t hits, misses;
+} dyad_Pool;
+
+
+static void dyad_poolRelease(dyad_Pool *pool, void *ptr) {
+  if (pool->destroy) pool->destroy(ptr);
+  dyad_free(ptr);
+}
+
+
+static void *dyad_poolAlloc(dyad_Pool *pool) {
+  dyad_PoolItem *item = pool->items;
+  pool->used = 1;
+  if (item) {
+    pool->items = item->next;
+    pool->count--;
+    pool->hits++;
+    return item;
+  }
+  pool->misses++;
+  item = dyad_realloc(NULL, pool->size);
+  memset(item, 0, pool->size);
+  return item;
+}
+
+
+static void dyad_poolFree(dyad_Pool *pool, void *ptr) {
+  dyad_PoolItem *item = ptr;
+  pool->used = 1;
+  if (pool->count >= pool->max) {
+    dyad_poolRelease(pool, ptr);
+    return;
+  }
+  item->next = pool->items;
+  pool->items = item;
+  pool->count++;
+}
+
+
+static void dyad_poolTrim(dyad_Pool *pool) {
+  while (pool->items) {
+    dyad_PoolItem *item = pool->items;
+    pool->items = item->next;
+    dyad_poolRelease(pool, item);
+  }
+  pool->count = 0;
+}
+
+
+
+/*===========================================================================*/
+/* WriteBuffer                                                               */
+/*===========================================================================*/
+
+/* The data waiting to be sent on a stream is kept as a queue of chunks.
+ * Writes are copied into the last chunk while it has room, otherwise a new
+ * chunk of at least DYAD_CHUNK_SIZE bytes is started. Buffers passed to
+ * dyad_writeRef() are queued as they are and handed back through their
+ * release callback once sent. Sent data is skipped by moving the head chunk's
+ * offset and the queue is flushed with writev(), so the cost of sending is
+ * linear in the size of the data however it was written. Files queued with
+ * dyad_writeFile() are chunks without data, sent from the page cache with
+ * sendfile() where there is one */
+
+#define DYAD_CHUNK_SIZE   16384
+#define DYAD_REF_MINSIZE  256   /* smaller references are copied instead */
+#define DYAD_IOV_MAX      64
+#define DYAD_POOL_MAX_CHUNKS  64    /* 1MB of spare chunks */
+#define DYAD_POOL_MAX_REFS    256
+
+typedef struct dyad_Chunk dyad_Chunk;
+
+struct dyad_Chunk {
+  dyad_Chunk *next;
+  char *data;         /* NULL for files */
+  int fd;             /* the file, whose offsets start and end are */
+  int start, end;     /* unsent data is data[start..end) */
+  int capacity;       /* 0 for references, which are never appended to */
+  dyad_ReleaseCallback release;
+  void *udata;
+};
+
+typedef struct {
+  dyad_Chunk *head, *tail;
+  int64_t length;
+  int64_t fileLength; /* of length, the part sent from files */
+} dyad_WriteBuffer;
+
+/* Chunks of DYAD_CHUNK_SIZE and the bare chunks used for references are
+ * pooled, larger chunks are allocated for the write they hold */
+static dyad_Pool dyad_chunkPool = {
+  sizeof(dyad_Chunk) + DYAD_CHUNK_SIZE, DYAD_POOL_MAX_CHUNKS, NULL
+};
+static dyad_Pool dyad_refPool = {
+  sizeof(dyad_Chunk), DYAD_POOL_MAX_REFS, NULL
+};
+
+/* Bytes waiting in the write buffers of all streams, and of these the bytes
+ * still in files rather than in memory */
+static int64_t dyad_bytesQueued;
+static int64_t dyad_fileBytesQueued;
+
+
+static void dyad_bufferAppendChunk(dyad_WriteBuffer *b, dyad_Chunk *chunk) {
+  if (b->tail) {
+    b->tail->next = chunk;
+  } else {
+    b->head = chunk;
+  }
+  b->tail = chunk;
+  b->length += chunk->end;
+  dyad_bytesQueued += chunk->end;
+}
+
+
+static void dyad_bufferFreeChunk(dyad_Chunk *chunk) {
+  if (chunk->release) {
+    chunk->release(chunk->udata);
+  }
+  if (chunk->capacity == 0) {
+    dyad_poolFree(&dyad_refPool, chunk);
+  } else if (chunk->capacity == DYAD_CHUNK_SIZE) {
+    dyad_poolFree(&dyad_chunkPool, chunk);
+  } else {
+    dyad_free(chunk);
+  }
+}
+
+
+static void dyad_bufferWrite(dyad_WriteBuffer *b, const void *data, int size) {
+  const char *p = data;
+  dyad_Chunk *chunk = b->tail;
+  /* Fill up the last chunk */
+  if (chunk && chunk->end < chunk->capacity) {
+    int n = chunk->capacity - chunk->end;
+    if (n > size) n = size;
+    memcpy(chunk->data + chunk->end, p, n);
+    chunk->end += n;
+    b->length += n;
+    dyad_bytesQueued += n;
+    p += n;
+    size -= n;
+  }
+  /* Put the rest in a new chunk */
+  if (size > 0) {
+    int capacity = size > DYAD_CHUNK_SIZE ? size : DYAD_CHUNK_SIZE;
+    if (capacity == DYAD_CHUNK_SIZE) {
+      chunk = dyad_poolAlloc(&dyad_chunkPool);
+    } else {
+      chunk = dyad_realloc(NULL, sizeof(*chunk) + capacity);
+    }
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->data = (char*) (chunk + 1);
+    chunk->capacity = capacity;
+    memcpy(chunk->data, p, size);
+    chunk->end = size;
+    dyad_bufferAppendChunk(b, chunk);
+  }
+}
+
+
+static void dyad_bufferWriteRef(
+  dyad_WriteBuffer *b, const void *data, int size,
+  dyad_ReleaseCallback release, void *udata
+) {
+  dyad_Chunk *chunk;
+  if (size < DYAD_REF_MINSIZE) {
+    dyad_bufferWrite(b, data, size);
+    if (release) release(udata);
+    return;
+  }
+  chunk = dyad_poolAlloc(&dyad_refPool);
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->data = (char*) data;
+  chunk->end = size;
+  chunk->release = release;
+  chunk->udata = udata;
+  dyad_bufferAppendChunk(b, chunk);
+}
+
+
+static void dyad_bufferWriteFile(
+  dyad_WriteBuffer *b, int fd, int offset, int size,
+  dyad_ReleaseCallback release, void *udata
+) {
+  dyad_Chunk *chunk = dyad_poolAlloc(&dyad_refPool);
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->fd = fd;
+  chunk->start = offset;
+  chunk->end = offset + size;
+  chunk->release = release;
+  chunk->udata = udata;
+  /* Only the part still to send counts as queued */
+  b->length -= offset;
+  dyad_bytesQueued -= offset;
+  dyad_bufferAppendChunk(b, chunk);
+  b->fileLength += size;
+  dyad_fileBytesQueued += size;
+}
+
+
+static void dyad_bufferConsume(dyad_WriteBuffer *b, int size) {
+  b->length -= size;
+  dyad_bytesQueued -= size;
+  while (size > 0) {
+    dyad_Chunk *chunk = b->head;
+    int n = chunk->end - chunk->start;
+    if (!chunk->data) {
+      int sent = size < n ? size : n;
+      b->fileLength -= sent;
+      dyad_fileBytesQueued -= sent;
+    }
+    if (size < n) {
+      chunk->start += size;
+      return;
+    }
+    size -= n;
+    b->head = chunk->next;
+    if (!b->head) b->tail = NULL;
+    dyad_bufferFreeChunk(chunk);
+  }
+}
+
+
+static void dyad_bufferClear(dyad_WriteBuffer *b) {
+  while (b->head) {
+    dyad_Chunk *chunk = b->head;
+    b->head = chunk->next;
+    dyad_bufferFreeChunk(chunk);
+  }
+  b->tail = NULL;
+  dyad_bytesQueued -= b->length;
+  dyad_fileBytesQueued -= b->fileLength;
+  b->length = 0;
+  b->fileLength = 0;
+}
+
+
+static int dyad_bufferSendFile(dyad_Chunk *chunk, int sockfd) {
+  int n = chunk->end - chunk->start;
+#ifdef __linux__
+  off_t offset = chunk->start;
+  n = (int) sendfile(sockfd, chunk->fd, &offset, n);
+#else
+  /* Without sendfile() the file is read in pieces and sent as usual */
+  char buf[DYAD_CHUNK_SIZE];
+  if (n > (int) sizeof(buf)) n = sizeof(buf);
+#ifdef _WIN32
+  if (_lseek(chunk->fd, chunk->start, SEEK_SET) < 0) return -1;
+  n = _read(chunk->fd, buf, n);
+#else
+  n = (int) pread(chunk->fd, buf, n, chunk->start);
+#endif
+  if (n > 0) n = send(sockfd, buf, n, 0);
+#endif
+  if (n == 0) {
+    /* The file was truncated; treat it like a broken connection */
+    errno = EIO;
+    return -1;
+  }
+  return n;
+}
+
+
+static int dyad_bufferSend(dyad_WriteBuffer *b, int sockfd) {
+#ifdef _WIN32
+  dyad_Chunk *chunk = b->head;
+  if (!chunk->data) {
+    return dyad_bufferSendFile(chunk, sockfd);
+  }
+  return send(sockfd, chunk->data + chunk->start,
+              chunk->end - chunk->start, 0);
+#else
+  struct iovec iov[DYAD_IOV_MAX];
+  dyad_Chunk *chunk;
+  int n = 0;
+  if (!b->head->data) {
+    return dyad_bufferSendFile(b->head, sockfd);
+  }
+  /* The data before the next file goes out in one writev() */
+  for (chunk = b->head; chunk && chunk->data && n < DYAD_IOV_MAX;
+       chunk = chunk->next) {
+    iov[n].iov_base = chunk->data + chunk->start;
+    iov[n].iov_len = chunk->end - chunk->start;
+    n++;
+  }
+  return (int) writev(sockfd, iov, n);
+#endif
+}
+
+
+
 /*===========================================================================*/
 /* SelectSet                                                                 */
 /*===========================================================================*/
@@ -256,6 +597,41 @@ static int dyad_selectHas(dyad_SelectSet *s, int set, int fd) {
 }
 
 
+/*===========================================================================*/
+/* Epoll                                                                     */
+/*===========================================================================*/
+
+/* On Linux the streams' sockets are registered with an edge-triggered epoll
+ * instance. A stream's registration is only touched when the set of events it
+ * is interested in changes -- when it starts listening or connecting, when its
+ * write buffer becomes non-empty or is drained, and when it starts closing --
+ * so a call to dyad_update() costs O(ready fds) instead of O(streams). If the
+ * epoll instance can't be created the select() path is used instead.
+ */
+
+#ifdef DYAD_USE_EPOLL
+  #define DYAD_EPOLL_MAXEVENTS 256
+#endif
+
+static int dyad_epollFd = -1;
+
+
+static void dyad_epollInit(void) {
+#ifdef DYAD_USE_EPOLL
+  dyad_epollFd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+
+static void dyad_epollDeinit(void) {
+  if (dyad_epollFd != -1) {
+    close(dyad_epollFd);
+    dyad_epollFd = -1;
+  }
+}
+
+
+
 /*===========================================================================*/
 /* Core                                                                      */
 /*===========================================================================*/
@@ -270,21 +646,45 @@ typedef struct {
 struct dyad_Stream {
   int state, flags;
   int sockfd;
-  char *address;
+  unsigned pollEvents;
+  char address[46];
   int port;
-  int bytesSent, bytesReceived;
+  int64_t bytesSent, bytesReceived;
   double lastActivity, timeout;
+  double deadline;    /* key in the timer heap */
+  int timerIndex;     /* position in the timer heap, -1 if not in it */
+  dyad_WriteBuffer writeBuffer;
+  int lowWatermark;   /* READY is emitted once no more than this is queued */
+  int highWatermark;  /* dyad_isFull() once this much is held in memory */
+  int lineScan;       /* lineBuffer bytes searched for a line end already */
+  dyad_Stream *next, *prev;
+  dyad_Stream *nextWritten;
+  dyad_Stream *nextClosed;
+  /* The vectors' memory is kept when a stream is recycled through the pool,
+   * so they must stay at the end of the struct (see dyad_newStream()) */
   dyad_Vector(dyad_Listener) listeners;
   dyad_Vector(char) lineBuffer;
-  dyad_Vector(char) writeBuffer;
-  dyad_Stream *next;
 };
 
+#define DYAD_POOL_MAX_STREAMS     1024
+#define DYAD_POOL_MAX_LINEBUFFER  65536   /* larger line buffers are freed */
+
 #define DYAD_FLAG_READY   (1 << 0)
 #define DYAD_FLAG_WRITTEN (1 << 1)
+#define DYAD_FLAG_PENDING (1 << 2)
+#define DYAD_FLAG_REUSEPORT (1 << 3)
+#define DYAD_FLAG_REAP    (1 << 4)
+#define DYAD_FLAG_STALLED (1 << 5)
+#define DYAD_FLAG_ACCEPT  (1 << 6)
+#define DYAD_FLAG_NOREAD  (1 << 7)
+
+/* Seconds after which a listener whose accept() failed tries again */
+#define DYAD_ACCEPT_RETRY_TIME  0.5
 
 
 static dyad_Stream *dyad_streams;
+static dyad_Stream *dyad_writtenStreams;
+static dyad_Stream *dyad_closedStreams;
 static int dyad_streamCount;
 static char dyad_panicMsgBuffer[128];
 static dyad_PanicCallback dyad_panicCallback;
@@ -292,6 +692,29 @@ static dyad_SelectSet dyad_selectSet;
 static double dyad_updateTimeout = 1;
 static double dyad_tickInterval = 1;
 static double dyad_lastTick = 0;
+static double dyad_now = 0;
+static dyad_Vector(dyad_Stream*) dyad_timers;
+static double dyad_poolLastUsed = 0;
+static double dyad_waitTime = 0;
+static int dyad_bufferLimit = 0;
+static int dyad_bufferPolicy = DYAD_BUFFER_STALL;
+static int dyad_stalled = 0;
+static double dyad_acceptRetry = 0;
+
+
+static void dyad_streamFreeBuffers(void *ptr) {
+  dyad_Stream *stream = ptr;
+  dyad_vectorDeinit(&stream->listeners);
+  dyad_vectorDeinit(&stream->lineBuffer);
+}
+
+static dyad_Pool dyad_streamPool = {
+  sizeof(dyad_Stream), DYAD_POOL_MAX_STREAMS, dyad_streamFreeBuffers
+};
+
+static dyad_Pool *dyad_pools[] = {
+  &dyad_streamPool, &dyad_chunkPool, &dyad_refPool
+};
 
 
 static void dyad_panic(const char *fmt, ...) {
@@ -323,17 +746,40 @@ static const char *dyad_intToStr(int x) {
 }
 
 
+static double dyad_updateClock(void) {
+  /* Monotonic time, read once per update rather than by everything which
+   * needs to know the time */
+#ifdef _WIN32
+  dyad_now = dyad_getTime();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  dyad_now = ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  return dyad_now;
+}
+
+
 static void dyad_destroyStream(dyad_Stream *stream);
 
+static void dyad_markClosed(dyad_Stream *stream) {
+  /* Closed streams are queued to be destroyed at the start of the next
+   * update, so only they have to be looked at then */
+  if (stream->flags & DYAD_FLAG_REAP) return;
+  stream->flags |= DYAD_FLAG_REAP;
+  stream->nextClosed = dyad_closedStreams;
+  dyad_closedStreams = stream;
+}
+
+
 static void dyad_destroyClosedStreams(void) {
-  dyad_Stream *stream = dyad_streams;
-  while (stream) {
+  while (dyad_closedStreams) {
+    dyad_Stream *stream = dyad_closedStreams;
+    dyad_closedStreams = stream->nextClosed;
+    stream->flags &= ~DYAD_FLAG_REAP;
+    /* A new stream is queued too, but may have been opened since */
     if (stream->state == DYAD_STATE_CLOSED) {
-      dyad_Stream *next = stream->next;
       dyad_destroyStream(stream);
-      stream = next;
-    } else {
-      stream = stream->next;
     }
   }
 }
@@ -342,11 +788,15 @@ static void dyad_destroyClosedStreams(void) {
 static void dyad_emitEvent(dyad_Stream *stream, dyad_Event *e);
 
 static void dyad_updateTickTimer(void) {
+  /* A tick interval of zero disables tick events */
+  if (dyad_tickInterval <= 0) {
+    return;
+  }
   /* Update tick timer */
   if (dyad_lastTick == 0) {
-    dyad_lastTick = dyad_getTime();
+    dyad_lastTick = dyad_now;
   }
-  while (dyad_lastTick < dyad_getTime()) {
+  while (dyad_lastTick < dyad_now) {
     /* Emit event on all streams */
     dyad_Stream *stream;
     dyad_Event e = dyad_createEvent(DYAD_EVENT_TICK);
@@ -361,48 +811,236 @@ static void dyad_updateTickTimer(void) {
 }
 
 
+/* Streams with a timeout are kept in a binary min-heap ordered by deadline,
+ * so only the streams which are due have to be looked at. Activity on a
+ * stream just updates its lastActivity; the deadline in the heap is moved
+ * forward lazily when it comes up */
+
+static void dyad_timerSet(dyad_Stream *stream, int i) {
+  dyad_timers.data[i] = stream;
+  stream->timerIndex = i;
+}
+
+
+static void dyad_timerSiftUp(int i) {
+  dyad_Stream *stream = dyad_timers.data[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (dyad_timers.data[parent]->deadline <= stream->deadline) break;
+    dyad_timerSet(dyad_timers.data[parent], i);
+    i = parent;
+  }
+  dyad_timerSet(stream, i);
+}
+
+
+static void dyad_timerSiftDown(int i) {
+  dyad_Stream *stream = dyad_timers.data[i];
+  for (;;) {
+    int child = i * 2 + 1;
+    if (child >= dyad_timers.length) break;
+    if (child + 1 < dyad_timers.length &&
+        dyad_timers.data[child + 1]->deadline <
+          dyad_timers.data[child]->deadline
+    ) {
+      child++;
+    }
+    if (stream->deadline <= dyad_timers.data[child]->deadline) break;
+    dyad_timerSet(dyad_timers.data[child], i);
+    i = child;
+  }
+  dyad_timerSet(stream, i);
+}
+
+
+static void dyad_timerSchedule(dyad_Stream *stream) {
+  stream->deadline = stream->lastActivity + stream->timeout;
+  if (stream->timerIndex == -1) {
+    dyad_vectorPush(&dyad_timers, stream);
+    stream->timerIndex = dyad_timers.length - 1;
+  }
+  dyad_timerSiftUp(stream->timerIndex);
+  dyad_timerSiftDown(stream->timerIndex);
+}
+
+
+static void dyad_timerCancel(dyad_Stream *stream) {
+  int i = stream->timerIndex;
+  dyad_Stream *last;
+  if (i == -1) return;
+  stream->timerIndex = -1;
+  last = dyad_timers.data[--dyad_timers.length];
+  if (last != stream) {
+    /* Move the last stream into the hole and restore the heap order */
+    dyad_timerSet(last, i);
+    dyad_timerSiftUp(i);
+    dyad_timerSiftDown(last->timerIndex);
+  }
+}
+
+
 static void dyad_updateStreamTimeouts(void) {
-  double currentTime = dyad_getTime();
-  dyad_Stream *stream;
   dyad_Event e = dyad_createEvent(DYAD_EVENT_TIMEOUT);
   e.msg = "stream timed out";
-  stream = dyad_streams;
-  while (stream) {
-    if (stream->timeout) {
-      if (currentTime - stream->lastActivity > stream->timeout) {
-        dyad_emitEvent(stream, &e);
-        dyad_close(stream);
+  while (dyad_timers.length > 0 && dyad_timers.data[0]->deadline < dyad_now) {
+    dyad_Stream *stream = dyad_timers.data[0];
+    if (stream->lastActivity + stream->timeout >= dyad_now) {
+      /* There was activity since the timer was set, move it forward */
+      stream->deadline = stream->lastActivity + stream->timeout;
+      dyad_timerSiftDown(0);
+      continue;
+    }
+    dyad_timerCancel(stream);
+    dyad_emitEvent(stream, &e);
+    dyad_close(stream);
+  }
+}
+
+
+static void dyad_acceptPendingConnections(dyad_Stream *stream);
+
+static void dyad_retryAccepts(void) {
+  dyad_Stream *stream;
+  if (dyad_acceptRetry == 0 || dyad_now < dyad_acceptRetry) return;
+  dyad_acceptRetry = 0;
+  for (stream = dyad_streams; stream; stream = stream->next) {
+    if (stream->flags & DYAD_FLAG_ACCEPT) {
+      stream->flags &= ~DYAD_FLAG_ACCEPT;
+      if (stream->state == DYAD_STATE_LISTENING) {
+        dyad_acceptPendingConnections(stream);
       }
     }
-    stream = stream->next;
   }
 }
 
 
+static void dyad_updatePools(void) {
+  /* Give the spare objects back once the pools have gone unused for
+   * DYAD_POOL_IDLE_TIME seconds, so a burst of connections doesn't pin its
+   * memory forever */
+  int i, n = sizeof(dyad_pools) / sizeof(*dyad_pools);
+  for (i = 0; i < n; i++) {
+    if (dyad_pools[i]->used) {
+      dyad_pools[i]->used = 0;
+      dyad_poolLastUsed = dyad_now;
+    }
+  }
+  if (dyad_now - dyad_poolLastUsed >= DYAD_POOL_IDLE_TIME) {
+    for (i = 0; i < n; i++) {
+      dyad_poolTrim(dyad_pools[i]);
+    }
+  }
+}
+
+
+static int dyad_hasPooledItems(void) {
+  int i, n = sizeof(dyad_pools) / sizeof(*dyad_pools);
+  for (i = 0; i < n; i++) {
+    if (dyad_pools[i]->count > 0) return 1;
+  }
+  return 0;
+}
+
+
+static double dyad_getWaitTimeout(void) {
+  /* Don't wait past the next tick or timeout */
+  double next = dyad_getNextTimeout();
+  if (next >= 0 && next < dyad_updateTimeout) {
+    return next;
+  }
+  return dyad_updateTimeout;
+}
+
+
 
 /*===========================================================================*/
 /* Stream                                                                    */
 /*===========================================================================*/
 
+static void dyad_epollUpdate(dyad_Stream *stream) {
+#ifdef DYAD_USE_EPOLL
+  struct epoll_event ev;
+  unsigned events = 0;
+  int op;
+  if (dyad_epollFd == -1 || stream->sockfd == -1) return;
+  switch (stream->state) {
+    case DYAD_STATE_CONNECTED:
+      if (!(stream->flags & DYAD_FLAG_NOREAD)) {
+        events = EPOLLIN;
+      }
+      if (!(stream->flags & DYAD_FLAG_READY) ||
+          stream->writeBuffer.length != 0
+      ) {
+        events |= EPOLLOUT;
+      }
+      break;
+    case DYAD_STATE_CLOSING:
+    case DYAD_STATE_CONNECTING:
+      events = EPOLLOUT;
+      break;
+    case DYAD_STATE_LISTENING:
+      events = EPOLLIN;
+      break;
+  }
+  if (events == stream->pollEvents) return;
+  if (events == 0) {
+    op = EPOLL_CTL_DEL;
+  } else if (stream->pollEvents == 0) {
+    op = EPOLL_CTL_ADD;
+  } else {
+    op = EPOLL_CTL_MOD;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events | EPOLLET;
+  ev.data.ptr = stream;
+  epoll_ctl(dyad_epollFd, op, stream->sockfd, &ev);
+  stream->pollEvents = events;
+#else
+  (void) stream;
+#endif
+}
+
+
+static void dyad_epollRemove(dyad_Stream *stream) {
+#ifdef DYAD_USE_EPOLL
+  struct epoll_event ev;
+  if (dyad_epollFd == -1 || stream->pollEvents == 0) return;
+  /* A non-NULL event is passed for the sake of kernels older than 2.6.9 */
+  memset(&ev, 0, sizeof(ev));
+  epoll_ctl(dyad_epollFd, EPOLL_CTL_DEL, stream->sockfd, &ev);
+  stream->pollEvents = 0;
+#else
+  (void) stream;
+#endif
+}
+
+
 static void dyad_destroyStream(dyad_Stream *stream) {
-  dyad_Stream **next;
+  dyad_timerCancel(stream);
   /* Close socket */
   if (stream->sockfd != -1) {
     close(stream->sockfd);
   }
   /* Remove from list and decrement count */
-  next = &dyad_streams;
-  while (*next != stream) {
-    next = &(*next)->next;
+  if (stream->prev) {
+    stream->prev->next = stream->next;
+  } else {
+    dyad_streams = stream->next;
+  }
+  if (stream->next) {
+    stream->next->prev = stream->prev;
   }
-  *next = stream->next;
   dyad_streamCount--;
-  /* Destroy and free */
-  dyad_vectorDeinit(&stream->listeners);
-  dyad_vectorDeinit(&stream->lineBuffer);
-  dyad_vectorDeinit(&stream->writeBuffer);
-  dyad_free(stream->address);
-  dyad_free(stream);
+  /* Destroy and return to the pool; the listener and line buffers' memory
+   * is kept for the next stream unless the line buffer grew large */
+  dyad_bufferClear(&stream->writeBuffer);
+  dyad_vectorClear(&stream->listeners);
+  dyad_vectorClear(&stream->lineBuffer);
+  if (stream->lineBuffer.capacity > DYAD_POOL_MAX_LINEBUFFER) {
+    dyad_vectorDeinit(&stream->lineBuffer);
+    dyad_vectorInit(&stream->lineBuffer);
+  }
+  dyad_poolFree(&dyad_streamPool, stream);
 }
 
 
@@ -444,17 +1082,17 @@ static void dyad_initAddress(dyad_Stream *stream) {
   socklen_t size;
   memset(&addr, 0, sizeof(addr));
   size = sizeof(addr);
-  dyad_free(stream->address);
+  stream->address[0] = '\0';
   if (getpeername(stream->sockfd, &addr.sa, &size) == -1) {
     return;
   }
   if (addr.sas.ss_family == AF_INET6) {
-    stream->address = dyad_realloc(NULL, 46);
-    inet_ntop(AF_INET6, &addr.sai6.sin6_addr, stream->address, 45);
+    inet_ntop(AF_INET6, &addr.sai6.sin6_addr, stream->address,
+              sizeof(stream->address));
     stream->port = ntohs(addr.sai6.sin6_port);
   } else {
-    stream->address = dyad_realloc(NULL, 16);
-    inet_ntop(AF_INET, &addr.sai.sin_addr, stream->address, 15);
+    inet_ntop(AF_INET, &addr.sai.sin_addr, stream->address,
+              sizeof(stream->address));
     stream->port = ntohs(addr.sai.sin_port);
   }
 }
@@ -502,12 +1140,58 @@ static int dyad_hasListenerForEvent(dyad_Stream *stream, int event) {
 }
 
 
+static void dyad_emitLines(dyad_Stream *stream, const char *data, int size) {
+  int start = 0;
+  char *buf, *nl;
+  dyad_vectorPushArr(&stream->lineBuffer, data, size);
+  buf = stream->lineBuffer.data;
+  /* Only the bytes after lineScan can hold a line end; memchr() does the
+   * search a word or vector at a time (libc picks the SSE2/AVX2 version for
+   * the CPU at load time) */
+  while ((nl = memchr(buf + stream->lineScan, '\n',
+                      stream->lineBuffer.length - stream->lineScan))) {
+    dyad_Event e;
+    int i = nl - buf;
+    buf[i] = '\0';
+    e = dyad_createEvent(DYAD_EVENT_LINE);
+    e.msg = "received line";
+    e.data = &buf[start];
+    e.size = i - start;
+    /* Check and strip carriage return */
+    if (e.size > 0 && e.data[e.size - 1] == '\r') {
+      e.data[--e.size] = '\0';
+    }
+    start = i + 1;
+    stream->lineScan = start;
+    dyad_emitEvent(stream, &e);
+    /* Check stream state in case it was closed during one of the line event
+     * handlers. */
+    if (stream->state != DYAD_STATE_CONNECTED) {
+      return;
+    }
+  }
+  /* Keep the partial line, the next search starts after it */
+  if (start == stream->lineBuffer.length) {
+    dyad_vectorClear(&stream->lineBuffer);
+  } else if (start > 0) {
+    dyad_vectorSplice(&stream->lineBuffer, 0, start);
+  }
+  stream->lineScan = stream->lineBuffer.length;
+}
+
+
 static void dyad_handleReceivedData(dyad_Stream *stream) {
   for (;;) {
     /* Receive data */
     dyad_Event e;
     char data[8192];
-    int size = recv(stream->sockfd, data, sizeof(data) - 1, 0);
+    int size;
+    /* Reading may have been paused by one of the data event handlers; the
+     * rest stays in the socket until it is resumed */
+    if (stream->flags & DYAD_FLAG_NOREAD) {
+      return;
+    }
+    size = recv(stream->sockfd, data, sizeof(data) - 1, 0);
     if (size <= 0) {
       if (size == 0 || errno != EWOULDBLOCK) {
         /* Handle disconnect */
@@ -527,7 +1211,7 @@ static void dyad_handleReceivedData(dyad_Stream *stream) {
     dyad_emitEvent(stream, &e);
     /* Update status */
     stream->bytesReceived += size;
-    stream->lastActivity = dyad_getTime();
+    stream->lastActivity = dyad_now;
     /* Check stream state in case it was closed during one of the data event
      * handlers. */
     if (stream->state != DYAD_STATE_CONNECTED) {
@@ -536,56 +1220,56 @@ static void dyad_handleReceivedData(dyad_Stream *stream) {
 
     /* Handle line event */
     if (dyad_hasListenerForEvent(stream, DYAD_EVENT_LINE)) {
-      int i, start;
-      char *buf;
-      for (i = 0; i < size; i++) {
-        dyad_vectorPush(&stream->lineBuffer, data[i]);
-      }
-      start = 0;
-      buf = stream->lineBuffer.data;
-      for (i = 0; i < stream->lineBuffer.length; i++) {
-        if (buf[i] == '\n') {
-          dyad_Event e;
-          buf[i] = '\0';
-          e = dyad_createEvent(DYAD_EVENT_LINE);
-          e.msg = "received line";
-          e.data = &buf[start];
-          e.size = i - start;
-          /* Check and strip carriage return */
-          if (e.size > 0 && e.data[e.size - 1] == '\r') {
-            e.data[--e.size] = '\0';
-          }
-          dyad_emitEvent(stream, &e);
-          start = i + 1;
-          /* Check stream state in case it was closed during one of the line
-           * event handlers. */
-          if (stream->state != DYAD_STATE_CONNECTED) {
-            return;
-          }
-        }
-      }
-      if (start == stream->lineBuffer.length) {
-        dyad_vectorClear(&stream->lineBuffer);
-      } else {
-        dyad_vectorSplice(&stream->lineBuffer, 0, start);
+      dyad_emitLines(stream, data, size);
+      if (stream->state != DYAD_STATE_CONNECTED) {
+        return;
       }
     }
   }
 }
 
 
+static int dyad_isTransientAcceptError(int err) {
+  /* The connection was interrupted or went away before it was accepted; the
+   * ones behind it in the backlog can still be */
+  if (err == EINTR) return 1;
+#ifdef ECONNABORTED
+  if (err == ECONNABORTED) return 1;
+#endif
+#ifdef EPROTO
+  if (err == EPROTO) return 1;
+#endif
+  return 0;
+}
+
+
 static void dyad_acceptPendingConnections(dyad_Stream *stream) {
   for (;;) {
     dyad_Stream *remote;
     dyad_Event e;
-    int err = 0;
     int sockfd = accept(stream->sockfd, NULL, NULL);
     if (sockfd == -1) {
-      err = errno;
+      char buf[256];
+      int err = errno;
       if (err == EWOULDBLOCK) {
         /* No more waiting sockets */
         return;
       }
+      if (dyad_isTransientAcceptError(err)) {
+        continue;
+      }
+      /* Out of file descriptors or memory, most likely. The backlog is
+       * tried again later; with edge-triggered polling no new event comes
+       * for the connections already waiting in it */
+      stream->flags |= DYAD_FLAG_ACCEPT;
+      if (dyad_acceptRetry == 0) {
+        dyad_acceptRetry = dyad_now + DYAD_ACCEPT_RETRY_TIME;
+      }
+      sprintf(buf, "could not accept connection (%s)", strerror(err));
+      e = dyad_createEvent(DYAD_EVENT_ERROR);
+      e.msg = buf;
+      dyad_emitEvent(stream, &e);
+      return;
     }
     /* Create client stream */
     remote = dyad_newStream();
@@ -597,77 +1281,163 @@ static void dyad_acceptPendingConnections(dyad_Stream *stream) {
     e.msg = "accepted connection";
     e.remote = remote;
     dyad_emitEvent(stream, &e);
-    /* Handle invalid socket -- the stream is still made and the ACCEPT event
-     * is still emitted, but its shut immediately with an error */
-    if (remote->sockfd == -1) {
-      dyad_streamError(remote, "failed to create socket on accept", err);
-      return;
-    }
+    dyad_epollUpdate(remote);
+  }
+}
+
+
+static void dyad_markWritten(dyad_Stream *stream) {
+  stream->flags |= DYAD_FLAG_WRITTEN;
+  if (!(stream->flags & DYAD_FLAG_PENDING)) {
+    stream->flags |= DYAD_FLAG_PENDING;
+    stream->nextWritten = dyad_writtenStreams;
+    dyad_writtenStreams = stream;
   }
+  dyad_epollUpdate(stream);
 }
 
 
 static int dyad_flushWriteBuffer(dyad_Stream *stream) {
+  int full = 0;
   stream->flags &= ~DYAD_FLAG_WRITTEN;
-  if (stream->writeBuffer.length > 0) {
-    /* Send data */
-    int size = send(stream->sockfd, stream->writeBuffer.data,
-                    stream->writeBuffer.length, 0);
+  /* Send data until it's all gone or the socket's buffer is full; with
+   * edge-triggered polling we won't be told again otherwise */
+  while (stream->writeBuffer.length > 0) {
+    int size = dyad_bufferSend(&stream->writeBuffer, stream->sockfd);
     if (size <= 0) {
       if (errno == EWOULDBLOCK) {
         /* No more data can be written */
-        return 0;
+        full = 1;
+        break;
       } else {
         /* Handle disconnect */
         dyad_close(stream);
         return 0;
       }
     }
-    if (size == stream->writeBuffer.length) {
-      dyad_vectorClear(&stream->writeBuffer);
-    } else {
-      dyad_vectorSplice(&stream->writeBuffer, 0, size);
-    }
+    dyad_bufferConsume(&stream->writeBuffer, size);
     /* Update status */
     stream->bytesSent += size;
-    stream->lastActivity = dyad_getTime();
+    stream->lastActivity = dyad_now;
+  }
+
+  /* If this is a 'closing' stream we can properly close it now */
+  if (stream->writeBuffer.length == 0 &&
+      stream->state == DYAD_STATE_CLOSING
+  ) {
+    dyad_close(stream);
+    return 0;
   }
 
-  if (stream->writeBuffer.length == 0) {
+  /* Ask for more data once the buffer has drained to the low watermark, so a
+   * stream being fed in pieces doesn't run dry while the next one is made */
+  if (stream->writeBuffer.length <= stream->lowWatermark &&
+      stream->state == DYAD_STATE_CONNECTED
+  ) {
     dyad_Event e;
-    /* If this is a 'closing' stream we can properly close it now */
-    if (stream->state == DYAD_STATE_CLOSING) {
-      dyad_close(stream);
-      return 0;
-    }
     /* Set ready flag and emit 'ready for data' event */
     stream->flags |= DYAD_FLAG_READY;
     e = dyad_createEvent(DYAD_EVENT_READY);
     e.msg = "stream is ready for more data";
     dyad_emitEvent(stream, &e);
+    if (stream->state == DYAD_STATE_CLOSED) {
+      return 0;
+    }
   }
+  /* Stop (or keep) watching for writability depending on whether anything is
+   * left in the write buffer */
+  dyad_epollUpdate(stream);
   /* Return 1 to indicate that more data can immediately be written to the
    * stream's socket */
-  return 1;
+  return !full;
 }
 
 
 
-/*===========================================================================*/
-/* API                                                                       */
-/*===========================================================================*/
 
-/*---------------------------------------------------------------------------*/
-/* Core                                                                      */
-/*---------------------------------------------------------------------------*/
+static void dyad_handleStream(
+  dyad_Stream *stream, int canRead, int canWrite, int hasExcept
+) {
+  switch (stream->state) {
 
-void dyad_update(void) {
+    case DYAD_STATE_CONNECTED:
+      if (canRead) {
+        dyad_handleReceivedData(stream);
+        if (stream->state == DYAD_STATE_CLOSED) {
+          break;
+        }
+      }
+      /* Fall through */
+
+    case DYAD_STATE_CLOSING:
+      if (canWrite) {
+        dyad_flushWriteBuffer(stream);
+      }
+      break;
+
+    case DYAD_STATE_CONNECTING:
+      if (canWrite) {
+        /* Check socket for error */
+        int optval = 0;
+        socklen_t optlen = sizeof(optval);
+        dyad_Event e;
+        getsockopt(stream->sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+        if (optval != 0) goto connectFailed;
+        /* Handle succeselful connection */
+        stream->state = DYAD_STATE_CONNECTED;
+        stream->lastActivity = dyad_now;
+        dyad_initAddress(stream);
+        dyad_epollUpdate(stream);
+        /* Emit connect event */
+        e = dyad_createEvent(DYAD_EVENT_CONNECT);
+        e.msg = "connected to server";
+        dyad_emitEvent(stream, &e);
+      } else if (hasExcept) {
+        /* Handle failed connection */
+        connectFailed:
+        dyad_streamError(stream, "could not connect to server", 0);
+      }
+      break;
+
+    case DYAD_STATE_LISTENING:
+      if (canRead) {
+        dyad_acceptPendingConnections(stream);
+      }
+      break;
+  }
+
+  /* If data was just now written to the stream we should immediately try to
+   * send it */
+  if (stream->flags & DYAD_FLAG_WRITTEN &&
+      stream->state != DYAD_STATE_CLOSED
+  ) {
+    dyad_flushWriteBuffer(stream);
+  }
+}
+
+
+static void dyad_flushWrittenStreams(void) {
+  /* Streams which were written to outside of their own event handlers (or
+   * outside of dyad_update() altogether) may not have a pending writability
+   * notification, so we try to send their data here */
+  while (dyad_writtenStreams) {
+    dyad_Stream *stream = dyad_writtenStreams;
+    dyad_writtenStreams = stream->nextWritten;
+    stream->nextWritten = NULL;
+    stream->flags &= ~DYAD_FLAG_PENDING;
+    if (stream->flags & DYAD_FLAG_WRITTEN &&
+        stream->state != DYAD_STATE_CLOSED
+    ) {
+      dyad_flushWriteBuffer(stream);
+    }
+  }
+}
+
+
+static void dyad_updateSelect(void) {
   dyad_Stream *stream;
   struct timeval tv;
-
-  dyad_destroyClosedStreams();
-  dyad_updateTickTimer();
-  dyad_updateStreamTimeouts();
+  double timeout, waitStart;
 
   /* Create fd sets for select() */
   dyad_selectZero(&dyad_selectSet);
@@ -676,7 +1446,9 @@ void dyad_update(void) {
   while (stream) {
     switch (stream->state) {
       case DYAD_STATE_CONNECTED:
-        dyad_selectAdd(&dyad_selectSet, DYAD_SET_READ, stream->sockfd);
+        if (!(stream->flags & DYAD_FLAG_NOREAD)) {
+          dyad_selectAdd(&dyad_selectSet, DYAD_SET_READ, stream->sockfd);
+        }
         if (!(stream->flags & DYAD_FLAG_READY) ||
             stream->writeBuffer.length != 0
         ) {
@@ -698,77 +1470,135 @@ void dyad_update(void) {
   }
 
   /* Init timeout value and do select */
-  tv.tv_sec = dyad_updateTimeout;
-  tv.tv_usec = (dyad_updateTimeout - tv.tv_sec) * 1e6;
+  timeout = dyad_getWaitTimeout();
+  tv.tv_sec = timeout;
+  tv.tv_usec = (timeout - tv.tv_sec) * 1e6;
 
+  waitStart = dyad_updateClock();
   select(dyad_selectSet.maxfd + 1,
          dyad_selectSet.fds[DYAD_SET_READ],
          dyad_selectSet.fds[DYAD_SET_WRITE],
          dyad_selectSet.fds[DYAD_SET_EXCEPT],
          &tv);
+  dyad_waitTime += dyad_updateClock() - waitStart;
 
   /* Handle streams */
   stream = dyad_streams;
   while (stream) {
-    switch (stream->state) {
+    int fd = stream->sockfd;
+    if (stream->state != DYAD_STATE_CLOSED) {
+      dyad_handleStream(stream,
+        dyad_selectHas(&dyad_selectSet, DYAD_SET_READ, fd),
+        dyad_selectHas(&dyad_selectSet, DYAD_SET_WRITE, fd),
+        dyad_selectHas(&dyad_selectSet, DYAD_SET_EXCEPT, fd));
+    }
+    stream = stream->next;
+  }
+}
 
-      case DYAD_STATE_CONNECTED:
-        if (dyad_selectHas(&dyad_selectSet, DYAD_SET_READ, stream->sockfd)) {
-          dyad_handleReceivedData(stream);
-          if (stream->state == DYAD_STATE_CLOSED) {
-            break;
-          }
-        }
-        /* Fall through */
 
-      case DYAD_STATE_CLOSING:
-        if (dyad_selectHas(&dyad_selectSet, DYAD_SET_WRITE, stream->sockfd)) {
-          dyad_flushWriteBuffer(stream);
-        }
-        break;
+#ifdef DYAD_USE_EPOLL
+static void dyad_updateEpoll(void) {
+  struct epoll_event events[DYAD_EPOLL_MAXEVENTS];
+  int i, n;
+  double timeout = dyad_getWaitTimeout();
+  double waitStart = dyad_updateClock();
 
-      case DYAD_STATE_CONNECTING:
-        if (dyad_selectHas(&dyad_selectSet, DYAD_SET_WRITE, stream->sockfd)) {
-          /* Check socket for error */
-          int optval = 0;
-          socklen_t optlen = sizeof(optval);
-          dyad_Event e;
-          getsockopt(stream->sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
-          if (optval != 0) goto connectFailed;
-          /* Handle succeselful connection */
-          stream->state = DYAD_STATE_CONNECTED;
-          stream->lastActivity = dyad_getTime();
-          dyad_initAddress(stream);
-          /* Emit connect event */
-          e = dyad_createEvent(DYAD_EVENT_CONNECT);
-          e.msg = "connected to server";
-          dyad_emitEvent(stream, &e);
-        } else if (
-          dyad_selectHas(&dyad_selectSet, DYAD_SET_EXCEPT, stream->sockfd)
+  /* Round the timeout up so we don't wake up just before it expires */
+  n = epoll_wait(dyad_epollFd, events, DYAD_EPOLL_MAXEVENTS,
+                 (int) (timeout * 1000 + 0.999));
+  dyad_waitTime += dyad_updateClock() - waitStart;
+
+  /* Streams are only destroyed at the start of dyad_update(), so the pointers
+   * returned here stay valid even if a handler closes one of them */
+  for (i = 0; i < n; i++) {
+    dyad_Stream *stream = events[i].data.ptr;
+    unsigned ev = events[i].events;
+    if (stream->state == DYAD_STATE_CLOSED) {
+      continue;
+    }
+    dyad_handleStream(stream,
+      ev & (EPOLLIN | EPOLLHUP | EPOLLERR),
+      ev & (EPOLLOUT | EPOLLHUP | EPOLLERR),
+      ev & EPOLLERR);
+  }
+}
+#endif
+
+
+
+static int64_t dyad_bufferMemory(dyad_WriteBuffer *b) {
+  return b->length - b->fileLength;
+}
+
+
+static void dyad_checkBufferLimit(void) {
+  dyad_Stream *stream;
+  if (dyad_bufferLimit <= 0) return;
+  if (dyad_bufferPolicy == DYAD_BUFFER_DROP_SLOWEST) {
+    /* Close the streams with the most unsent data until the rest fit; their
+     * peers are the ones reading slowest */
+    while (dyad_bytesQueued - dyad_fileBytesQueued > dyad_bufferLimit) {
+      dyad_Stream *slowest = NULL;
+      for (stream = dyad_streams; stream; stream = stream->next) {
+        if (stream->state != DYAD_STATE_CLOSED &&
+            (!slowest || dyad_bufferMemory(&stream->writeBuffer) >
+                         dyad_bufferMemory(&slowest->writeBuffer))
         ) {
-          /* Handle failed connection */
-          connectFailed:
-          dyad_streamError(stream, "could not connect to server", 0);
+          slowest = stream;
         }
-        break;
-
-      case DYAD_STATE_LISTENING:
-        if (dyad_selectHas(&dyad_selectSet, DYAD_SET_READ, stream->sockfd)) {
-          dyad_acceptPendingConnections(stream);
+      }
+      if (!slowest || dyad_bufferMemory(&slowest->writeBuffer) == 0) break;
+      dyad_streamError(slowest, "write buffer limit exceeded", 0);
+    }
+  } else if (dyad_stalled &&
+             dyad_bytesQueued - dyad_fileBytesQueued <=
+             dyad_bufferLimit / 4 * 3
+  ) {
+    /* Enough has drained, let the streams told to wait write again */
+    dyad_Event e = dyad_createEvent(DYAD_EVENT_READY);
+    e.msg = "stream is ready for more data";
+    dyad_stalled = 0;
+    for (stream = dyad_streams; stream; stream = stream->next) {
+      if (stream->flags & DYAD_FLAG_STALLED) {
+        stream->flags &= ~DYAD_FLAG_STALLED;
+        if (stream->state == DYAD_STATE_CONNECTED) {
+          dyad_emitEvent(stream, &e);
         }
-        break;
+      }
     }
+  }
+}
 
-    /* If data was just now written to the stream we should immediately try to
-     * send it */
-    if (stream->flags & DYAD_FLAG_WRITTEN &&
-        stream->state != DYAD_STATE_CLOSED
-    ) {
-      dyad_flushWriteBuffer(stream);
-    }
 
-    stream = stream->next;
+/*===========================================================================*/
+/* API                                                                       */
+/*===========================================================================*/
+
+/*---------------------------------------------------------------------------*/
+/* Core                                                                      */
+/*---------------------------------------------------------------------------*/
+
+void dyad_update(void) {
+  dyad_updateClock();
+  dyad_flushWrittenStreams();
+  dyad_destroyClosedStreams();
+  dyad_updateTickTimer();
+  dyad_updateStreamTimeouts();
+  dyad_retryAccepts();
+  dyad_updatePools();
+
+#ifdef DYAD_USE_EPOLL
+  if (dyad_epollFd != -1) {
+    dyad_updateEpoll();
+  } else
+#endif
+  {
+    dyad_updateSelect();
   }
+
+  dyad_flushWrittenStreams();
+  dyad_checkBufferLimit();
 }
 
 
@@ -783,17 +1613,28 @@ void dyad_init(void) {
   /* Stops the SIGPIPE signal being raised when writing to a closed socket */
   signal(SIGPIPE, SIG_IGN);
 #endif
+  dyad_updateClock();
+  dyad_epollInit();
 }
 
 
 void dyad_shutdown(void) {
+  int i;
   /* Close and destroy all the streams */
   while (dyad_streams) {
     dyad_close(dyad_streams);
     dyad_destroyStream(dyad_streams);
   }
   /* Clear up everything */
+  dyad_writtenStreams = NULL;
+  dyad_closedStreams = NULL;
+  dyad_vectorDeinit(&dyad_timers);
+  dyad_vectorInit(&dyad_timers);
+  for (i = 0; i < (int) (sizeof(dyad_pools) / sizeof(*dyad_pools)); i++) {
+    dyad_poolTrim(dyad_pools[i]);
+  }
   dyad_selectDeinit(&dyad_selectSet);
+  dyad_epollDeinit();
 #ifdef _WIN32
   WSACleanup();
 #endif
@@ -823,6 +1664,96 @@ int dyad_getStreamCount(void) {
 }
 
 
+int64_t dyad_getPoolHits(void) {
+  int64_t hits = 0;
+  int i;
+  for (i = 0; i < (int) (sizeof(dyad_pools) / sizeof(*dyad_pools)); i++) {
+    hits += dyad_pools[i]->hits;
+  }
+  return hits;
+}
+
+
+int64_t dyad_getPoolMisses(void) {
+  int64_t misses = 0;
+  int i;
+  for (i = 0; i < (int) (sizeof(dyad_pools) / sizeof(*dyad_pools)); i++) {
+    misses += dyad_pools[i]->misses;
+  }
+  return misses;
+}
+
+
+int64_t dyad_getBytesQueued(void) {
+  return dyad_bytesQueued;
+}
+
+
+int64_t dyad_getBytesBuffered(void) {
+  return dyad_bytesQueued - dyad_fileBytesQueued;
+}
+
+
+void dyad_setBufferLimit(int bytes, int policy) {
+  dyad_bufferLimit = bytes;
+  dyad_bufferPolicy = policy;
+}
+
+
+double dyad_getWaitTime(void) {
+  return dyad_waitTime;
+}
+
+
+int dyad_getPollFd(void) {
+  return dyad_epollFd;
+}
+
+
+double dyad_getNextTimeout(void) {
+  double currentTime, next = 0;
+  int found = 0;
+  /* Written streams are flushed as soon as dyad_update() is called */
+  if (dyad_writtenStreams) {
+    return 0;
+  }
+  currentTime = dyad_updateClock();
+  if (dyad_tickInterval > 0) {
+    next = dyad_lastTick - currentTime;
+    found = 1;
+  }
+  /* The top of the heap may be early (see dyad_updateStreamTimeouts), which
+   * only costs a spurious wakeup */
+  if (dyad_timers.length > 0) {
+    double t = dyad_timers.data[0]->deadline - currentTime;
+    if (!found || t < next) {
+      next = t;
+      found = 1;
+    }
+  }
+  /* Wake up to accept the connections a listener couldn't */
+  if (dyad_acceptRetry != 0) {
+    double t = dyad_acceptRetry - currentTime;
+    if (!found || t < next) {
+      next = t;
+      found = 1;
+    }
+  }
+  /* Wake up to trim the pools once they are idle */
+  if (dyad_hasPooledItems()) {
+    double t = dyad_poolLastUsed + DYAD_POOL_IDLE_TIME - currentTime;
+    if (!found || t < next) {
+      next = t;
+      found = 1;
+    }
+  }
+  if (!found) {
+    return -1;
+  }
+  return next < 0 ? 0 : next;
+}
+
+
 void dyad_setTickInterval(double seconds) {
   dyad_tickInterval = seconds;
 }
@@ -845,15 +1776,22 @@ dyad_PanicCallback dyad_atPanic(dyad_PanicCallback func) {
 /*---------------------------------------------------------------------------*/
 
 dyad_Stream *dyad_newStream(void) {
-  dyad_Stream *stream = dyad_realloc(NULL, sizeof(*stream));
-  memset(stream, 0, sizeof(*stream));
+  dyad_Stream *stream = dyad_poolAlloc(&dyad_streamPool);
+  /* Everything but the (empty) vectors of a recycled stream is reset */
+  memset(stream, 0, offsetof(dyad_Stream, listeners));
   stream->state = DYAD_STATE_CLOSED;
   stream->sockfd = -1;
-  stream->lastActivity = dyad_getTime();
+  stream->timerIndex = -1;
+  stream->lastActivity = dyad_now;
   /* Add to list and increment count */
   stream->next = dyad_streams;
+  if (dyad_streams) {
+    dyad_streams->prev = stream;
+  }
   dyad_streams = stream;
   dyad_streamCount++;
+  /* Destroyed at the next update unless it is opened by then */
+  dyad_markClosed(stream);
   return stream;
 }
 
@@ -886,18 +1824,24 @@ void dyad_close(dyad_Stream *stream) {
   dyad_Event e;
   if (stream->state == DYAD_STATE_CLOSED) return;
   stream->state = DYAD_STATE_CLOSED;
+  dyad_timerCancel(stream);
+  dyad_markClosed(stream);
   /* Close socket */
   if (stream->sockfd != -1) {
+    dyad_epollRemove(stream);
     close(stream->sockfd);
     stream->sockfd = -1;
   }
+  /* Drop unsent data; this is done before the event so buffers passed to
+   * dyad_writeRef() are released while their owner is still around */
+  dyad_bufferClear(&stream->writeBuffer);
   /* Emit event */
   e = dyad_createEvent(DYAD_EVENT_CLOSE);
   e.msg = "stream closed";
   dyad_emitEvent(stream, &e);
   /* Clear buffers */
   dyad_vectorClear(&stream->lineBuffer);
-  dyad_vectorClear(&stream->writeBuffer);
+  stream->lineScan = 0;
 }
 
 
@@ -905,6 +1849,7 @@ void dyad_end(dyad_Stream *stream) {
   if (stream->state == DYAD_STATE_CLOSED) return;
   if (stream->writeBuffer.length > 0) {
     stream->state = DYAD_STATE_CLOSING;
+    dyad_epollUpdate(stream);
   } else {
     dyad_close(stream);
   }
@@ -937,6 +1882,18 @@ int dyad_listenEx(
   optval = 1;
   setsockopt(stream->sockfd, SOL_SOCKET, SO_REUSEADDR,
              &optval, sizeof(optval));
+#ifdef SO_REUSEPORT
+  /* Set SO_REUSEPORT if requested so that several processes can bind the same
+   * port and have the kernel balance incoming connections between them */
+  if (stream->flags & DYAD_FLAG_REUSEPORT) {
+    err = setsockopt(stream->sockfd, SOL_SOCKET, SO_REUSEPORT,
+                     &optval, sizeof(optval));
+    if (err) {
+      dyad_streamError(stream, "could not set SO_REUSEPORT", errno);
+      goto fail;
+    }
+  }
+#endif
   /* Bind and listen */
   err = bind(stream->sockfd, ai->ai_addr, ai->ai_addrlen);
   if (err) {
@@ -950,6 +1907,7 @@ int dyad_listenEx(
   }
   stream->state = DYAD_STATE_LISTENING;
   stream->port = port;
+  dyad_epollUpdate(stream);
   /* Emit listening event */
   e = dyad_createEvent(DYAD_EVENT_LISTEN);
   e.msg = "socket is listening";
@@ -986,6 +1944,7 @@ int dyad_connect(dyad_Stream *stream, const char *host, int port) {
   if (err) goto fail;
   connect(stream->sockfd, ai->ai_addr, ai->ai_addrlen);
   stream->state = DYAD_STATE_CONNECTING;
+  dyad_epollUpdate(stream);
   freeaddrinfo(ai);
   return 0;
   fail:
@@ -995,24 +1954,53 @@ int dyad_connect(dyad_Stream *stream, const char *host, int port) {
 
 
 void dyad_write(dyad_Stream *stream, void *data, int size) {
-  char *p = data;
-  while (size--) {
-    dyad_vectorPush(&stream->writeBuffer, *p++);
+  dyad_bufferWrite(&stream->writeBuffer, data, size);
+  dyad_markWritten(stream);
+}
+
+
+void dyad_writeRef(
+  dyad_Stream *stream, const void *data, int size,
+  dyad_ReleaseCallback release, void *udata
+) {
+  if (stream->state == DYAD_STATE_CLOSED) {
+    /* Nothing will ever be sent */
+    if (release) release(udata);
+    return;
   }
-  stream->flags |= DYAD_FLAG_WRITTEN;
+  dyad_bufferWriteRef(&stream->writeBuffer, data, size, release, udata);
+  dyad_markWritten(stream);
+}
+
+
+void dyad_writeFile(
+  dyad_Stream *stream, int fd, int offset, int size,
+  dyad_ReleaseCallback release, void *udata
+) {
+  if (stream->state == DYAD_STATE_CLOSED || size <= 0) {
+    if (release) release(udata);
+    return;
+  }
+  dyad_bufferWriteFile(&stream->writeBuffer, fd, offset, size,
+                       release, udata);
+  dyad_markWritten(stream);
 }
 
 
 void dyad_vwritef(dyad_Stream *stream, const char *fmt, va_list args) {
-  char buf[64];
+  dyad_WriteBuffer *b = &stream->writeBuffer;
+  char buf[512];
   char *str;
   char f[] = "%_";
   FILE *fp;
-  int c;
+  size_t n;
+  char c;
   while (*fmt) {
     if (*fmt == '%') {
       fmt++;
       switch (*fmt) {
+        case '\0':
+          continue;
         case 'f': case 'g': case 'd': case 'i': case 'x': case 'X': case 'p':
           f[1] = *fmt;
           vsprintf(buf, (const char*) f, args);
@@ -1020,31 +2008,34 @@ void dyad_vwritef(dyad_Stream *stream, const char *fmt, va_list args) {
           goto writeStr;
         case 'r':
           fp = va_arg(args, FILE*);
-          while ((c = fgetc(fp)) != EOF) {
-            dyad_vectorPush(&stream->writeBuffer, c);
+          while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            dyad_bufferWrite(b, buf, n);
           }
           break;
         case 'c':
-          dyad_vectorPush(&stream->writeBuffer, va_arg(args, int));
+          c = va_arg(args, int);
+          dyad_bufferWrite(b, &c, 1);
           break;
         case 's': {
           str = va_arg(args, char*);
           if (str == NULL) str = "(null)";
           writeStr:
-          while (*str) {
-            dyad_vectorPush(&stream->writeBuffer, *str++);
-          }
+          dyad_bufferWrite(b, str, strlen(str));
           break;
         }
         default:
-          dyad_vectorPush(&stream->writeBuffer, *fmt);
+          dyad_bufferWrite(b, fmt, 1);
       }
+      fmt++;
     } else {
-      dyad_vectorPush(&stream->writeBuffer, *fmt);
+      /* Copy the text up to the next format specifier in one go */
+      const char *p = strchr(fmt, '%');
+      n = p ? (size_t) (p - fmt) : strlen(fmt);
+      dyad_bufferWrite(b, fmt, n);
+      fmt += n;
     }
-    fmt++;
   }
-  stream->flags |= DYAD_FLAG_WRITTEN;
+  dyad_markWritten(stream);
 }
 
 
@@ -1056,8 +2047,72 @@ void dyad_writef(dyad_Stream *stream, const char *fmt, ...) {
 }
 
 
+void dyad_setLowWatermark(dyad_Stream *stream, int bytes) {
+  stream->lowWatermark = bytes;
+}
+
+
+void dyad_setHighWatermark(dyad_Stream *stream, int bytes) {
+  stream->highWatermark = bytes;
+}
+
+
+int dyad_isFull(dyad_Stream *stream) {
+  /* A full stream gets READY once it has drained to its low watermark */
+  if (stream->highWatermark > 0 &&
+      dyad_bufferMemory(&stream->writeBuffer) >= stream->highWatermark
+  ) {
+    return 1;
+  }
+  /* With the stall policy, READY comes once all streams together are well
+   * below the limit again (see dyad_checkBufferLimit()) */
+  if (dyad_bufferLimit > 0 && dyad_bufferPolicy == DYAD_BUFFER_STALL &&
+      dyad_bytesQueued - dyad_fileBytesQueued >= dyad_bufferLimit
+  ) {
+    stream->flags |= DYAD_FLAG_STALLED;
+    dyad_stalled = 1;
+    return 1;
+  }
+  return 0;
+}
+
+
 void dyad_setTimeout(dyad_Stream *stream, double seconds) {
   stream->timeout = seconds;
+  if (seconds > 0) {
+    /* The stream may have been quiet while its timeout was off */
+    stream->lastActivity = dyad_updateClock();
+    dyad_timerSchedule(stream);
+  } else {
+    dyad_timerCancel(stream);
+  }
+}
+
+
+int dyad_setReusePort(dyad_Stream *stream, int opt) {
+#ifdef SO_REUSEPORT
+  if (opt) {
+    stream->flags |= DYAD_FLAG_REUSEPORT;
+  } else {
+    stream->flags &= ~DYAD_FLAG_REUSEPORT;
+  }
+  return 0;
+#else
+  (void) stream;
+  return opt ? -1 : 0;
+#endif
+}
+
+
+void dyad_setReadPaused(dyad_Stream *stream, int opt) {
+  if (opt) {
+    stream->flags |= DYAD_FLAG_NOREAD;
+  } else {
+    stream->flags &= ~DYAD_FLAG_NOREAD;
+  }
+  /* Re-arming the socket with epoll reports data which arrived while reading
+   * was paused, no new edge is needed for it */
+  dyad_epollUpdate(stream);
 }
 
 
@@ -1073,7 +2128,7 @@ int dyad_getState(dyad_Stream *stream) {
 
 
 const char *dyad_getAddress(dyad_Stream *stream) {
-  return stream->address ? stream->address : "";
+  return stream->address;
 }
 
 
@@ -1082,16 +2137,21 @@ int dyad_getPort(dyad_Stream *stream) {
 }
 
 
-int dyad_getBytesSent(dyad_Stream *stream) {
+int64_t dyad_getBytesSent(dyad_Stream *stream) {
   return stream->bytesSent;
 }
 
 
-int dyad_getBytesReceived(dyad_Stream *stream) {
+int64_t dyad_getBytesReceived(dyad_Stream *stream) {
   return stream->bytesReceived;
 }
 
 
+int64_t dyad_getBytesPending(dyad_Stream *stream) {
+  return stream->writeBuffer.length;
+}
+
+
 int dyad_getSocket(dyad_Stream *stream) {
   return stream->sockfd;
 }
\ No newline at end of file
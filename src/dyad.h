@@ -9,6 +9,7 @@
 #define DYAD_H
 
 #include <stdarg.h>
+#include <stdint.h>
 
 struct dyad_Stream;
 typedef struct dyad_Stream dyad_Stream;
@@ -26,6 +27,7 @@ typedef struct {
 
 typedef void (*dyad_Callback)(dyad_Event*);
 typedef void (*dyad_PanicCallback)(const char*);
+typedef void (*dyad_ReleaseCallback)(void*);
 
 enum {
   DYAD_EVENT_NULL,
@@ -49,6 +51,11 @@ enum {
   DYAD_STATE_LISTENING
 };
 
+enum {
+  DYAD_BUFFER_STALL,
+  DYAD_BUFFER_DROP_SLOWEST
+};
+
 
 void dyad_init(void);
 void dyad_update(void);
@@ -56,8 +63,16 @@ void dyad_shutdown(void);
 const char *dyad_getVersion(void);
 double dyad_getTime(void);
 int  dyad_getStreamCount(void);
+int  dyad_getPollFd(void);
+int64_t dyad_getPoolHits(void);
+int64_t dyad_getPoolMisses(void);
+int64_t dyad_getBytesQueued(void);
+int64_t dyad_getBytesBuffered(void);
+double dyad_getWaitTime(void);
+double dyad_getNextTimeout(void);
 void dyad_setTickInterval(double seconds);
 void dyad_setUpdateTimeout(double seconds);
+void dyad_setBufferLimit(int bytes, int policy);
 dyad_PanicCallback dyad_atPanic(dyad_PanicCallback func);
 
 dyad_Stream *dyad_newStream(void);
@@ -72,15 +87,25 @@ void dyad_removeListener(dyad_Stream *stream, int event,
 void dyad_end(dyad_Stream *stream);
 void dyad_close(dyad_Stream *stream);
 void dyad_write(dyad_Stream *stream, void *data, int size);
+void dyad_writeRef(dyad_Stream *stream, const void *data, int size,
+                   dyad_ReleaseCallback release, void *udata);
+void dyad_writeFile(dyad_Stream *stream, int fd, int offset, int size,
+                    dyad_ReleaseCallback release, void *udata);
 void dyad_vwritef(dyad_Stream *stream, const char *fmt, va_list args);
 void dyad_writef(dyad_Stream *stream, const char *fmt, ...);
 void dyad_setTimeout(dyad_Stream *stream, double seconds);
+void dyad_setLowWatermark(dyad_Stream *stream, int bytes);
+void dyad_setHighWatermark(dyad_Stream *stream, int bytes);
+int  dyad_isFull(dyad_Stream *stream);
+int  dyad_setReusePort(dyad_Stream *stream, int opt);
+void dyad_setReadPaused(dyad_Stream *stream, int opt);
 void dyad_setNoDelay(dyad_Stream *stream, int opt);
 int  dyad_getState(dyad_Stream *stream);
 const char *dyad_getAddress(dyad_Stream *stream);
 int  dyad_getPort(dyad_Stream *stream);
-int  dyad_getBytesSent(dyad_Stream *stream);
-int  dyad_getBytesReceived(dyad_Stream *stream);
+int64_t dyad_getBytesSent(dyad_Stream *stream);
+int64_t dyad_getBytesReceived(dyad_Stream *stream);
+int64_t dyad_getBytesPending(dyad_Stream *stream);
 int  dyad_getSocket(dyad_Stream *stream);
 
 #endif
\ No newline at end of file
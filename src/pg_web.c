@@ -13,6 +13,9 @@
 
 #include "postgres.h"
 
+#include <math.h>
+#include <sys/socket.h>
+
 /* Following are required for all bgworker */
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
@@ -30,6 +33,8 @@
 #include "pgstat.h"
 #include "tcop/utility.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
 #include "utils/snapmgr.h"
 
 /* web server */
@@ -44,10 +49,36 @@ void _PG_init(void);
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
 
 /* GUC variables */
 static int pg_web_setting_port; //http port int
-static char pg_web_setting_port_str[5]; //http port str
+static char pg_web_setting_port_str[6]; //http port str
+static int pg_web_setting_workers; //number of http workers
+int pg_web_setting_keepalive_timeout; //idle keep-alive timeout, seconds
+bool pg_web_setting_enable_query; //allow SQL over HTTP
+char *pg_web_setting_query_role; //role the SQL over HTTP runs as
+int pg_web_setting_endpoint_cache_size; //prepared endpoints per worker
+int pg_web_setting_cache_size; //shared response cache, kB
+int pg_web_setting_cache_ttl; //lifetime of cached responses, ms
+int pg_web_setting_query_workers; //query executors per http worker
+int pg_web_setting_query_queue_depth; //queries waiting for an executor
+int pg_web_setting_query_timeout; //time a query may take, ms
+char *pg_web_setting_static_dir; //directory served under /static/
+int pg_web_setting_compression_level; //zlib level, 0 disables compression
+int pg_web_setting_compression_min_size; //smallest body compressed, bytes
+int pg_web_setting_write_buffer_high_water; //per connection, kB
+static int pg_web_setting_write_buffer_limit; //all connections of a worker, kB
+static int pg_web_setting_write_buffer_policy; //what happens at the limit
+
+static const struct config_enum_entry pg_web_write_buffer_policies[] = {
+  {"stall", DYAD_BUFFER_STALL, false},
+  {"drop_slowest", DYAD_BUFFER_DROP_SLOWEST, false},
+  {NULL, 0, false}
+};
+
+/* index of this worker, from 0 to pg_web.workers - 1 */
+static int pg_web_worker_id = 0;
 
 /*
  * pg_web_sigterm
@@ -64,6 +95,21 @@ pg_web_sigterm(SIGNAL_ARGS)
   errno = save_errno;
 }
 
+/*
+ * pg_web_sighup
+ *
+ * SIGHUP handler.
+ */
+static void
+pg_web_sighup(SIGNAL_ARGS)
+{
+  int save_errno = errno;
+  got_sighup = true;
+  if (MyProc)
+    SetLatch(&MyProc->procLatch);
+  errno = save_errno;
+}
+
 /*
  * pg_web_exit
  *
@@ -77,6 +123,73 @@ pg_web_exit(int code)
 }
 
 
+/*
+ * pg_web_wait
+ *
+ * Sleep until the latch is set (the query executors set it too), one of the
+ * web server sockets becomes ready, or dyad, the query pool or the queries
+ * waiting for the transaction have timed work to do (stream timeouts,
+ * ticks, waiting queries). Returns the WL_* events which woke us up.
+ */
+static int
+pg_web_wait(void)
+{
+  pgsocket  sock = dyad_getPollFd();
+  double    next = dyad_getNextTimeout();
+  long      timeout = -1;
+  long      pool_timeout = pg_web_pool_next_timeout();
+  long      xact_timeout = pg_web_waiting_next_timeout();
+  int       rc;
+
+  if (next >= 0)
+    timeout = (long) ceil(next * 1000.0);
+  /* Queries waiting for an executor or the transaction time out too */
+  if (pool_timeout >= 0 && (timeout < 0 || pool_timeout < timeout))
+    timeout = pool_timeout;
+  if (xact_timeout >= 0 && (timeout < 0 || xact_timeout < timeout))
+    timeout = xact_timeout;
+
+  /* Without an epoll descriptor dyad_update() itself blocks in select() */
+  if (sock == PGINVALID_SOCKET)
+    timeout = 0;
+
+#if PG_VERSION_NUM >= 90600
+  {
+    static WaitEventSet *wait_set = NULL;
+    WaitEvent   event;
+
+    if (wait_set == NULL)
+    {
+      wait_set = CreateWaitEventSet(TopMemoryContext, 3);
+      AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET,
+                        &MyProc->procLatch, NULL);
+      AddWaitEventToSet(wait_set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET,
+                        NULL, NULL);
+      if (sock != PGINVALID_SOCKET)
+        AddWaitEventToSet(wait_set, WL_SOCKET_READABLE, sock, NULL, NULL);
+    }
+
+#if PG_VERSION_NUM >= 100000
+    if (WaitEventSetWait(wait_set, timeout, &event, 1, PG_WAIT_EXTENSION) == 0)
+#else
+    if (WaitEventSetWait(wait_set, timeout, &event, 1) == 0)
+#endif
+      rc = WL_TIMEOUT;
+    else
+      rc = event.events;
+  }
+#else
+  rc = WaitLatchOrSocket(&MyProc->procLatch,
+                         WL_LATCH_SET | WL_POSTMASTER_DEATH |
+                         (sock != PGINVALID_SOCKET ? WL_SOCKET_READABLE : 0) |
+                         (timeout >= 0 ? WL_TIMEOUT : 0),
+                         sock, timeout);
+#endif
+
+  ResetLatch(&MyProc->procLatch);
+  return rc;
+}
+
 /*
  * pg_web_main
  *
@@ -87,9 +200,15 @@ pg_web_main(Datum main_arg)
 {
 
   dyad_Stream *s;
+  instr_time   loop_start;
+  int64        last_pool_hits = 0;
+  int64        last_pool_misses = 0;
+
+  pg_web_worker_id = DatumGetInt32(main_arg);
 
-  /* Set up the sigterm signal before unblocking them */
+  /* Set up the signals before unblocking them */
   pqsignal(SIGTERM, pg_web_sigterm);
+  pqsignal(SIGHUP, pg_web_sighup);
 
   /* We're now ready to receive signals */
   BackgroundWorkerUnblockSignals();
@@ -97,34 +216,91 @@ pg_web_main(Datum main_arg)
   /* Connect to our database */
   BackgroundWorkerInitializeConnection("postgres", NULL);
 
-  ereport( INFO, (errmsg( "Start web server on port %s\n", pg_web_setting_port_str )));
+  /* Count our requests in the shared stats */
+  pg_web_stats_attach(pg_web_worker_id);
+
+  ereport( INFO, (errmsg( "Start web server worker %d on port %s\n",
+    pg_web_worker_id, pg_web_setting_port_str )));
   
   dyad_init();
+  /* We sleep on the latch, so dyad must never block on its own (unless it
+   * has to fall back to select()), and we have no use for tick events */
+  dyad_setUpdateTimeout(dyad_getPollFd() != -1 ? 0 : 1);
+  dyad_setTickInterval(0);
+  dyad_setBufferLimit(pg_web_setting_write_buffer_limit * 1024,
+                      pg_web_setting_write_buffer_policy);
   s = dyad_newStream();
   dyad_addListener(s, DYAD_EVENT_ERROR,  onWebError,  NULL);
   dyad_addListener(s, DYAD_EVENT_ACCEPT, onWebAccept, NULL);
   dyad_addListener(s, DYAD_EVENT_LISTEN, onWebListen, NULL);
+  /* All the workers bind the same port, the kernel spreads the connections */
+  if (pg_web_setting_workers > 1)
+    dyad_setReusePort(s, 1);
   dyad_listen(s, pg_web_setting_port);
 
   /* begin loop */
+  INSTR_TIME_SET_CURRENT(loop_start);
   while (!got_sigterm)
   {
-    //int rc;
-    
+    int         rc;
+    double      dyad_wait = dyad_getWaitTime();
+    uint64      bytes_queued;
+    uint64      bytes_buffered;
+    int64       pool_hits;
+    int64       pool_misses;
+    instr_time  wait_start;
+    instr_time  wait_end;
+    instr_time  busy;
+    instr_time  wait;
+
     dyad_update();
-    
-    /* Wait 10s */
+    /* results of the queries, written out by the next update */
+    pg_web_pool_poll();
+    pg_web_run_waiting();
+    pg_web_stats_check_reset();
+
+    if (got_sighup)
+    {
+      got_sighup = false;
+      ProcessConfigFile(PGC_SIGHUP);
+      dyad_setBufferLimit(pg_web_setting_write_buffer_limit * 1024,
+                          pg_web_setting_write_buffer_policy);
+    }
+
+    if (got_sigterm)
+      break;
+
+    bytes_queued = dyad_getBytesQueued();
+    bytes_buffered = dyad_getBytesBuffered() + pg_web_input_buffered();
+    pool_hits = dyad_getPoolHits();
+    pool_misses = dyad_getPoolMisses();
+    INSTR_TIME_SET_CURRENT(wait_start);
+    rc = pg_web_wait();
+    INSTR_TIME_SET_CURRENT(wait_end);
+
     /*
-    rc = WaitLatch(&MyProc->procLatch,
-      WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-      10000L);
-    ResetLatch(&MyProc->procLatch);
-    */
+     * Account the iteration. Without epoll dyad_update() waits in select(),
+     * that time is moved from the busy to the waiting part.
+     */
+    busy = wait_start;
+    INSTR_TIME_SUBTRACT(busy, loop_start);
+    wait = wait_end;
+    INSTR_TIME_SUBTRACT(wait, wait_start);
+    loop_start = wait_end;
+    dyad_wait = (dyad_getWaitTime() - dyad_wait) * 1000000.0;
+    pg_web_stats_loop_done(
+      Max(INSTR_TIME_GET_MICROSEC(busy) - dyad_wait, 0),
+      INSTR_TIME_GET_MICROSEC(wait) + dyad_wait,
+      bytes_queued,
+      bytes_buffered,
+      pool_hits - last_pool_hits,
+      pool_misses - last_pool_misses);
+    last_pool_hits = pool_hits;
+    last_pool_misses = pool_misses;
+
     /* Emergency bailout if postmaster has died */
-    /*
     if (rc & WL_POSTMASTER_DEATH)
       pg_web_exit(1);
-    */
   }
   
   pg_web_exit(0);
@@ -147,6 +323,7 @@ void
 _PG_init(void)
 {
   BackgroundWorker	worker;
+  int i;
 
   /* get GUC settings, if available */
 
@@ -165,17 +342,305 @@ _PG_init(void)
     NULL
   );
 
+  DefineCustomIntVariable(
+    "pg_web.workers",
+    "Number of pg_web HTTP workers",
+    "Number of background workers serving HTTP on pg_web.port (default: 1). "
+    "Each worker counts against max_worker_processes.",
+    &pg_web_setting_workers,
+    1,
+    1,
+    64,
+    PGC_POSTMASTER,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.keepalive_timeout",
+    "Idle timeout of pg_web HTTP connections",
+    "Seconds a persistent HTTP connection may stay idle before it is closed "
+    "(default: 15). Zero disables keep-alive.",
+    &pg_web_setting_keepalive_timeout,
+    15,
+    0,
+    3600,
+    PGC_SIGHUP,
+    GUC_UNIT_S,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomBoolVariable(
+    "pg_web.enable_query",
+    "Allow running SQL queries over HTTP",
+    "Enables the /query and /export endpoints, which run read-only queries "
+    "in the postgres database as pg_web.query_role; they are refused while "
+    "that isn't set (default: off).",
+    &pg_web_setting_enable_query,
+    false,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomStringVariable(
+    "pg_web.query_role",
+    "Role the SQL of pg_web requests runs as",
+    "The queries of /query and /export run as this role, which must not be "
+    "a superuser, so it decides what HTTP clients may read (default: empty, "
+    "which refuses them).",
+    &pg_web_setting_query_role,
+    "",
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.endpoint_cache_size",
+    "Prepared endpoints kept per pg_web worker",
+    "Number of /q/ endpoints each worker keeps prepared; the least recently "
+    "used one is dropped to make room (default: 100).",
+    &pg_web_setting_endpoint_cache_size,
+    100,
+    1,
+    10000,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.cache_size",
+    "Size of the pg_web response cache",
+    "Shared memory for GET responses of /query, /export and /q/ endpoints "
+    "which are reused until a table they read changes (default: 0, which "
+    "disables the cache).",
+    &pg_web_setting_cache_size,
+    0,
+    0,
+    MAX_KILOBYTES,
+    PGC_POSTMASTER,
+    GUC_UNIT_KB,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.cache_ttl",
+    "Lifetime of cached pg_web responses",
+    "Time a cached response is served, or a client's ETag is answered "
+    "with 304 without running the query, at most, even if its tables don't "
+    "change (default: 10s). Zero stops both.",
+    &pg_web_setting_cache_ttl,
+    10000,
+    0,
+    INT_MAX,
+    PGC_SIGHUP,
+    GUC_UNIT_MS,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.query_workers",
+    "Query executors of each pg_web worker",
+    "Background workers each HTTP worker starts, as they are needed, to run "
+    "the queries of /query, /export and /q/ endpoints, so its other "
+    "connections are served meanwhile. Each counts against "
+    "max_worker_processes (default: 0, which runs the queries in the HTTP "
+    "worker).",
+    &pg_web_setting_query_workers,
+    0,
+    0,
+    64,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.query_queue_depth",
+    "Queries waiting for a pg_web query executor",
+    "Queries of an HTTP worker which may wait for a free executor; more are "
+    "answered with 503 (default: 64).",
+    &pg_web_setting_query_queue_depth,
+    64,
+    1,
+    10000,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.query_timeout",
+    "Time a pg_web query may take",
+    "Queries of a request still running after this long are canceled, "
+    "like with statement_timeout, and ones still waiting for an executor "
+    "are answered with 503 (default: 0, which disables the timeout).",
+    &pg_web_setting_query_timeout,
+    0,
+    0,
+    INT_MAX,
+    PGC_SIGHUP,
+    GUC_UNIT_MS,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomStringVariable(
+    "pg_web.static_dir",
+    "Directory of the files pg_web serves under /static/",
+    "Files of this directory are served under /static/, relative paths are "
+    "taken to be in the share directory (default: empty, which disables it).",
+    &pg_web_setting_static_dir,
+    "",
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.compression_level",
+    "Compression level of pg_web responses",
+    "Responses are compressed with gzip or deflate at this zlib level when "
+    "the client accepts it, 1 is the fastest and 9 the best (default: 0, "
+    "which disables compression).",
+    &pg_web_setting_compression_level,
+    0,
+    0,
+    9,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.compression_min_size",
+    "Smallest pg_web response body which is compressed",
+    "Bodies smaller than this many bytes are sent as they are; streamed "
+    "results are always compressed (default: 1024).",
+    &pg_web_setting_compression_min_size,
+    1024,
+    0,
+    INT_MAX,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.write_buffer_high_water",
+    "Unsent data a pg_web connection may hold before it is paused",
+    "Pipelined requests and streamed results of a connection wait while "
+    "this much of its responses is unsent, until it has drained (default: "
+    "1MB, 0 disables the limit).",
+    &pg_web_setting_write_buffer_high_water,
+    1024,
+    0,
+    MAX_KILOBYTES,
+    PGC_SIGHUP,
+    GUC_UNIT_KB,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomIntVariable(
+    "pg_web.write_buffer_limit",
+    "Unsent data all connections of a pg_web worker may hold",
+    "What happens beyond it is set by pg_web.write_buffer_limit_policy; "
+    "files served from pg_web.static_dir don't count (default: 0, which "
+    "disables the limit).",
+    &pg_web_setting_write_buffer_limit,
+    0,
+    0,
+    MAX_KILOBYTES,
+    PGC_SIGHUP,
+    GUC_UNIT_KB,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  DefineCustomEnumVariable(
+    "pg_web.write_buffer_limit_policy",
+    "What pg_web does when pg_web.write_buffer_limit is reached",
+    "With stall the connections of the worker are paused until three "
+    "quarters of the limit are left, with drop_slowest the connections "
+    "with the most unsent data are closed (default: stall).",
+    &pg_web_setting_write_buffer_policy,
+    DYAD_BUFFER_STALL,
+    pg_web_write_buffer_policies,
+    PGC_SIGHUP,
+    0,
+    NULL,
+    NULL,
+    NULL
+  );
+
+  /* The workers and the shared stats can only be set up at server start */
+  if (!process_shared_preload_libraries_in_progress)
+    return;
+
+#ifndef SO_REUSEPORT
+  if (pg_web_setting_workers > 1)
+  {
+    ereport(WARNING,
+      (errmsg("pg_web.workers is set to %d, but SO_REUSEPORT is not "
+              "supported on this platform; starting a single worker",
+              pg_web_setting_workers)));
+    pg_web_setting_workers = 1;
+  }
+#endif
+
+  /* shared counters of the workers, see pg_web_stats.c */
+  pg_web_stats_init(pg_web_setting_workers);
+  /* the response cache, see pg_web_cache.c */
+  pg_web_cache_init();
+
   /* register the worker processes */
   worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
   worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
   worker.bgw_main = pg_web_main;
   /* Wait 1 seconds for restart before crash */
   worker.bgw_restart_time = 1;
-  worker.bgw_main_arg = (Datum) 0;
 
-  /* this value is shown in the process list */
-  snprintf(worker.bgw_name, BGW_MAXLEN, "pg_web");
+  for (i = 0; i < pg_web_setting_workers; i++)
+  {
+    worker.bgw_main_arg = Int32GetDatum(i);
 
-  RegisterBackgroundWorker(&worker);
+    /* this value is shown in the process list */
+    if (pg_web_setting_workers > 1)
+      snprintf(worker.bgw_name, BGW_MAXLEN, "pg_web worker %d", i);
+    else
+      snprintf(worker.bgw_name, BGW_MAXLEN, "pg_web");
+
+    RegisterBackgroundWorker(&worker);
+  }
 }
 
@@ -0,0 +1,754 @@
+/*
+ * pg_web_arrow.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_arrow.h"
+
+#include "catalog/pg_type.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+/* before 10 the server could be built with float timestamps */
+#if PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP)
+#define PG_WEB_ARROW_INT64_TIMESTAMP
+#endif
+
+/* distance between the PostgreSQL and Unix epochs */
+#define PG_WEB_ARROW_EPOCH_DAYS   (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
+#define PG_WEB_ARROW_EPOCH_USECS  ((int64) PG_WEB_ARROW_EPOCH_DAYS * USECS_PER_DAY)
+
+/* values from Arrow's Message.fbs and Schema.fbs */
+#define PG_WEB_ARROW_METADATA_V5          4
+#define PG_WEB_ARROW_HEADER_SCHEMA        1
+#define PG_WEB_ARROW_HEADER_RECORD_BATCH  3
+#define PG_WEB_ARROW_TYPE_INT             2
+#define PG_WEB_ARROW_TYPE_FLOATING_POINT  3
+#define PG_WEB_ARROW_TYPE_BINARY          4
+#define PG_WEB_ARROW_TYPE_UTF8            5
+#define PG_WEB_ARROW_TYPE_BOOL            6
+#define PG_WEB_ARROW_TYPE_DATE            8
+#define PG_WEB_ARROW_TYPE_TIMESTAMP       10
+
+#define PG_WEB_ARROW_IS_VARLEN(kind) \
+  ((kind) == PG_WEB_ARROW_BINARY || (kind) == PG_WEB_ARROW_UTF8 || \
+   (kind) == PG_WEB_ARROW_UTF8_OUT)
+
+/* buffers of one column of a record batch */
+typedef struct PgWebArrowBuffers
+{
+  StringInfoData  validity;       /* bitmap, left out without nulls */
+  StringInfoData  values;         /* values, or offsets of varlen ones */
+  StringInfoData  data;           /* varlen values */
+  int64           null_count;
+} PgWebArrowBuffers;
+
+/*
+ * The metadata of every message is a flatbuffer. Flatbuffer offsets may
+ * only point forward, so we write a table first and the tables, vectors
+ * and strings it refers to after it, filling in the offsets as they are
+ * written. Every table is preceded by its vtable. Positions are offsets in
+ * the output buffer, alignment is relative to the start of the flatbuffer
+ * (base). Scalars are always little-endian.
+ */
+
+/*
+ * pg_web_fb_put
+ *
+ * Store a little-endian scalar.
+ */
+static void
+pg_web_fb_put(StringInfo b, int pos, uint64 value, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    b->data[pos + i] = (char) ((value >> (i * 8)) & 0xFF);
+}
+
+/*
+ * pg_web_fb_reserve
+ *
+ * Append size zero bytes at the given alignment, returns their position.
+ */
+static int
+pg_web_fb_reserve(StringInfo b, int base, int align, int size)
+{
+  int pos;
+
+  while ((b->len - base) % align != 0)
+    appendStringInfoChar(b, '\0');
+
+  pos = b->len;
+  enlargeStringInfo(b, size);
+  memset(b->data + pos, 0, size);
+  b->len += size;
+  b->data[b->len] = '\0';
+  return pos;
+}
+
+/*
+ * pg_web_fb_table
+ *
+ * Append a table with fields of the given sizes (0 for fields left out)
+ * and its vtable. The positions of the fields are returned in fields.
+ */
+static int
+pg_web_fb_table(StringInfo b, int base, int nfields, const int *sizes,
+                int *fields)
+{
+  int offsets[8];
+  int size = 4;                   /* the vtable offset comes first */
+  int vtable;
+  int table;
+  int i;
+
+  Assert(nfields <= lengthof(offsets));
+  for (i = 0; i < nfields; i++)
+  {
+    if (sizes[i] == 0)
+    {
+      offsets[i] = 0;
+      continue;
+    }
+    size = TYPEALIGN(sizes[i], size);
+    offsets[i] = size;
+    size += sizes[i];
+  }
+
+  vtable = pg_web_fb_reserve(b, base, 2, 4 + 2 * nfields);
+  table = pg_web_fb_reserve(b, base, 8, size);
+
+  pg_web_fb_put(b, vtable, 4 + 2 * nfields, 2);
+  pg_web_fb_put(b, vtable + 2, size, 2);
+  for (i = 0; i < nfields; i++)
+  {
+    pg_web_fb_put(b, vtable + 4 + 2 * i, offsets[i], 2);
+    fields[i] = table + offsets[i];
+  }
+  pg_web_fb_put(b, table, table - vtable, 4);
+
+  return table;
+}
+
+/*
+ * pg_web_fb_link
+ *
+ * Point the offset field at target.
+ */
+static void
+pg_web_fb_link(StringInfo b, int field, int target)
+{
+  pg_web_fb_put(b, field, target - field, 4);
+}
+
+/*
+ * pg_web_fb_string
+ */
+static int
+pg_web_fb_string(StringInfo b, int base, const char *str)
+{
+  int len = strlen(str);
+  int pos = pg_web_fb_reserve(b, base, 4, 4 + len + 1);
+
+  pg_web_fb_put(b, pos, len, 4);
+  memcpy(b->data + pos + 4, str, len);
+  return pos;
+}
+
+/*
+ * pg_web_fb_vector
+ *
+ * Append a vector of count zeroed elements, which follow the length at
+ * pos + 4 with the given alignment.
+ */
+static int
+pg_web_fb_vector(StringInfo b, int base, int count, int elem_size, int align)
+{
+  int pos;
+
+  pg_web_fb_reserve(b, base, 4, 0);
+  if ((b->len - base + 4) % align != 0)
+    pg_web_fb_reserve(b, base, 4, 4);
+  pos = pg_web_fb_reserve(b, base, 4, 4 + count * elem_size);
+  pg_web_fb_put(b, pos, count, 4);
+  return pos;
+}
+
+/*
+ * pg_web_arrow_message_begin
+ *
+ * Start an encapsulated message: the continuation marker, the metadata
+ * length (see pg_web_arrow_message_end), and a flatbuffer with the
+ * Message table. Returns the start of the flatbuffer; the position of the
+ * header field is returned in *header.
+ */
+static int
+pg_web_arrow_message_begin(StringInfo out, int header_type, int64 body_length,
+                           int *header)
+{
+  /* version, header_type, header, bodyLength */
+  static const int sizes[4] = {2, 1, 4, 8};
+  int              fields[4];
+  int              base;
+  int              root;
+  int              message;
+
+  appendBinaryStringInfo(out, "\377\377\377\377\0\0\0\0", 8);
+  base = out->len;
+  root = pg_web_fb_reserve(out, base, 4, 4);
+  message = pg_web_fb_table(out, base, 4, sizes, fields);
+  pg_web_fb_link(out, root, message);
+
+  pg_web_fb_put(out, fields[0], PG_WEB_ARROW_METADATA_V5, 2);
+  pg_web_fb_put(out, fields[1], header_type, 1);
+  pg_web_fb_put(out, fields[3], body_length, 8);
+  *header = fields[2];
+  return base;
+}
+
+/*
+ * pg_web_arrow_message_end
+ *
+ * Pad the metadata so the body starts 8-byte aligned and fill in its
+ * length.
+ */
+static void
+pg_web_arrow_message_end(StringInfo out, int base)
+{
+  pg_web_fb_reserve(out, base, 8, 0);
+  pg_web_fb_put(out, base - 4, out->len - base, 4);
+}
+
+/*
+ * pg_web_arrow_kind
+ *
+ * How values of the type are stored.
+ */
+static PgWebArrowKind
+pg_web_arrow_kind(Oid typoid)
+{
+  switch (getBaseType(typoid))
+  {
+    case BOOLOID:
+      return PG_WEB_ARROW_BOOL;
+    case INT2OID:
+      return PG_WEB_ARROW_INT16;
+    case INT4OID:
+      return PG_WEB_ARROW_INT32;
+    case INT8OID:
+      return PG_WEB_ARROW_INT64;
+    case OIDOID:
+      return PG_WEB_ARROW_UINT32;
+    case FLOAT4OID:
+      return PG_WEB_ARROW_FLOAT32;
+    case FLOAT8OID:
+      return PG_WEB_ARROW_FLOAT64;
+    case DATEOID:
+      return PG_WEB_ARROW_DATE32;
+#ifdef PG_WEB_ARROW_INT64_TIMESTAMP
+    case TIMESTAMPOID:
+      return PG_WEB_ARROW_TIMESTAMP;
+    case TIMESTAMPTZOID:
+      return PG_WEB_ARROW_TIMESTAMPTZ;
+#endif
+    case BYTEAOID:
+      return PG_WEB_ARROW_BINARY;
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+      return PG_WEB_ARROW_UTF8;
+    default:
+      /* numeric among others, whose text form is the exact one */
+      return PG_WEB_ARROW_UTF8_OUT;
+  }
+}
+
+/*
+ * pg_web_arrow_width
+ *
+ * Bytes per value of the fixed width kinds, 0 for the others.
+ */
+static int
+pg_web_arrow_width(PgWebArrowKind kind)
+{
+  switch (kind)
+  {
+    case PG_WEB_ARROW_INT16:
+      return 2;
+    case PG_WEB_ARROW_INT32:
+    case PG_WEB_ARROW_UINT32:
+    case PG_WEB_ARROW_FLOAT32:
+    case PG_WEB_ARROW_DATE32:
+      return 4;
+    case PG_WEB_ARROW_INT64:
+    case PG_WEB_ARROW_FLOAT64:
+    case PG_WEB_ARROW_TIMESTAMP:
+    case PG_WEB_ARROW_TIMESTAMPTZ:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * pg_web_arrow_to_utf8
+ *
+ * The string in UTF-8, which Arrow's strings are. *len is updated if it
+ * had to be converted.
+ */
+static const char *
+pg_web_arrow_to_utf8(PgWebArrow *arrow, const char *str, int *len)
+{
+  char *converted;
+
+  if (!arrow->convert)
+    return str;
+
+  converted = (char *) pg_do_encoding_conversion((unsigned char *) str, *len,
+                                                 GetDatabaseEncoding(),
+                                                 PG_UTF8);
+  if (converted != str)
+    *len = strlen(converted);
+  return converted;
+}
+
+/*
+ * pg_web_arrow_create
+ *
+ * Set up the writer for rows of tupdesc. The output functions are used
+ * for the types Arrow has no equivalent of; they must live as long as
+ * the writer.
+ */
+PgWebArrow *
+pg_web_arrow_create(TupleDesc tupdesc, FmgrInfo *outfuncs)
+{
+  PgWebArrow *arrow = palloc0(sizeof(PgWebArrow));
+  int         encoding = GetDatabaseEncoding();
+  int         i;
+
+  arrow->natts = tupdesc->natts;
+  arrow->columns = palloc0(sizeof(PgWebArrowColumn) * arrow->natts);
+  arrow->convert = encoding != PG_UTF8 && encoding != PG_SQL_ASCII;
+
+  for (i = 0; i < arrow->natts; i++)
+  {
+    Form_pg_attribute  attr = TupleDescAttr(tupdesc, i);
+    PgWebArrowColumn  *col = &arrow->columns[i];
+    const char        *name = NameStr(attr->attname);
+    int                len = strlen(name);
+
+    name = pg_web_arrow_to_utf8(arrow, name, &len);
+    col->name = pnstrdup(name, len);
+    col->kind = pg_web_arrow_kind(attr->atttypid);
+    col->width = pg_web_arrow_width(col->kind);
+    col->outfunc = &outfuncs[i];
+  }
+
+  return arrow;
+}
+
+/*
+ * pg_web_arrow_type
+ *
+ * Append the Arrow type table of the column, returns its position. The
+ * type's union tag is returned in *type_type.
+ */
+static int
+pg_web_arrow_type(StringInfo out, int base, PgWebArrowColumn *col,
+                  int *type_type)
+{
+  static const int int_sizes[2] = {4, 1};         /* bitWidth, is_signed */
+  static const int short_sizes[1] = {2};          /* precision or unit */
+  static const int timestamp_sizes[2] = {2, 4};   /* unit, timezone */
+  int              fields[2];
+  int              table;
+
+  switch (col->kind)
+  {
+    case PG_WEB_ARROW_BOOL:
+      *type_type = PG_WEB_ARROW_TYPE_BOOL;
+      return pg_web_fb_table(out, base, 0, NULL, fields);
+
+    case PG_WEB_ARROW_INT16:
+    case PG_WEB_ARROW_INT32:
+    case PG_WEB_ARROW_INT64:
+    case PG_WEB_ARROW_UINT32:
+      *type_type = PG_WEB_ARROW_TYPE_INT;
+      table = pg_web_fb_table(out, base, 2, int_sizes, fields);
+      pg_web_fb_put(out, fields[0], col->width * 8, 4);
+      pg_web_fb_put(out, fields[1], col->kind != PG_WEB_ARROW_UINT32, 1);
+      return table;
+
+    case PG_WEB_ARROW_FLOAT32:
+    case PG_WEB_ARROW_FLOAT64:
+      *type_type = PG_WEB_ARROW_TYPE_FLOATING_POINT;
+      table = pg_web_fb_table(out, base, 1, short_sizes, fields);
+      /* SINGLE or DOUBLE */
+      pg_web_fb_put(out, fields[0], col->width == 4 ? 1 : 2, 2);
+      return table;
+
+    case PG_WEB_ARROW_DATE32:
+      *type_type = PG_WEB_ARROW_TYPE_DATE;
+      /* the unit is DAY, 0 */
+      return pg_web_fb_table(out, base, 1, short_sizes, fields);
+
+    case PG_WEB_ARROW_TIMESTAMP:
+    case PG_WEB_ARROW_TIMESTAMPTZ:
+      *type_type = PG_WEB_ARROW_TYPE_TIMESTAMP;
+      table = pg_web_fb_table(out, base,
+                              col->kind == PG_WEB_ARROW_TIMESTAMPTZ ? 2 : 1,
+                              timestamp_sizes, fields);
+      /* MICROSECOND */
+      pg_web_fb_put(out, fields[0], 2, 2);
+      if (col->kind == PG_WEB_ARROW_TIMESTAMPTZ)
+        pg_web_fb_link(out, fields[1], pg_web_fb_string(out, base, "UTC"));
+      return table;
+
+    case PG_WEB_ARROW_BINARY:
+      *type_type = PG_WEB_ARROW_TYPE_BINARY;
+      return pg_web_fb_table(out, base, 0, NULL, fields);
+
+    default:
+      *type_type = PG_WEB_ARROW_TYPE_UTF8;
+      return pg_web_fb_table(out, base, 0, NULL, fields);
+  }
+}
+
+/*
+ * pg_web_arrow_schema
+ *
+ * Append the Schema message, which starts the stream.
+ */
+void
+pg_web_arrow_schema(PgWebArrow *arrow, StringInfo out)
+{
+  /* endianness, fields */
+  static const int schema_sizes[2] = {2, 4};
+  /* name, nullable, type_type, type, dictionary, children */
+  static const int field_sizes[6] = {4, 1, 1, 4, 0, 4};
+  int              schema_fields[2];
+  int              base;
+  int              header;
+  int              schema;
+  int              vector;
+  int              i;
+
+  base = pg_web_arrow_message_begin(out, PG_WEB_ARROW_HEADER_SCHEMA, 0,
+                                    &header);
+  schema = pg_web_fb_table(out, base, 2, schema_sizes, schema_fields);
+  pg_web_fb_link(out, header, schema);
+#ifdef WORDS_BIGENDIAN
+  /* the buffers hold the values in our byte order */
+  pg_web_fb_put(out, schema_fields[0], 1, 2);
+#endif
+
+  vector = pg_web_fb_vector(out, base, arrow->natts, 4, 4);
+  pg_web_fb_link(out, schema_fields[1], vector);
+  for (i = 0; i < arrow->natts; i++)
+  {
+    PgWebArrowColumn *col = &arrow->columns[i];
+    int               fields[6];
+    int               field;
+    int               type;
+    int               type_type;
+
+    field = pg_web_fb_table(out, base, 6, field_sizes, fields);
+    pg_web_fb_link(out, vector + 4 + 4 * i, field);
+
+    pg_web_fb_link(out, fields[0], pg_web_fb_string(out, base, col->name));
+    pg_web_fb_put(out, fields[1], 1, 1);
+    type = pg_web_arrow_type(out, base, col, &type_type);
+    pg_web_fb_put(out, fields[2], type_type, 1);
+    pg_web_fb_link(out, fields[3], type);
+    /* readers want the children even of types which have none */
+    pg_web_fb_link(out, fields[5], pg_web_fb_vector(out, base, 0, 4, 4));
+  }
+
+  pg_web_arrow_message_end(out, base);
+}
+
+/*
+ * pg_web_arrow_zeroed
+ *
+ * Make buf hold size zero bytes.
+ */
+static void
+pg_web_arrow_zeroed(StringInfo buf, int size)
+{
+  initStringInfo(buf);
+  enlargeStringInfo(buf, size);
+  memset(buf->data, 0, size);
+  buf->len = size;
+}
+
+/*
+ * pg_web_arrow_set
+ *
+ * Store the value of the column in the given row.
+ */
+static void
+pg_web_arrow_set(PgWebArrow *arrow, PgWebArrowColumn *col,
+                 PgWebArrowBuffers *bufs, int row, Datum value, bool isnull)
+{
+  char *slot = bufs->values.data + row * col->width;
+
+  if (!isnull)
+  {
+    switch (col->kind)
+    {
+      case PG_WEB_ARROW_BOOL:
+        if (DatumGetBool(value))
+          bufs->values.data[row >> 3] |= 1 << (row & 7);
+        break;
+
+      case PG_WEB_ARROW_INT16:
+        {
+          int16 v = DatumGetInt16(value);
+
+          memcpy(slot, &v, sizeof(v));
+        }
+        break;
+
+      case PG_WEB_ARROW_INT32:
+        {
+          int32 v = DatumGetInt32(value);
+
+          memcpy(slot, &v, sizeof(v));
+        }
+        break;
+
+      case PG_WEB_ARROW_INT64:
+        {
+          int64 v = DatumGetInt64(value);
+
+          memcpy(slot, &v, sizeof(v));
+        }
+        break;
+
+      case PG_WEB_ARROW_UINT32:
+        {
+          Oid v = DatumGetObjectId(value);
+
+          memcpy(slot, &v, sizeof(v));
+        }
+        break;
+
+      case PG_WEB_ARROW_FLOAT32:
+        {
+          float4 v = DatumGetFloat4(value);
+
+          memcpy(slot, &v, sizeof(v));
+        }
+        break;
+
+      case PG_WEB_ARROW_FLOAT64:
+        {
+          float8 v = DatumGetFloat8(value);
+
+          memcpy(slot, &v, sizeof(v));
+        }
+        break;
+
+      case PG_WEB_ARROW_DATE32:
+        {
+          DateADT date = DatumGetDateADT(value);
+
+          /* Arrow has no infinity, these become nulls */
+          if (DATE_NOT_FINITE(date))
+            isnull = true;
+          else
+          {
+            int32 v = date + PG_WEB_ARROW_EPOCH_DAYS;
+
+            memcpy(slot, &v, sizeof(v));
+          }
+        }
+        break;
+
+      case PG_WEB_ARROW_TIMESTAMP:
+      case PG_WEB_ARROW_TIMESTAMPTZ:
+        {
+          Timestamp ts = DatumGetTimestamp(value);
+
+          if (TIMESTAMP_NOT_FINITE(ts))
+            isnull = true;
+          else
+          {
+            int64 v = ts + PG_WEB_ARROW_EPOCH_USECS;
+
+            memcpy(slot, &v, sizeof(v));
+          }
+        }
+        break;
+
+      case PG_WEB_ARROW_BINARY:
+      case PG_WEB_ARROW_UTF8:
+        {
+          bytea      *v = DatumGetByteaPP(value);
+          const char *str = VARDATA_ANY(v);
+          int         len = VARSIZE_ANY_EXHDR(v);
+
+          if (col->kind == PG_WEB_ARROW_UTF8)
+            str = pg_web_arrow_to_utf8(arrow, str, &len);
+          appendBinaryStringInfo(&bufs->data, str, len);
+        }
+        break;
+
+      case PG_WEB_ARROW_UTF8_OUT:
+        {
+          const char *str = OutputFunctionCall(col->outfunc, value);
+          int         len = strlen(str);
+
+          str = pg_web_arrow_to_utf8(arrow, str, &len);
+          appendBinaryStringInfo(&bufs->data, str, len);
+        }
+        break;
+    }
+  }
+
+  if (isnull)
+    bufs->null_count++;
+  else
+    bufs->validity.data[row >> 3] |= 1 << (row & 7);
+
+  /* the end of the value is the start of the next one */
+  if (PG_WEB_ARROW_IS_VARLEN(col->kind))
+  {
+    int32 end = bufs->data.len;
+
+    memcpy(bufs->values.data + (row + 1) * sizeof(int32), &end, sizeof(end));
+  }
+}
+
+/*
+ * pg_web_arrow_batch
+ *
+ * Append the tuples as a RecordBatch message. The values are copied
+ * column by column into the buffers Arrow wants, fixed width ones as they
+ * are in the Datums.
+ */
+void
+pg_web_arrow_batch(PgWebArrow *arrow, HeapTuple *tuples, int ntuples,
+                   TupleDesc tupdesc, StringInfo out)
+{
+  /* length, nodes, buffers */
+  static const int   batch_sizes[3] = {8, 4, 4};
+  PgWebArrowBuffers *bufs;
+  Datum             *values;
+  bool              *nulls;
+  StringInfo        *body;
+  int                batch_fields[3];
+  int64              body_length = 0;
+  int64              offset = 0;
+  int                nbuffers = 0;
+  int                base;
+  int                header;
+  int                batch;
+  int                nodes;
+  int                buffers;
+  int                row;
+  int                i;
+
+  bufs = palloc0(sizeof(PgWebArrowBuffers) * arrow->natts);
+  values = palloc(sizeof(Datum) * arrow->natts);
+  nulls = palloc(sizeof(bool) * arrow->natts);
+  body = palloc(sizeof(StringInfo) * arrow->natts * 3);
+
+  for (i = 0; i < arrow->natts; i++)
+  {
+    PgWebArrowColumn *col = &arrow->columns[i];
+
+    pg_web_arrow_zeroed(&bufs[i].validity, (ntuples + 7) / 8);
+    if (col->kind == PG_WEB_ARROW_BOOL)
+      pg_web_arrow_zeroed(&bufs[i].values, (ntuples + 7) / 8);
+    else if (PG_WEB_ARROW_IS_VARLEN(col->kind))
+    {
+      pg_web_arrow_zeroed(&bufs[i].values, (ntuples + 1) * sizeof(int32));
+      initStringInfo(&bufs[i].data);
+    }
+    else
+      pg_web_arrow_zeroed(&bufs[i].values, ntuples * col->width);
+  }
+
+  for (row = 0; row < ntuples; row++)
+  {
+    heap_deform_tuple(tuples[row], tupdesc, values, nulls);
+    for (i = 0; i < arrow->natts; i++)
+      pg_web_arrow_set(arrow, &arrow->columns[i], &bufs[i], row, values[i],
+                       nulls[i]);
+  }
+
+  /* the buffers in the order of the body */
+  for (i = 0; i < arrow->natts; i++)
+  {
+    /* without nulls the bitmap may be left out */
+    if (bufs[i].null_count == 0)
+      bufs[i].validity.len = 0;
+    body[nbuffers++] = &bufs[i].validity;
+    body[nbuffers++] = &bufs[i].values;
+    if (PG_WEB_ARROW_IS_VARLEN(arrow->columns[i].kind))
+      body[nbuffers++] = &bufs[i].data;
+  }
+  for (i = 0; i < nbuffers; i++)
+    body_length += TYPEALIGN(8, body[i]->len);
+
+  base = pg_web_arrow_message_begin(out, PG_WEB_ARROW_HEADER_RECORD_BATCH,
+                                    body_length, &header);
+  batch = pg_web_fb_table(out, base, 3, batch_sizes, batch_fields);
+  pg_web_fb_link(out, header, batch);
+  pg_web_fb_put(out, batch_fields[0], ntuples, 8);
+
+  /* FieldNode structs: length, null_count */
+  nodes = pg_web_fb_vector(out, base, arrow->natts, 16, 8);
+  pg_web_fb_link(out, batch_fields[1], nodes);
+  for (i = 0; i < arrow->natts; i++)
+  {
+    pg_web_fb_put(out, nodes + 4 + 16 * i, ntuples, 8);
+    pg_web_fb_put(out, nodes + 4 + 16 * i + 8, bufs[i].null_count, 8);
+  }
+
+  /* Buffer structs: offset, length */
+  buffers = pg_web_fb_vector(out, base, nbuffers, 16, 8);
+  pg_web_fb_link(out, batch_fields[2], buffers);
+  for (i = 0; i < nbuffers; i++)
+  {
+    pg_web_fb_put(out, buffers + 4 + 16 * i, offset, 8);
+    pg_web_fb_put(out, buffers + 4 + 16 * i + 8, body[i]->len, 8);
+    offset += TYPEALIGN(8, body[i]->len);
+  }
+
+  pg_web_arrow_message_end(out, base);
+
+  for (i = 0; i < nbuffers; i++)
+  {
+    appendBinaryStringInfo(out, body[i]->data, body[i]->len);
+    pg_web_fb_reserve(out, base, 8, 0);
+  }
+}
+
+/*
+ * pg_web_arrow_end
+ *
+ * Append the end-of-stream marker.
+ */
+void
+pg_web_arrow_end(StringInfo out)
+{
+  appendBinaryStringInfo(out, "\377\377\377\377\0\0\0\0", 8);
+}
@@ -0,0 +1,66 @@
+/*
+ * pg_web_arrow.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_ARROW_H
+#define PG_WEB_ARROW_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/htup.h"
+#include "access/tupdesc.h"
+#include "lib/stringinfo.h"
+
+/* media type of Arrow IPC streams */
+#define PG_WEB_ARROW_STREAM_TYPE "application/vnd.apache.arrow.stream"
+
+/* how a column is stored in Arrow */
+typedef enum PgWebArrowKind
+{
+  PG_WEB_ARROW_BOOL,
+  PG_WEB_ARROW_INT16,
+  PG_WEB_ARROW_INT32,
+  PG_WEB_ARROW_INT64,
+  PG_WEB_ARROW_UINT32,          /* oid */
+  PG_WEB_ARROW_FLOAT32,
+  PG_WEB_ARROW_FLOAT64,
+  PG_WEB_ARROW_DATE32,
+  PG_WEB_ARROW_TIMESTAMP,       /* microseconds */
+  PG_WEB_ARROW_TIMESTAMPTZ,     /* microseconds, UTC */
+  PG_WEB_ARROW_BINARY,          /* bytea */
+  PG_WEB_ARROW_UTF8,            /* text types, copied as they are */
+  PG_WEB_ARROW_UTF8_OUT         /* anything else, by its output function */
+} PgWebArrowKind;
+
+typedef struct PgWebArrowColumn
+{
+  char           *name;
+  PgWebArrowKind  kind;
+  int             width;          /* bytes per value, 0 if not fixed */
+  FmgrInfo       *outfunc;
+} PgWebArrowColumn;
+
+/* writer of an Arrow IPC stream, one record batch per fetched batch */
+typedef struct PgWebArrow
+{
+  int               natts;
+  PgWebArrowColumn *columns;
+  bool              convert;      /* the database encoding isn't UTF-8 */
+} PgWebArrow;
+
+PgWebArrow *pg_web_arrow_create(TupleDesc tupdesc, FmgrInfo *outfuncs);
+void pg_web_arrow_schema(PgWebArrow *arrow, StringInfo out);
+void pg_web_arrow_batch(PgWebArrow *arrow, HeapTuple *tuples, int ntuples,
+                        TupleDesc tupdesc, StringInfo out);
+void pg_web_arrow_end(StringInfo out);
+
+#endif
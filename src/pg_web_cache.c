@@ -0,0 +1,773 @@
+/*
+ * pg_web_cache.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_cache.h"
+
+#include "access/xact.h"
+#include "catalog/catalog.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/plannodes.h"
+#include "parser/parsetree.h"
+#if PG_VERSION_NUM >= 100000
+#include "replication/logicalworker.h"
+#endif
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/utility.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/*
+ * Responses are kept in fixed-size slots, grouped in sets of
+ * PG_WEB_CACHE_WAYS; a key can only be in the set its hash picks.
+ *
+ * Whether a response is still valid is told by change counters. Every
+ * backend notes the tables its transaction writes (see
+ * pg_web_cache_executor_end and pg_web_cache_utility), and after the
+ * commit, once the changes are visible, sets their counters to the next
+ * value of a global sequence. A response remembers the sequence as it was
+ * before its snapshot was taken, so it is stale as soon as the counter of
+ * one of its tables is above that. Counters are shared by all tables
+ * hashed to the same bucket, which at worst drops a response too early.
+ * Statements whose effects we can't tell (DDL, mostly) bump the bucket of
+ * the whole database, which every response depends on.
+ *
+ * The counters are kept even without the cache: the entity tags of results
+ * name the counters they depend on (see pg_web_cache_tag), so a client's
+ * If-None-Match can be checked against them without running the query.
+ */
+#define PG_WEB_CACHE_WAYS         4
+#define PG_WEB_CACHE_REL_BUCKETS  4096
+/* tables written by a transaction, before it counts as writing all */
+#define PG_WEB_CACHE_MAX_DIRTY    32
+
+typedef struct PgWebCacheSlot
+{
+  uint32      hash;
+  int         key_len;                /* 0 if the slot is empty */
+  int         body_len;
+  uint64      etag;
+  PgWebCacheDeps deps;
+  char        content_type[PG_WEB_CACHE_TYPE_LEN];
+  char        data[PG_WEB_CACHE_DATA_SIZE];   /* key, then body */
+} PgWebCacheSlot;
+
+typedef struct PgWebCacheShared
+{
+  LWLock         *lock;               /* protects the slots */
+  slock_t         mutex;              /* protects the counters */
+  uint64          seq;
+  uint64          rel_seq[PG_WEB_CACHE_REL_BUCKETS];
+  int             nsets;              /* 0 if pg_web.cache_size is 0 */
+  PgWebCacheSlot  slots[1];           /* VARIABLE LENGTH ARRAY */
+} PgWebCacheShared;
+
+/* the shared counters and cache, NULL if the library isn't preloaded */
+static PgWebCacheShared *pg_web_cache_shared = NULL;
+static int pg_web_cache_nsets = 0;
+
+/* tables written by the current transaction */
+static uint16 pg_web_cache_dirty[PG_WEB_CACHE_MAX_DIRTY];
+static int    pg_web_cache_ndirty = 0;
+static bool   pg_web_cache_dirty_all = false;
+
+/* where a hit's body is copied to */
+static char *pg_web_cache_buffer = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+
+#if PG_VERSION_NUM >= 140000
+#define PG_WEB_UTILITY_PARAMS \
+  PlannedStmt *pstmt, const char *queryString, bool readOnlyTree, \
+  ProcessUtilityContext context, ParamListInfo params, \
+  QueryEnvironment *queryEnv, DestReceiver *dest, QueryCompletion *qc
+#define PG_WEB_UTILITY_ARGS \
+  pstmt, queryString, readOnlyTree, context, params, queryEnv, dest, qc
+#elif PG_VERSION_NUM >= 130000
+#define PG_WEB_UTILITY_PARAMS \
+  PlannedStmt *pstmt, const char *queryString, \
+  ProcessUtilityContext context, ParamListInfo params, \
+  QueryEnvironment *queryEnv, DestReceiver *dest, QueryCompletion *qc
+#define PG_WEB_UTILITY_ARGS \
+  pstmt, queryString, context, params, queryEnv, dest, qc
+#elif PG_VERSION_NUM >= 100000
+#define PG_WEB_UTILITY_PARAMS \
+  PlannedStmt *pstmt, const char *queryString, \
+  ProcessUtilityContext context, ParamListInfo params, \
+  QueryEnvironment *queryEnv, DestReceiver *dest, char *completionTag
+#define PG_WEB_UTILITY_ARGS \
+  pstmt, queryString, context, params, queryEnv, dest, completionTag
+#else
+#define PG_WEB_UTILITY_PARAMS \
+  Node *parsetree, const char *queryString, \
+  ProcessUtilityContext context, ParamListInfo params, \
+  DestReceiver *dest, char *completionTag
+#define PG_WEB_UTILITY_ARGS \
+  parsetree, queryString, context, params, dest, completionTag
+#endif
+
+/*
+ * pg_web_cache_shmem_size
+ *
+ * Size of the cache area.
+ */
+static Size
+pg_web_cache_shmem_size(void)
+{
+  return add_size(offsetof(PgWebCacheShared, slots),
+                  mul_size(mul_size(pg_web_cache_nsets, PG_WEB_CACHE_WAYS),
+                           sizeof(PgWebCacheSlot)));
+}
+
+/*
+ * pg_web_cache_shmem_request
+ *
+ * Ask for the cache area and its lock.
+ */
+static void
+pg_web_cache_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+  if (prev_shmem_request_hook)
+    prev_shmem_request_hook();
+#endif
+  RequestAddinShmemSpace(pg_web_cache_shmem_size());
+#if PG_VERSION_NUM >= 90600
+  RequestNamedLWLockTranche("pg_web cache", 1);
+#else
+  RequestAddinLWLocks(1);
+#endif
+}
+
+/*
+ * pg_web_cache_shmem_startup
+ *
+ * Allocate or attach to the cache area.
+ */
+static void
+pg_web_cache_shmem_startup(void)
+{
+  bool found;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  pg_web_cache_shared = ShmemInitStruct("pg_web cache",
+                                        pg_web_cache_shmem_size(),
+                                        &found);
+  if (!found)
+  {
+    memset(pg_web_cache_shared, 0, pg_web_cache_shmem_size());
+#if PG_VERSION_NUM >= 90600
+    pg_web_cache_shared->lock = &(GetNamedLWLockTranche("pg_web cache"))->lock;
+#else
+    pg_web_cache_shared->lock = LWLockAssign();
+#endif
+    SpinLockInit(&pg_web_cache_shared->mutex);
+    pg_web_cache_shared->nsets = pg_web_cache_nsets;
+  }
+  LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * pg_web_cache_bucket
+ *
+ * Counter bucket of the table, or of the whole database for InvalidOid.
+ */
+static uint16
+pg_web_cache_bucket(Oid relid)
+{
+  Oid dbid = MyDatabaseId;
+
+  if (OidIsValid(relid) && IsSharedRelation(relid))
+    dbid = InvalidOid;
+  return (uint16) (((uint32) dbid * 0x9E3779B1U ^
+                    (uint32) relid * 0x85EBCA6BU) % PG_WEB_CACHE_REL_BUCKETS);
+}
+
+/*
+ * pg_web_cache_mark
+ *
+ * Note that the current transaction writes the table.
+ */
+static void
+pg_web_cache_mark(Oid relid)
+{
+  uint16 bucket = pg_web_cache_bucket(relid);
+  int    i;
+
+  for (i = 0; i < pg_web_cache_ndirty; i++)
+    if (pg_web_cache_dirty[i] == bucket)
+      return;
+  if (pg_web_cache_ndirty == PG_WEB_CACHE_MAX_DIRTY)
+    pg_web_cache_dirty_all = true;
+  else
+    pg_web_cache_dirty[pg_web_cache_ndirty++] = bucket;
+}
+
+/*
+ * pg_web_cache_mark_rangevar
+ *
+ * As pg_web_cache_mark, for a table named in a statement.
+ */
+static void
+pg_web_cache_mark_rangevar(RangeVar *relation)
+{
+  Oid relid = RangeVarGetRelid(relation, NoLock, true);
+
+  if (!OidIsValid(relid))
+    pg_web_cache_dirty_all = true;
+#if PG_VERSION_NUM >= 100000
+  /* the rows go to partitions we don't know of here */
+  else if (get_rel_relkind(relid) == RELKIND_PARTITIONED_TABLE)
+    pg_web_cache_dirty_all = true;
+#endif
+  else
+    pg_web_cache_mark(relid);
+}
+
+/*
+ * pg_web_cache_executor_end
+ *
+ * ExecutorEnd hook, notes the tables the statement wrote.
+ */
+static void
+pg_web_cache_executor_end(QueryDesc *queryDesc)
+{
+  PlannedStmt *stmt = queryDesc->plannedstmt;
+  ListCell    *lc;
+
+  foreach(lc, stmt->resultRelations)
+  {
+    RangeTblEntry *rte = rt_fetch(lfirst_int(lc), stmt->rtable);
+
+#if PG_VERSION_NUM >= 100000
+    if (rte->relkind == RELKIND_PARTITIONED_TABLE)
+    {
+      pg_web_cache_dirty_all = true;
+      continue;
+    }
+#endif
+    pg_web_cache_mark(rte->relid);
+  }
+
+  if (prev_ExecutorEnd)
+    prev_ExecutorEnd(queryDesc);
+  else
+    standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * pg_web_cache_utility
+ *
+ * ProcessUtility hook. COPY FROM writes one table, the statements listed
+ * here write none (or do it through the executor), anything else may
+ * change what any query returns.
+ */
+static void
+pg_web_cache_utility(PG_WEB_UTILITY_PARAMS)
+{
+#if PG_VERSION_NUM >= 100000
+  Node *parsetree = pstmt->utilityStmt;
+#endif
+
+  switch (nodeTag(parsetree))
+  {
+    case T_TransactionStmt:
+      /* the prepared transaction's tables are long forgotten */
+      if (((TransactionStmt *) parsetree)->kind == TRANS_STMT_COMMIT_PREPARED)
+        pg_web_cache_dirty_all = true;
+      break;
+    case T_CopyStmt:
+      if (((CopyStmt *) parsetree)->is_from)
+        pg_web_cache_mark_rangevar(((CopyStmt *) parsetree)->relation);
+      break;
+    case T_VariableSetStmt:
+    case T_VariableShowStmt:
+    case T_ExplainStmt:
+    case T_PrepareStmt:
+    case T_ExecuteStmt:
+    case T_DeallocateStmt:
+    case T_DeclareCursorStmt:
+    case T_FetchStmt:
+    case T_ClosePortalStmt:
+    case T_NotifyStmt:
+    case T_ListenStmt:
+    case T_UnlistenStmt:
+    case T_LockStmt:
+    case T_DiscardStmt:
+    case T_ConstraintsSetStmt:
+    case T_CheckPointStmt:
+    case T_VacuumStmt:
+    case T_LoadStmt:
+    case T_DoStmt:
+#if PG_VERSION_NUM >= 110000
+    case T_CallStmt:
+#endif
+      break;
+    default:
+      pg_web_cache_dirty_all = true;
+      break;
+  }
+
+  if (prev_ProcessUtility)
+    prev_ProcessUtility(PG_WEB_UTILITY_ARGS);
+  else
+    standard_ProcessUtility(PG_WEB_UTILITY_ARGS);
+}
+
+/*
+ * pg_web_cache_xact_callback
+ *
+ * Bump the counters of the tables the transaction wrote once its changes
+ * are visible, that is after the commit. Logical replication applies its
+ * changes without the executor hooks, so its commits count as writing all.
+ */
+static void
+pg_web_cache_xact_callback(XactEvent event, void *arg)
+{
+  volatile PgWebCacheShared *shared = pg_web_cache_shared;
+  uint64                     seq;
+  int                        i;
+
+  switch (event)
+  {
+    case XACT_EVENT_COMMIT:
+#if PG_VERSION_NUM >= 100000
+      if (IsLogicalWorker())
+        pg_web_cache_dirty_all = true;
+#endif
+      if (pg_web_cache_ndirty == 0 && !pg_web_cache_dirty_all)
+        break;
+      SpinLockAcquire(&shared->mutex);
+      seq = ++shared->seq;
+      if (pg_web_cache_dirty_all)
+        shared->rel_seq[pg_web_cache_bucket(InvalidOid)] = seq;
+      for (i = 0; i < pg_web_cache_ndirty; i++)
+        shared->rel_seq[pg_web_cache_dirty[i]] = seq;
+      SpinLockRelease(&shared->mutex);
+      break;
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PREPARE:
+      break;
+    default:
+      return;
+  }
+
+  pg_web_cache_ndirty = 0;
+  pg_web_cache_dirty_all = false;
+}
+
+/*
+ * pg_web_cache_init
+ *
+ * Reserve shared memory for the change counters and a cache of
+ * pg_web.cache_size, and start tracking the writes of all backends. Must
+ * be called from _PG_init while the library is preloaded.
+ */
+void
+pg_web_cache_init(void)
+{
+  if (pg_web_setting_cache_size > 0)
+    pg_web_cache_nsets = Max(pg_web_setting_cache_size * 1024L /
+                             (PG_WEB_CACHE_WAYS * sizeof(PgWebCacheSlot)),
+                             1);
+
+#if PG_VERSION_NUM >= 150000
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = pg_web_cache_shmem_request;
+#else
+  pg_web_cache_shmem_request();
+#endif
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = pg_web_cache_shmem_startup;
+
+  prev_ExecutorEnd = ExecutorEnd_hook;
+  ExecutorEnd_hook = pg_web_cache_executor_end;
+  prev_ProcessUtility = ProcessUtility_hook;
+  ProcessUtility_hook = pg_web_cache_utility;
+  RegisterXactCallback(pg_web_cache_xact_callback, NULL);
+}
+
+/*
+ * pg_web_cache_enabled
+ */
+bool
+pg_web_cache_enabled(void)
+{
+  return pg_web_cache_shared != NULL && pg_web_cache_shared->nsets > 0 &&
+         pg_web_setting_cache_ttl > 0;
+}
+
+/*
+ * pg_web_cache_deps_begin
+ *
+ * Start collecting the dependencies of a result. Must be called before
+ * its snapshot is taken.
+ */
+void
+pg_web_cache_deps_begin(PgWebCacheDeps *deps)
+{
+  volatile PgWebCacheShared *shared = pg_web_cache_shared;
+
+  deps->seq = 0;
+  deps->taken = GetCurrentTimestamp();
+  deps->nbuckets = -1;
+  /* an older snapshot could miss changes counted before seq */
+  if (shared == NULL || IsolationUsesXactSnapshot())
+    return;
+
+  SpinLockAcquire(&shared->mutex);
+  deps->seq = shared->seq;
+  SpinLockRelease(&shared->mutex);
+
+  deps->buckets[0] = pg_web_cache_bucket(InvalidOid);
+  deps->nbuckets = 1;
+}
+
+/*
+ * pg_web_cache_deps_add
+ *
+ * Add the tables the portal's plans read.
+ */
+void
+pg_web_cache_deps_add(PgWebCacheDeps *deps, Portal portal)
+{
+  ListCell *lc;
+
+  foreach(lc, portal->stmts)
+  {
+    Node     *stmt = (Node *) lfirst(lc);
+    ListCell *rc;
+
+    if (!IsA(stmt, PlannedStmt))
+    {
+      deps->nbuckets = -1;
+      return;
+    }
+    foreach(rc, ((PlannedStmt *) stmt)->relationOids)
+    {
+      uint16 bucket = pg_web_cache_bucket(lfirst_oid(rc));
+      int    i;
+
+      if (deps->nbuckets < 0)
+        return;
+      for (i = 0; i < deps->nbuckets; i++)
+        if (deps->buckets[i] == bucket)
+          break;
+      if (i < deps->nbuckets)
+        continue;
+      if (deps->nbuckets == PG_WEB_CACHE_MAX_DEPS)
+        deps->nbuckets = -1;
+      else
+        deps->buckets[deps->nbuckets++] = bucket;
+    }
+  }
+}
+
+/*
+ * pg_web_cache_hash_more
+ *
+ * FNV-1a hash of the data, continuing from hash.
+ */
+static uint32
+pg_web_cache_hash_more(uint32 hash, const char *data, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char) data[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/*
+ * pg_web_cache_hash
+ *
+ * FNV-1a hash of the key.
+ */
+static uint32
+pg_web_cache_hash(const char *key, int len)
+{
+  return pg_web_cache_hash_more(2166136261U, key, len);
+}
+
+/*
+ * pg_web_cache_fresh
+ *
+ * Is a result with these dependencies still valid: younger than
+ * pg_web.cache_ttl, and none of its tables changed since?
+ */
+static bool
+pg_web_cache_fresh(PgWebCacheDeps *deps, TimestampTz now)
+{
+  volatile PgWebCacheShared *shared = pg_web_cache_shared;
+  bool                       fresh = true;
+  int                        i;
+
+  if (deps->nbuckets < 0 ||
+      TimestampTzPlusMilliseconds(deps->taken,
+                                  pg_web_setting_cache_ttl) <= now)
+    return false;
+
+  SpinLockAcquire(&shared->mutex);
+  for (i = 0; i < deps->nbuckets; i++)
+  {
+    if (shared->rel_seq[deps->buckets[i]] > deps->seq)
+    {
+      fresh = false;
+      break;
+    }
+  }
+  SpinLockRelease(&shared->mutex);
+  return fresh;
+}
+
+/*
+ * pg_web_cache_get
+ *
+ * Look up the response stored under the key. On a hit its ETag, its
+ * dependencies and content type are copied to hit, and hit->body points to
+ * the body, which is valid until the next call. Takes no transaction.
+ */
+bool
+pg_web_cache_get(const char *key, PgWebCacheHit *hit)
+{
+  int             key_len = strlen(key);
+  uint32          hash;
+  PgWebCacheSlot *set;
+  TimestampTz     now;
+  bool            found = false;
+  int             i;
+
+  if (!pg_web_cache_enabled())
+    return false;
+  if (pg_web_cache_buffer == NULL)
+    pg_web_cache_buffer = MemoryContextAlloc(TopMemoryContext,
+                                             PG_WEB_CACHE_DATA_SIZE);
+
+  hash = pg_web_cache_hash(key, key_len);
+  set = &pg_web_cache_shared->slots[(hash % pg_web_cache_shared->nsets) *
+                                    PG_WEB_CACHE_WAYS];
+  now = GetCurrentTimestamp();
+
+  LWLockAcquire(pg_web_cache_shared->lock, LW_SHARED);
+  for (i = 0; i < PG_WEB_CACHE_WAYS; i++)
+  {
+    PgWebCacheSlot *slot = &set[i];
+
+    if (slot->key_len != key_len || slot->hash != hash ||
+        memcmp(slot->data, key, key_len) != 0)
+      continue;
+    if (pg_web_cache_fresh(&slot->deps, now))
+    {
+      found = true;
+      hit->etag = slot->etag;
+      hit->deps = slot->deps;
+      strlcpy(hit->content_type, slot->content_type, PG_WEB_CACHE_TYPE_LEN);
+      memcpy(pg_web_cache_buffer, slot->data + key_len, slot->body_len);
+      hit->body = pg_web_cache_buffer;
+      hit->len = slot->body_len;
+    }
+    break;
+  }
+  LWLockRelease(pg_web_cache_shared->lock);
+
+  return found;
+}
+
+/*
+ * pg_web_cache_put
+ *
+ * Store the response under the key for pg_web.cache_ttl, or until one of
+ * the tables it depends on changes. It replaces an older response for the
+ * key, or else the oldest one of its set. Responses which don't fit into a
+ * slot aren't kept; their ETags answer conditional requests all the same.
+ */
+void
+pg_web_cache_put(const char *key, const char *content_type,
+                 const char *body, int len, uint64 etag,
+                 PgWebCacheDeps *deps)
+{
+  int             key_len = strlen(key);
+  uint32          hash;
+  PgWebCacheSlot *set;
+  PgWebCacheSlot *victim = NULL;
+  int             i;
+
+  if (!pg_web_cache_enabled() || deps->nbuckets < 0 ||
+      key_len + len > PG_WEB_CACHE_DATA_SIZE ||
+      strlen(content_type) >= PG_WEB_CACHE_TYPE_LEN)
+    return;
+
+  hash = pg_web_cache_hash(key, key_len);
+  set = &pg_web_cache_shared->slots[(hash % pg_web_cache_shared->nsets) *
+                                    PG_WEB_CACHE_WAYS];
+
+  LWLockAcquire(pg_web_cache_shared->lock, LW_EXCLUSIVE);
+  for (i = 0; i < PG_WEB_CACHE_WAYS; i++)
+  {
+    PgWebCacheSlot *slot = &set[i];
+
+    if (slot->key_len == key_len && slot->hash == hash &&
+        memcmp(slot->data, key, key_len) == 0)
+    {
+      victim = slot;
+      break;
+    }
+    /* empty slots are the oldest, they are taken first */
+    if (victim == NULL || slot->deps.taken < victim->deps.taken)
+      victim = slot;
+  }
+
+  victim->hash = hash;
+  victim->key_len = key_len;
+  victim->body_len = len;
+  victim->etag = etag;
+  victim->deps = *deps;
+  strlcpy(victim->content_type, content_type, PG_WEB_CACHE_TYPE_LEN);
+  memcpy(victim->data, key, key_len);
+  if (len > 0)
+    memcpy(victim->data + key_len, body, len);
+  LWLockRelease(pg_web_cache_shared->lock);
+}
+
+/*
+ * pg_web_cache_etag
+ *
+ * 64-bit FNV-1a hash of a response body, the part of its entity tag which
+ * depends on the content, see pg_web_cache_tag.
+ */
+uint64
+pg_web_cache_etag(const char *body, int len)
+{
+  uint64 hash = UINT64CONST(14695981039346656037);
+  int    i;
+
+  for (i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char) body[i];
+    hash *= UINT64CONST(1099511628211);
+  }
+  return hash;
+}
+
+/*
+ * pg_web_cache_tag
+ *
+ * Entity tag, unquoted, of the response to the request with the key. If
+ * the change counters tell when the result becomes stale, the tag names
+ * them besides the body's hash and length:
+ *
+ *   hash.len.seq.taken.bucket...check
+ *
+ * with check a hash of the key and the rest, so pg_web_cache_tag_valid can
+ * answer a conditional request from the counters alone. Otherwise the tag
+ * is the hash, and the client only gets 304 once the result is computed
+ * again and didn't change.
+ */
+void
+pg_web_cache_tag(char *tag, const char *key, uint64 etag, int len,
+                 PgWebCacheDeps *deps)
+{
+  int n;
+  int i;
+
+  n = snprintf(tag, PG_WEB_CACHE_TAG_LEN, "%08x%08x",
+               (uint32) (etag >> 32), (uint32) etag);
+  if (deps == NULL || deps->nbuckets < 0 || pg_web_setting_cache_ttl == 0)
+    return;
+
+  n += snprintf(tag + n, PG_WEB_CACHE_TAG_LEN - n,
+                ".%x." UINT64_FORMAT "." INT64_FORMAT,
+                len, deps->seq, (int64) deps->taken);
+  for (i = 0; i < deps->nbuckets; i++)
+    n += snprintf(tag + n, PG_WEB_CACHE_TAG_LEN - n, ".%x",
+                  deps->buckets[i]);
+  snprintf(tag + n, PG_WEB_CACHE_TAG_LEN - n, ".%08x",
+           pg_web_cache_hash_more(pg_web_cache_hash(key, strlen(key)),
+                                  tag, n));
+}
+
+/*
+ * pg_web_cache_tag_valid
+ *
+ * Is the tag one pg_web_cache_tag made for the key, of a result which is
+ * still valid? Then *len is set to the length of the body it names. Takes
+ * no transaction and doesn't need the response to be in the cache.
+ */
+bool
+pg_web_cache_tag_valid(const char *key, const char *tag, int tag_len,
+                       int *len)
+{
+  char            buf[PG_WEB_CACHE_TAG_LEN];
+  char           *dot;
+  char           *p;
+  char           *end;
+  PgWebCacheDeps  deps;
+  unsigned long   value;
+
+  if (pg_web_cache_shared == NULL || tag_len >= PG_WEB_CACHE_TAG_LEN)
+    return false;
+  memcpy(buf, tag, tag_len);
+  buf[tag_len] = '\0';
+
+  /* a tag of another key, or not ours at all */
+  dot = strrchr(buf, '.');
+  if (dot == NULL ||
+      strtoul(dot + 1, &end, 16) !=
+        pg_web_cache_hash_more(pg_web_cache_hash(key, strlen(key)),
+                               buf, dot - buf) ||
+      *end != '\0')
+    return false;
+  *dot = '\0';
+
+  /* the hash of the body doesn't matter here */
+  p = strchr(buf, '.');
+  if (p == NULL)
+    return false;
+  *len = (int) strtoul(p + 1, &end, 16);
+  if (*end != '.')
+    return false;
+  deps.seq = strtoull(end + 1, &end, 10);
+  if (*end != '.')
+    return false;
+  deps.taken = strtoll(end + 1, &end, 10);
+
+  deps.nbuckets = 0;
+  while (*end == '.' && deps.nbuckets < PG_WEB_CACHE_MAX_DEPS)
+  {
+    value = strtoul(end + 1, &end, 16);
+    if (value >= PG_WEB_CACHE_REL_BUCKETS)
+      return false;
+    deps.buckets[deps.nbuckets++] = (uint16) value;
+  }
+  if (*end != '\0' || deps.nbuckets == 0)
+    return false;
+
+  return pg_web_cache_fresh(&deps, GetCurrentTimestamp());
+}
@@ -0,0 +1,71 @@
+/*
+ * pg_web_cache.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_CACHE_H
+#define PG_WEB_CACHE_H
+
+#include "postgres.h"
+#include "utils/portal.h"
+#include "utils/timestamp.h"
+
+/* largest response body which is cached */
+#define PG_WEB_CACHE_DATA_SIZE  32000
+/* longest content type of a cached response */
+#define PG_WEB_CACHE_TYPE_LEN   64
+/* tables a cached response may depend on */
+#define PG_WEB_CACHE_MAX_DEPS   16
+/* size of an entity tag made by pg_web_cache_tag, with the final NUL */
+#define PG_WEB_CACHE_TAG_LEN    144
+
+/*
+ * What a result depends on: the change counters of the tables it was read
+ * from (see pg_web_cache.c) and their value when its snapshot was taken.
+ * nbuckets is -1 if the result can't be cached.
+ */
+typedef struct PgWebCacheDeps
+{
+  uint64      seq;
+  TimestampTz taken;
+  int         nbuckets;
+  uint16      buckets[PG_WEB_CACHE_MAX_DEPS];
+} PgWebCacheDeps;
+
+/* a response found in the cache */
+typedef struct PgWebCacheHit
+{
+  uint64          etag;
+  PgWebCacheDeps  deps;
+  char            content_type[PG_WEB_CACHE_TYPE_LEN];
+  char           *body;
+  int             len;
+} PgWebCacheHit;
+
+/* GUC variables, see pg_web.c */
+extern int pg_web_setting_cache_size;
+extern int pg_web_setting_cache_ttl;
+
+void pg_web_cache_init(void);
+bool pg_web_cache_enabled(void);
+void pg_web_cache_deps_begin(PgWebCacheDeps *deps);
+void pg_web_cache_deps_add(PgWebCacheDeps *deps, Portal portal);
+bool pg_web_cache_get(const char *key, PgWebCacheHit *hit);
+void pg_web_cache_put(const char *key, const char *content_type,
+                      const char *body, int len, uint64 etag,
+                      PgWebCacheDeps *deps);
+uint64 pg_web_cache_etag(const char *body, int len);
+void pg_web_cache_tag(char *tag, const char *key, uint64 etag, int len,
+                      PgWebCacheDeps *deps);
+bool pg_web_cache_tag_valid(const char *key, const char *tag, int tag_len,
+                            int *len);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * pg_web_compress.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_compress.h"
+
+#include <zlib.h>
+
+#include "utils/memutils.h"
+
+#include "pg_web_stats.h"
+
+/*
+ * A compressed response body being written. zlib allocates its state in
+ * the memory context the compressor was made in.
+ */
+struct PgWebCompressor
+{
+  z_stream      zs;
+  MemoryContext mcxt;
+};
+
+/*
+ * pg_web_compress_alloc
+ *
+ * zlib's allocator.
+ */
+static voidpf
+pg_web_compress_alloc(voidpf opaque, uInt items, uInt size)
+{
+  return MemoryContextAlloc((MemoryContext) opaque, (Size) items * size);
+}
+
+/*
+ * pg_web_compress_free
+ *
+ * zlib's deallocator.
+ */
+static void
+pg_web_compress_free(voidpf opaque, voidpf address)
+{
+  pfree(address);
+}
+
+/*
+ * pg_web_encoding_name
+ *
+ * The encoding as it is named in Content-Encoding.
+ */
+const char *
+pg_web_encoding_name(PgWebEncoding encoding)
+{
+  switch (encoding)
+  {
+    case PG_WEB_ENCODING_GZIP:
+      return "gzip";
+    case PG_WEB_ENCODING_DEFLATE:
+      return "deflate";
+    default:
+      return "identity";
+  }
+}
+
+/*
+ * pg_web_compress_begin
+ *
+ * Start compressing a body with pg_web.compression_level, in the current
+ * memory context. "deflate" is the zlib format, as RFC 9110 has it.
+ */
+PgWebCompressor *
+pg_web_compress_begin(PgWebEncoding encoding)
+{
+  PgWebCompressor *compressor = palloc0(sizeof(PgWebCompressor));
+  int              window_bits = MAX_WBITS;
+
+  if (encoding == PG_WEB_ENCODING_GZIP)
+    window_bits += 16;
+
+  compressor->mcxt = CurrentMemoryContext;
+  compressor->zs.zalloc = pg_web_compress_alloc;
+  compressor->zs.zfree = pg_web_compress_free;
+  compressor->zs.opaque = (voidpf) compressor->mcxt;
+  if (deflateInit2(&compressor->zs, pg_web_setting_compression_level,
+                   Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    elog(ERROR, "pg_web: could not initialize compression: %s",
+         compressor->zs.msg ? compressor->zs.msg : "unknown error");
+  return compressor;
+}
+
+/*
+ * pg_web_compress
+ *
+ * Compress the next part of the body and append it to out. Everything
+ * given so far is flushed, so the client can decode it without waiting
+ * for more; with finish the body ends here.
+ */
+void
+pg_web_compress(PgWebCompressor *compressor, const char *data, int len,
+                bool finish, StringInfo out)
+{
+  z_stream *zs = &compressor->zs;
+  int       start = out->len;
+  int       rc;
+
+  zs->next_in = (Bytef *) data;
+  zs->avail_in = len;
+  /* about the bound of one deflate call, more rounds if that is not it */
+  enlargeStringInfo(out, deflateBound(zs, len) + 16);
+  do
+  {
+    if (out->maxlen - out->len - 1 < 64)
+      enlargeStringInfo(out, out->maxlen);
+    zs->next_out = (Bytef *) out->data + out->len;
+    zs->avail_out = out->maxlen - out->len - 1;
+    rc = deflate(zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+    if (rc == Z_STREAM_ERROR)
+      elog(ERROR, "pg_web: compression failed");
+    out->len = (char *) zs->next_out - out->data;
+  } while (zs->avail_out == 0 || (finish && rc != Z_STREAM_END));
+  out->data[out->len] = '\0';
+
+  if (MyWebStats != NULL)
+  {
+    MyWebStats->compress_bytes_in += len;
+    MyWebStats->compress_bytes_out += out->len - start;
+  }
+}
+
+/*
+ * pg_web_compress_end
+ *
+ * Free the compressor, whether or not the body was finished.
+ */
+void
+pg_web_compress_end(PgWebCompressor *compressor)
+{
+  deflateEnd(&compressor->zs);
+  pfree(compressor);
+}
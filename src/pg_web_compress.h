@@ -0,0 +1,40 @@
+/*
+ * pg_web_compress.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_COMPRESS_H
+#define PG_WEB_COMPRESS_H
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+/* content codings we compress responses with */
+typedef enum PgWebEncoding
+{
+  PG_WEB_ENCODING_IDENTITY,
+  PG_WEB_ENCODING_GZIP,
+  PG_WEB_ENCODING_DEFLATE
+} PgWebEncoding;
+
+typedef struct PgWebCompressor PgWebCompressor;
+
+/* GUC variables, see pg_web.c */
+extern int pg_web_setting_compression_level;
+extern int pg_web_setting_compression_min_size;
+
+const char *pg_web_encoding_name(PgWebEncoding encoding);
+PgWebCompressor *pg_web_compress_begin(PgWebEncoding encoding);
+void pg_web_compress(PgWebCompressor *compressor, const char *data, int len,
+                     bool finish, StringInfo out);
+void pg_web_compress_end(PgWebCompressor *compressor);
+
+#endif
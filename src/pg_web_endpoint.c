@@ -0,0 +1,403 @@
+/*
+ * pg_web_endpoint.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_endpoint.h"
+
+#include "access/genam.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#endif
+#include "catalog/indexing.h"
+#include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "lib/ilist.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+PG_FUNCTION_INFO_V1(pg_web_endpoints_changed);
+
+Datum pg_web_endpoints_changed(PG_FUNCTION_ARGS);
+
+/*
+ * A prepared endpoint. The plan is kept with SPI_keepplan, so it survives
+ * the transaction, and is replanned by the plan cache when the tables it
+ * uses change. Names which aren't defined are kept too, without a plan, so
+ * requests for them don't read pg_web_endpoints every time.
+ */
+typedef struct PgWebEndpoint
+{
+  char          name[NAMEDATALEN];  /* hash key */
+  MemoryContext mcxt;               /* everything below, NULL if undefined */
+  SPIPlanPtr    plan;
+  int           nparams;
+  char        **params;             /* request parameters for $1, $2, ... */
+  FmgrInfo     *infuncs;
+  Oid          *typioparams;
+  dlist_node    lru_node;           /* most recently used first */
+} PgWebEndpoint;
+
+static HTAB          *pg_web_endpoints = NULL;
+static dlist_head     pg_web_endpoint_lru;
+static int            pg_web_endpoint_count = 0;
+static MemoryContext  pg_web_endpoint_cxt = NULL;
+/* the definitions changed, see pg_web_endpoint_invalidate */
+static bool           pg_web_endpoints_stale = false;
+static Oid            pg_web_endpoints_relid = InvalidOid;
+
+/*
+ * pg_web_endpoint_invalidate
+ *
+ * Relcache callback. pg_web_endpoints_changed invalidates the relcache
+ * entry of the table on every change, so this tells us to drop the plans.
+ * They are dropped on the next lookup, not here, in the middle of whatever
+ * processes the invalidation.
+ */
+static void
+pg_web_endpoint_invalidate(Datum arg, Oid relid)
+{
+  if (relid == InvalidOid || relid == pg_web_endpoints_relid)
+    pg_web_endpoints_stale = true;
+}
+
+/*
+ * pg_web_endpoint_forget
+ *
+ * Drop the endpoint from the cache.
+ */
+static void
+pg_web_endpoint_forget(PgWebEndpoint *endpoint)
+{
+  dlist_delete(&endpoint->lru_node);
+  if (endpoint->plan != NULL)
+  {
+    SPI_freeplan(endpoint->plan);
+    MemoryContextDelete(endpoint->mcxt);
+  }
+  hash_search(pg_web_endpoints, endpoint->name, HASH_REMOVE, NULL);
+  pg_web_endpoint_count--;
+}
+
+/*
+ * pg_web_endpoint_init
+ *
+ * Create the cache on first use.
+ */
+static void
+pg_web_endpoint_init(void)
+{
+  HASHCTL ctl;
+  int     flags = HASH_ELEM | HASH_CONTEXT;
+
+  pg_web_endpoint_cxt = AllocSetContextCreate(TopMemoryContext,
+                                              "pg_web endpoints",
+                                              ALLOCSET_DEFAULT_MINSIZE,
+                                              ALLOCSET_DEFAULT_INITSIZE,
+                                              ALLOCSET_DEFAULT_MAXSIZE);
+
+  MemSet(&ctl, 0, sizeof(ctl));
+  ctl.keysize = NAMEDATALEN;
+  ctl.entrysize = sizeof(PgWebEndpoint);
+  ctl.hcxt = pg_web_endpoint_cxt;
+#if PG_VERSION_NUM >= 140000
+  flags |= HASH_STRINGS;
+#endif
+  pg_web_endpoints = hash_create("pg_web endpoints", 64, &ctl, flags);
+  dlist_init(&pg_web_endpoint_lru);
+
+  CacheRegisterRelcacheCallback(pg_web_endpoint_invalidate, (Datum) 0);
+}
+
+/*
+ * pg_web_endpoint_schema
+ *
+ * Schema the extension was created in, where pg_web_endpoints is.
+ */
+static Oid
+pg_web_endpoint_schema(void)
+{
+  Oid extoid = get_extension_oid("pg_web", false);
+#if PG_VERSION_NUM >= 160000
+  return get_extension_schema(extoid);
+#else
+  Oid          schema = InvalidOid;
+  Relation     rel;
+  ScanKeyData  key;
+  SysScanDesc  scan;
+  HeapTuple    tuple;
+
+  /* get_extension_schema is static before PostgreSQL 16 */
+#if PG_VERSION_NUM >= 120000
+  rel = table_open(ExtensionRelationId, AccessShareLock);
+  ScanKeyInit(&key, Anum_pg_extension_oid, BTEqualStrategyNumber, F_OIDEQ,
+              ObjectIdGetDatum(extoid));
+#else
+  rel = heap_open(ExtensionRelationId, AccessShareLock);
+  ScanKeyInit(&key, ObjectIdAttributeNumber, BTEqualStrategyNumber, F_OIDEQ,
+              ObjectIdGetDatum(extoid));
+#endif
+  scan = systable_beginscan(rel, ExtensionOidIndexId, true, NULL, 1, &key);
+  tuple = systable_getnext(scan);
+  if (HeapTupleIsValid(tuple))
+    schema = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+  systable_endscan(scan);
+#if PG_VERSION_NUM >= 120000
+  table_close(rel, AccessShareLock);
+#else
+  heap_close(rel, AccessShareLock);
+#endif
+  return schema;
+#endif
+}
+
+/*
+ * pg_web_endpoint_make_room
+ *
+ * Evict the least recently used endpoints until there is room for one.
+ */
+static void
+pg_web_endpoint_make_room(void)
+{
+  while (pg_web_endpoint_count >= pg_web_setting_endpoint_cache_size &&
+         !dlist_is_empty(&pg_web_endpoint_lru))
+    pg_web_endpoint_forget(dlist_container(PgWebEndpoint, lru_node,
+                                           dlist_tail_node(&pg_web_endpoint_lru)));
+}
+
+/*
+ * pg_web_endpoint_load
+ *
+ * Read the definition of the endpoint from pg_web_endpoints and prepare
+ * it. If there is no such endpoint that is remembered, without a plan.
+ */
+static PgWebEndpoint *
+pg_web_endpoint_load(const char *key)
+{
+  Oid            argtypes[1] = {TEXTOID};
+  Datum          args[1];
+  Oid            schema;
+  char          *query;
+  HeapTuple      tuple;
+  TupleDesc      tupdesc;
+  char          *sql;
+  Datum         *params;
+  Datum         *types;
+  int            nparams;
+  int            ntypes;
+  bool           isnull;
+  char         **names;
+  Oid           *argoids;
+  FmgrInfo      *infuncs;
+  Oid           *typioparams;
+  SPIPlanPtr     plan;
+  MemoryContext  mcxt;
+  MemoryContext  oldcontext;
+  PgWebEndpoint *endpoint;
+  bool           found;
+  int            i;
+
+  /* not whatever the search_path finds first */
+  schema = pg_web_endpoint_schema();
+  pg_web_endpoints_relid = get_relname_relid("pg_web_endpoints", schema);
+  query = psprintf("SELECT query, params, types::oid[] FROM %s "
+                   "WHERE name = $1",
+                   quote_qualified_identifier(get_namespace_name(schema),
+                                              "pg_web_endpoints"));
+
+  args[0] = CStringGetTextDatum(key);
+  if (SPI_execute_with_args(query, 1, argtypes, args, NULL, true,
+                            1) != SPI_OK_SELECT)
+    elog(ERROR, "pg_web: could not read pg_web_endpoints");
+  if (SPI_processed == 0)
+  {
+    pg_web_endpoint_make_room();
+    endpoint = hash_search(pg_web_endpoints, key, HASH_ENTER, &found);
+    Assert(!found);
+    endpoint->mcxt = NULL;
+    endpoint->plan = NULL;
+    endpoint->nparams = 0;
+    dlist_push_head(&pg_web_endpoint_lru, &endpoint->lru_node);
+    pg_web_endpoint_count++;
+    return endpoint;
+  }
+
+  tuple = SPI_tuptable->vals[0];
+  tupdesc = SPI_tuptable->tupdesc;
+  sql = SPI_getvalue(tuple, tupdesc, 1);
+  deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(tuple, tupdesc, 2,
+                                                     &isnull)),
+                    TEXTOID, -1, false, 'i', &params, NULL, &nparams);
+  deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(tuple, tupdesc, 3,
+                                                     &isnull)),
+                    OIDOID, sizeof(Oid), true, 'i', &types, NULL, &ntypes);
+  if (nparams != ntypes)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("endpoint \"%s\" has %d params but %d types",
+                    key, nparams, ntypes)));
+
+  /* make room first, a new plan must not be the one evicted */
+  pg_web_endpoint_make_room();
+
+  mcxt = AllocSetContextCreate(pg_web_endpoint_cxt,
+                               "pg_web endpoint",
+                               ALLOCSET_SMALL_MINSIZE,
+                               ALLOCSET_SMALL_INITSIZE,
+                               ALLOCSET_SMALL_MAXSIZE);
+  oldcontext = MemoryContextSwitchTo(mcxt);
+  names = palloc(sizeof(char *) * Max(nparams, 1));
+  argoids = palloc(sizeof(Oid) * Max(nparams, 1));
+  infuncs = palloc(sizeof(FmgrInfo) * Max(nparams, 1));
+  typioparams = palloc(sizeof(Oid) * Max(nparams, 1));
+
+  /* nothing is left behind if the SQL doesn't prepare */
+  PG_TRY();
+  {
+    for (i = 0; i < nparams; i++)
+    {
+      Oid infunc;
+
+      names[i] = TextDatumGetCString(params[i]);
+      argoids[i] = DatumGetObjectId(types[i]);
+      getTypeInputInfo(argoids[i], &infunc, &typioparams[i]);
+      fmgr_info_cxt(infunc, &infuncs[i], mcxt);
+    }
+
+    plan = SPI_prepare(sql, nparams, argoids);
+    if (plan == NULL)
+      elog(ERROR, "pg_web: could not prepare endpoint \"%s\": %s",
+           key, SPI_result_code_string(SPI_result));
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(mcxt);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+  MemoryContextSwitchTo(oldcontext);
+  SPI_keepplan(plan);
+
+  endpoint = hash_search(pg_web_endpoints, key, HASH_ENTER, &found);
+  Assert(!found);
+  endpoint->mcxt = mcxt;
+  endpoint->plan = plan;
+  endpoint->nparams = nparams;
+  endpoint->params = names;
+  endpoint->infuncs = infuncs;
+  endpoint->typioparams = typioparams;
+
+  dlist_push_head(&pg_web_endpoint_lru, &endpoint->lru_node);
+  pg_web_endpoint_count++;
+  return endpoint;
+}
+
+/*
+ * pg_web_endpoint_get
+ *
+ * The prepared endpoint, from the cache if it is there, or NULL if it
+ * isn't defined.
+ */
+static PgWebEndpoint *
+pg_web_endpoint_get(const char *name)
+{
+  char           key[NAMEDATALEN];
+  PgWebEndpoint *endpoint;
+
+  if (pg_web_endpoints == NULL)
+    pg_web_endpoint_init();
+
+  /* a hit takes no lock which would process the invalidations for us */
+  AcceptInvalidationMessages();
+  if (pg_web_endpoints_stale)
+  {
+    while (!dlist_is_empty(&pg_web_endpoint_lru))
+      pg_web_endpoint_forget(dlist_container(PgWebEndpoint, lru_node,
+                                             dlist_head_node(&pg_web_endpoint_lru)));
+    pg_web_endpoints_stale = false;
+  }
+
+  if (strlen(name) >= NAMEDATALEN)
+    return NULL;
+  MemSet(key, 0, sizeof(key));
+  strlcpy(key, name, sizeof(key));
+
+  endpoint = hash_search(pg_web_endpoints, key, HASH_FIND, NULL);
+  if (endpoint != NULL)
+    dlist_move_head(&pg_web_endpoint_lru, &endpoint->lru_node);
+  else
+    endpoint = pg_web_endpoint_load(key);
+  return endpoint->plan != NULL ? endpoint : NULL;
+}
+
+/*
+ * pg_web_endpoint_open
+ *
+ * Open a cursor for the named endpoint, with its parameters taken from the
+ * request through lookup; missing ones are NULL. Must be called with SPI
+ * connected and a snapshot set, as SPI_cursor_open.
+ */
+Portal
+pg_web_endpoint_open(const char *name, PgWebParamLookup lookup, void *arg)
+{
+  PgWebEndpoint *endpoint = pg_web_endpoint_get(name);
+  Datum         *values;
+  char          *nulls;
+  int            i;
+
+  if (endpoint == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_UNDEFINED_OBJECT),
+             errmsg("endpoint \"%s\" does not exist", name)));
+
+  values = palloc(sizeof(Datum) * Max(endpoint->nparams, 1));
+  nulls = palloc(sizeof(char) * Max(endpoint->nparams, 1));
+  for (i = 0; i < endpoint->nparams; i++)
+  {
+    char *str = lookup(arg, endpoint->params[i]);
+
+    values[i] = InputFunctionCall(&endpoint->infuncs[i], str,
+                                  endpoint->typioparams[i], -1);
+    nulls[i] = str == NULL ? 'n' : ' ';
+  }
+
+  return SPI_cursor_open(NULL, endpoint->plan, values, nulls, true);
+}
+
+/*
+ * pg_web_endpoints_changed
+ *
+ * Statement trigger of pg_web_endpoints. Invalidating the table's relcache
+ * entry is how the workers learn that their plans are out of date.
+ */
+Datum
+pg_web_endpoints_changed(PG_FUNCTION_ARGS)
+{
+  TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+  if (!CALLED_AS_TRIGGER(fcinfo))
+    elog(ERROR, "pg_web_endpoints_changed: not called by trigger manager");
+
+  CacheInvalidateRelcache(trigdata->tg_relation);
+  return PointerGetDatum(NULL);
+}
@@ -0,0 +1,32 @@
+/*
+ * pg_web_endpoint.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_ENDPOINT_H
+#define PG_WEB_ENDPOINT_H
+
+#include "postgres.h"
+#include "utils/portal.h"
+
+/*
+ * Value of the named request parameter, palloc'd, or NULL if the request
+ * doesn't have it.
+ */
+typedef char *(*PgWebParamLookup) (void *arg, const char *name);
+
+/* GUC variables, see pg_web.c */
+extern int pg_web_setting_endpoint_cache_size;
+
+Portal pg_web_endpoint_open(const char *name, PgWebParamLookup lookup,
+                            void *arg);
+
+#endif
@@ -13,46 +13,1520 @@
 
 #include "pg_web_handler.h"
 
+#include "utils/builtins.h"
+#include "utils/json.h"
+#include "utils/memutils.h"
+
+/* receive buffers which grew beyond this are shrunk between requests */
+#define PG_WEB_CONN_BUFFER_KEEP (64 * 1024)
+
+/* a connection isn't read from while more than this of its requests waits
+ * to be answered, the largest request fits */
+#define PG_WEB_CONN_BUFFER_MAX \
+  (PG_WEB_HTTP_MAX_HEADER_SIZE + PG_WEB_HTTP_MAX_BODY_SIZE)
+
+/* the next batch of a streamed result is fetched once no more than this is
+ * left to send, so the socket keeps busy meanwhile */
+#define PG_WEB_STREAM_LOW_WATER (64 * 1024)
+
+/* output of a chunked response smaller than this is held back and sent
+ * together with what follows, so rows don't each cost a chunk */
+#define PG_WEB_CHUNK_MIN_SIZE (16 * 1024)
+
+/* named endpoints are served under /q/<name> */
+#define PG_WEB_ENDPOINT_PREFIX      "/q/"
+#define PG_WEB_ENDPOINT_PREFIX_LEN  3
+
+/* files of pg_web.static_dir are served under /static/<path> */
+#define PG_WEB_STATIC_PREFIX      "/static/"
+#define PG_WEB_STATIC_PREFIX_LEN  8
+
 static int count = 0;
 
-void onWebLine(dyad_Event *e) {
-  char path[128];
-  if (sscanf(e->data, "GET %127s", path) == 1) {
-    /* Print request */
-    printf("%s %s\n", dyad_getAddress(e->stream), path);
-    elog(LOG, "Hello from pg_web! By I should be a HTTP server."); /* Say Hello to the world */
-    /* Send header */
-    dyad_writef(e->stream, "HTTP/1.1 200 OK\r\n");
-    dyad_writef(e->stream, "Content-Type:text/html; charset=utf-8\r\n");
-    dyad_writef(e->stream, "\r\n");
-    /* Handle request */
-    if (!strcmp(path, "/")) {
-      dyad_writef(e->stream, "<html><body><pre>"
-                             "<a href='/date'>date</a><br>"
-                             "<a href='/count'>count</a><br>"
-                             "<a href='/ip'>ip</a>"
-                             "</pre></body></html>" );
-
-    } else if (!strcmp(path, "/date")) {
-      time_t t = time(0);
-      dyad_writef(e->stream, "%s", ctime(&t));
-
-    } else if (!strcmp(path, "/count")) {
-      dyad_writef(e->stream, "%d", ++count);
-
-    } else if (!strcmp(path, "/ip")) {
-      dyad_writef(e->stream, "%s", dyad_getAddress(e->stream));
+/* memory for the connections' state and receive buffers */
+static MemoryContext PgWebConnContext = NULL;
+
+/* bytes in the receive buffers of all connections */
+static uint64 pg_web_input_bytes = 0;
+
+/* connections whose query waits for the shared transaction, oldest first */
+static dlist_head pg_web_waiting = DLIST_STATIC_INIT(pg_web_waiting);
+
+static void pg_web_process_requests(PgWebConn *conn);
+
+/*
+ * pg_web_request_done
+ *
+ * Count the request in the worker's stats once its response is written.
+ */
+static void pg_web_request_done(PgWebConn *conn, int status) {
+  PgWebRequest *req = &conn->req;
+  instr_time    duration;
+  uint64        out_end;
+  int           in_end;
+
+  if (!conn->timing) {
+    return;
+  }
+  conn->timing = false;
+
+  INSTR_TIME_SET_CURRENT(duration);
+  INSTR_TIME_SUBTRACT(duration, conn->started);
+  /* A bad request was not parsed to its end, count what we have of it */
+  in_end = req->state == PG_WEB_HTTP_FAILED ? conn->buf.len : req->pos;
+  out_end = dyad_getBytesSent(conn->stream) +
+            dyad_getBytesPending(conn->stream);
+
+  pg_web_stats_request_done(conn->route, status, in_end - req->start,
+                            out_end - conn->out_start,
+                            INSTR_TIME_GET_MICROSEC(duration));
+}
+
+/*
+ * pg_web_respond_head
+ *
+ * Write the status line and headers of a complete response, with an ETag
+ * header if etag isn't NULL and the header lines in extra, if any. A 304
+ * has no content headers. Returns whether the connection is kept open for
+ * the next request, see pg_web_respond_end.
+ */
+static bool pg_web_respond_head(PgWebConn *conn, int status,
+                                const char *content_type, const char *etag,
+                                const char *extra, int len) {
+  dyad_Stream *stream = conn->stream;
+  bool         keep_alive;
+
+  keep_alive = conn->req.keep_alive && pg_web_setting_keepalive_timeout > 0;
+
+  dyad_writef(stream, "HTTP/1.1 %d %s\r\n",
+              status, pg_web_http_status_text(status));
+  if (status != 304) {
+    dyad_writef(stream, "Content-Type: %s\r\n", content_type);
+    dyad_writef(stream, "Content-Length: %d\r\n", len);
+  }
+  if (etag != NULL) {
+    dyad_writef(stream, "ETag: %s\r\n", etag);
+  }
+  if (extra != NULL) {
+    dyad_writef(stream, "%s", extra);
+  }
+  if (!keep_alive) {
+    dyad_writef(stream, "Connection: close\r\n");
+  } else if (conn->req.http_minor == 0) {
+    dyad_writef(stream, "Connection: keep-alive\r\n");
+  }
+  dyad_writef(stream, "\r\n");
+  return keep_alive;
+}
+
+/*
+ * pg_web_respond_end
+ *
+ * Finish a response whose body is written. The connection is closed once
+ * it is sent unless it is kept open.
+ */
+static void pg_web_respond_end(PgWebConn *conn, int status, bool keep_alive) {
+  pg_web_request_done(conn, status);
+  if (!keep_alive) {
+    /* Close stream when all data has been sent */
+    dyad_end(conn->stream);
+  }
+}
+
+/*
+ * pg_web_has_body
+ *
+ * Is a response with this status to the current request sent with a body?
+ */
+static bool pg_web_has_body(PgWebConn *conn, int status) {
+  return status != 304 &&
+         !pg_web_http_slice_equals(&conn->buf, conn->req.method, "HEAD");
+}
+
+/*
+ * pg_web_response_encoding
+ *
+ * The encoding to compress a body of len bytes with: identity if
+ * compression is off, the body is smaller than pg_web.compression_min_size
+ * or the client takes neither gzip nor deflate. len is -1 for a streamed
+ * body, which is always large enough.
+ */
+static PgWebEncoding pg_web_response_encoding(PgWebConn *conn, int len) {
+  PgWebHeader *header;
+
+  if (pg_web_setting_compression_level == 0 ||
+      (len >= 0 && len < pg_web_setting_compression_min_size)) {
+    return PG_WEB_ENCODING_IDENTITY;
+  }
+  header = pg_web_http_get_header(&conn->req, &conn->buf, "Accept-Encoding");
+  if (header == NULL) {
+    return PG_WEB_ENCODING_IDENTITY;
+  }
+  if (pg_web_http_accepts(&conn->buf, header, "gzip")) {
+    return PG_WEB_ENCODING_GZIP;
+  }
+  if (pg_web_http_accepts(&conn->buf, header, "deflate")) {
+    return PG_WEB_ENCODING_DEFLATE;
+  }
+  return PG_WEB_ENCODING_IDENTITY;
+}
+
+/*
+ * pg_web_encoding_headers
+ *
+ * The Content-Encoding and Vary lines of a body of len bytes sent in the
+ * encoding, see pg_web_response_encoding.
+ */
+static void pg_web_encoding_headers(char *extra, size_t size,
+                                    PgWebEncoding encoding, int len) {
+  extra[0] = '\0';
+  if (encoding != PG_WEB_ENCODING_IDENTITY) {
+    snprintf(extra, size, "Content-Encoding: %s\r\n",
+             pg_web_encoding_name(encoding));
+  }
+  /* Whether it is compressed depends on Accept-Encoding */
+  if (pg_web_setting_compression_level > 0 &&
+      (len < 0 || len >= pg_web_setting_compression_min_size)) {
+    strlcat(extra, "Vary: Accept-Encoding\r\n", size);
+  }
+}
+
+/*
+ * pg_web_respond_tagged
+ *
+ * Write a complete response, with an ETag header if etag isn't NULL. The
+ * connection is kept open for the next request if the client wants that,
+ * otherwise it is closed once the response is sent. A 304 has neither
+ * content headers nor a body.
+ */
+static void pg_web_respond_tagged(PgWebConn *conn, int status,
+                                  const char *content_type, const char *etag,
+                                  const char *body, int len) {
+  PgWebEncoding   encoding = PG_WEB_ENCODING_IDENTITY;
+  StringInfoData  compressed;
+  char            extra[64];
+  bool            keep_alive;
+
+  if (status != 304) {
+    encoding = pg_web_response_encoding(conn, len);
+    pg_web_encoding_headers(extra, sizeof(extra), encoding, len);
+  } else {
+    extra[0] = '\0';
+  }
+  if (encoding != PG_WEB_ENCODING_IDENTITY) {
+    /* Even for HEAD, Content-Length is that of the compressed body */
+    PgWebCompressor *compressor = pg_web_compress_begin(encoding);
+
+    initStringInfo(&compressed);
+    pg_web_compress(compressor, body, len, true, &compressed);
+    pg_web_compress_end(compressor);
+    body = compressed.data;
+    len = compressed.len;
+  }
+
+  keep_alive = pg_web_respond_head(conn, status, content_type, etag, extra,
+                                   len);
+  if (len > 0 && pg_web_has_body(conn, status)) {
+    dyad_write(conn->stream, (void *) body, len);
+  }
+  pg_web_respond_end(conn, status, keep_alive);
+  if (encoding != PG_WEB_ENCODING_IDENTITY) {
+    pfree(compressed.data);
+  }
+}
+
+/*
+ * pg_web_respond
+ *
+ * Write a complete response, see pg_web_respond_tagged.
+ */
+static void pg_web_respond(PgWebConn *conn, int status,
+                           const char *content_type,
+                           const char *body, int len) {
+  pg_web_respond_tagged(conn, status, content_type, NULL, body, len);
+}
+
+/*
+ * pg_web_respond_error
+ *
+ * Answer with the status and its reason phrase as the body.
+ */
+static void pg_web_respond_error(PgWebConn *conn, int status) {
+  char body[64];
+  int  len;
+
+  len = snprintf(body, sizeof(body), "%d %s\n",
+                 status, pg_web_http_status_text(status));
+  pg_web_respond(conn, status, "text/plain; charset=utf-8", body, len);
+}
+
+/*
+ * pg_web_respond_json_error
+ *
+ * Answer with {"error": message}.
+ */
+static void pg_web_respond_json_error(PgWebConn *conn, int status,
+                                      const char *message) {
+  StringInfoData body;
+
+  initStringInfo(&body);
+  appendStringInfoString(&body, "{\"error\":");
+  escape_json(&body, message);
+  appendStringInfoString(&body, "}\n");
+  pg_web_respond(conn, status, "application/json", body.data, body.len);
+  pfree(body.data);
+}
+
+/*
+ * pg_web_free_buffer
+ *
+ * Release callback of the buffers handed to dyad_writeRef.
+ */
+static void pg_web_free_buffer(void *data) {
+  pfree(data);
+}
+
+/*
+ * pg_web_format_etag
+ *
+ * The entity tag made by pg_web_cache_tag as it is sent, quoted. A
+ * compressed body is another entity, its tag names the encoding.
+ */
+static void pg_web_format_etag(char *tag, size_t size, const char *etag,
+                               PgWebEncoding encoding) {
+  if (encoding == PG_WEB_ENCODING_IDENTITY) {
+    snprintf(tag, size, "\"%s\"", etag);
+  } else {
+    snprintf(tag, size, "\"%s-%s\"", etag, pg_web_encoding_name(encoding));
+  }
+}
+
+/*
+ * pg_web_not_modified
+ *
+ * Does the client have the response with this tag already?
+ */
+static bool pg_web_not_modified(PgWebConn *conn, const char *tag) {
+  PgWebHeader *header = pg_web_http_get_header(&conn->req, &conn->buf,
+                                               "If-None-Match");
+
+  return header != NULL && pg_web_http_etag_matches(&conn->buf, header, tag);
+}
 
+/*
+ * pg_web_respond_result
+ *
+ * Answer a GET with a complete query result and its entity tag, or with
+ * 304 Not Modified if the client sent that tag in If-None-Match.
+ */
+static void pg_web_respond_result(PgWebConn *conn, const char *content_type,
+                                  const char *body, int len,
+                                  const char *etag) {
+  char tag[PG_WEB_CACHE_TAG_LEN + 16];
+
+  pg_web_format_etag(tag, sizeof(tag), etag,
+                     pg_web_response_encoding(conn, len));
+  if (pg_web_not_modified(conn, tag)) {
+    pg_web_respond_tagged(conn, 304, NULL, tag, NULL, 0);
+  } else {
+    pg_web_respond_tagged(conn, 200, content_type, tag, body, len);
+  }
+}
+
+/*
+ * pg_web_flush_chunk
+ *
+ * Send the output held back in conn->pending as one chunk.
+ */
+static void pg_web_flush_chunk(PgWebConn *conn) {
+  if (conn->pending.len > 0) {
+    dyad_writef(conn->stream, "%x\r\n", conn->pending.len);
+    dyad_write(conn->stream, conn->pending.data, conn->pending.len);
+    dyad_write(conn->stream, "\r\n", 2);
+    resetStringInfo(&conn->pending);
+  }
+}
+
+/*
+ * pg_web_write_chunked
+ *
+ * Send the next part of a chunked body and free it once it is sent. While
+ * the socket is still busy with earlier output small parts are collected in
+ * conn->pending, up to a chunk of PG_WEB_CHUNK_MIN_SIZE; the sending of
+ * that output asks for the next part (DYAD_EVENT_READY), so nothing held
+ * back waits for long. Larger parts are a chunk of their own and are sent
+ * from where they are. With last the body ends here, with the terminal
+ * chunk unless it is cut off, which the client can tell by its absence.
+ */
+static void pg_web_write_chunked(PgWebConn *conn, StringInfo out, bool last,
+                                 bool cut_off) {
+  if (out != NULL && out->len > 0) {
+    if (conn->pending.len + out->len < PG_WEB_CHUNK_MIN_SIZE &&
+        dyad_getBytesPending(conn->stream) > 0) {
+      if (conn->pending.data == NULL) {
+        MemoryContext oldcontext = MemoryContextSwitchTo(PgWebConnContext);
+
+        initStringInfo(&conn->pending);
+        MemoryContextSwitchTo(oldcontext);
+      }
+      appendBinaryStringInfo(&conn->pending, out->data, out->len);
+      pfree(out->data);
     } else {
-      dyad_writef(e->stream, "bad request '%s'", path);
+      pg_web_flush_chunk(conn);
+      dyad_writef(conn->stream, "%x\r\n", out->len);
+      dyad_writeRef(conn->stream, out->data, out->len, pg_web_free_buffer,
+                    out->data);
+      dyad_write(conn->stream, "\r\n", 2);
     }
-    /* Close stream when all data has been sent */
-    dyad_end(e->stream);
+  } else if (out != NULL) {
+    pfree(out->data);
+  }
+  if (last) {
+    pg_web_flush_chunk(conn);
+    if (!cut_off) {
+      dyad_writef(conn->stream, "0\r\n\r\n");
+    }
+  }
+}
+
+/*
+ * pg_web_write_batch
+ *
+ * Send a batch of a streamed result, through the compressor if the
+ * response is compressed, and free it once it is sent. With last the body
+ * ends here; it is cut off if the query failed.
+ */
+static void pg_web_write_batch(PgWebConn *conn, StringInfo out, bool last,
+                               bool cut_off) {
+  StringInfoData compressed;
+
+  if (conn->compressor != NULL) {
+    initStringInfo(&compressed);
+    pg_web_compress(conn->compressor, out ? out->data : NULL,
+                    out ? out->len : 0, last, &compressed);
+    if (out != NULL) {
+      pfree(out->data);
+    }
+    if (last) {
+      pg_web_compress_end(conn->compressor);
+      conn->compressor = NULL;
+    }
+    out = &compressed;
+  }
+  if (conn->chunked) {
+    pg_web_write_chunked(conn, out, last, cut_off);
+  } else if (out != NULL) {
+    /* The batch is sent from where it is and freed afterwards */
+    dyad_writeRef(conn->stream, out->data, out->len, pg_web_free_buffer,
+                  out->data);
+  }
+}
+
+/*
+ * pg_web_query_result
+ *
+ * Send a batch of the result in conn->content_type, as pg_web_query_fetch
+ * returned it or the query pool passed it on (see PgWebJobCallback), and
+ * free it. Errors found before the first batch is sent still get a proper
+ * status. A result which fits in one batch is answered with its length
+ * (and to a GET with an ETag), and stored in the response cache if the
+ * request was looked up there. A longer one is streamed in the chunked
+ * transfer coding, so the connection can be kept open, or to HTTP/1.0
+ * clients with its end marked by closing the connection.
+ */
+static void pg_web_query_result(PgWebConn *conn, int rc, StringInfo out,
+                                const char *error, PgWebCacheDeps *deps) {
+  char *cache_key = conn->cache_key;
+
+  if (conn->streaming) {
+    pg_web_write_batch(conn, out, rc != PG_WEB_QUERY_MORE,
+                       rc == PG_WEB_QUERY_ERROR);
+    if (rc == PG_WEB_QUERY_ERROR) {
+      /* Too late for an error status, the client gets a truncated body */
+      elog(LOG, "pg_web query failed: %s", error);
+      conn->keep_alive = false;
+    }
+    if (rc != PG_WEB_QUERY_MORE) {
+      conn->streaming = false;
+      pg_web_respond_end(conn, 200, conn->chunked && conn->keep_alive);
+    }
+    return;
+  }
+
+  conn->cache_key = NULL;
+  if (rc == PG_WEB_QUERY_MORE) {
+    PgWebEncoding encoding = pg_web_response_encoding(conn, -1);
+    char          extra[64];
+
+    if (encoding != PG_WEB_ENCODING_IDENTITY) {
+      MemoryContext oldcontext = MemoryContextSwitchTo(PgWebConnContext);
+
+      conn->compressor = pg_web_compress_begin(encoding);
+      MemoryContextSwitchTo(oldcontext);
+    }
+    pg_web_encoding_headers(extra, sizeof(extra), encoding, -1);
+
+    /* The length is unknown, HTTP/1.1 clients get it in chunks and
+     * HTTP/1.0 ones until the connection is closed */
+    conn->chunked = conn->req.http_minor >= 1;
+    conn->keep_alive = conn->chunked && conn->req.keep_alive &&
+                       pg_web_setting_keepalive_timeout > 0;
+    dyad_writef(conn->stream, "HTTP/1.1 200 OK\r\n");
+    dyad_writef(conn->stream, "Content-Type: %s\r\n", conn->content_type);
+    dyad_writef(conn->stream, "%s", extra);
+    if (conn->chunked) {
+      dyad_writef(conn->stream, "Transfer-Encoding: chunked\r\n");
+    }
+    if (!conn->keep_alive) {
+      dyad_writef(conn->stream, "Connection: close\r\n");
+    }
+    dyad_writef(conn->stream, "\r\n");
+    pg_web_write_batch(conn, out, false, false);
+    dyad_setLowWatermark(conn->stream, PG_WEB_STREAM_LOW_WATER);
+    conn->streaming = true;
+  } else if (rc == PG_WEB_QUERY_DONE) {
+    if (cache_key != NULL) {
+      uint64 etag = pg_web_cache_etag(out->data, out->len);
+      char   tag[PG_WEB_CACHE_TAG_LEN];
+
+      pg_web_cache_put(cache_key, conn->content_type, out->data, out->len,
+                       etag, deps);
+      pg_web_cache_tag(tag, cache_key, etag, out->len, deps);
+      pg_web_respond_result(conn, conn->content_type, out->data, out->len,
+                            tag);
+    } else {
+      pg_web_respond(conn, 200, conn->content_type, out->data, out->len);
+    }
+    pfree(out->data);
+  } else {
+    pg_web_respond_json_error(conn,
+                              rc == PG_WEB_QUERY_UNAVAILABLE ? 503 : 400,
+                              error);
+    if (out != NULL) {
+      pfree(out->data);
+    }
+  }
+
+  if (cache_key != NULL) {
+    pfree(cache_key);
+  }
+}
+
+/*
+ * pg_web_stream_query
+ *
+ * Fetch the next batch of rows of conn->query and send it. The batch after
+ * it is fetched once this one has left the write buffer (see onWebReady),
+ * so a slow client never makes us hold more than one batch in memory.
+ */
+static void pg_web_stream_query(PgWebConn *conn) {
+  PgWebQuery     *query = conn->query;
+  StringInfoData  out;
+  int             rc;
+
+  initStringInfo(&out);
+  rc = pg_web_query_fetch(query, &out);
+  if (rc != PG_WEB_QUERY_MORE) {
+    conn->query = NULL;
+  }
+  pg_web_query_result(conn, rc, &out, query->error, &query->deps);
+  if (rc != PG_WEB_QUERY_MORE) {
+    pg_web_query_close(query);
+  }
+}
+
+/*
+ * pg_web_start_stream
+ *
+ * Start streaming the result of the query just opened as conn->query, or
+ * answer the error if it couldn't be opened.
+ */
+static void pg_web_start_stream(PgWebConn *conn, char *error) {
+  if (conn->query == NULL) {
+    pg_web_query_result(conn, PG_WEB_QUERY_ERROR, NULL, error, NULL);
+    pfree(error);
+  } else {
+    pg_web_stream_query(conn);
+  }
+}
+
+/*
+ * pg_web_next_request
+ *
+ * Go on with the requests pipelined after the one just answered.
+ */
+static void pg_web_next_request(PgWebConn *conn) {
+  conn->continue_sent = false;
+  pg_web_http_request_init(&conn->req, conn->req.pos);
+  pg_web_process_requests(conn);
+}
+
+/*
+ * pg_web_job_result
+ *
+ * PgWebJobCallback of the queries run by the pool. Once the response is
+ * complete the requests which came meanwhile are handled.
+ */
+static void pg_web_job_result(void *owner, int rc, StringInfo out,
+                              const char *error, PgWebCacheDeps *deps) {
+  PgWebConn   *conn = (PgWebConn *) owner;
+  dyad_Stream *stream = conn->stream;
+
+  if (rc == PG_WEB_QUERY_MORE && !conn->streaming &&
+      pg_web_setting_keepalive_timeout > 0) {
+    /* From now on the client is the one who may be slow */
+    dyad_setTimeout(conn->stream, pg_web_setting_keepalive_timeout);
+  }
+  if (rc != PG_WEB_QUERY_MORE) {
+    conn->job = NULL;
+  }
+  pg_web_query_result(conn, rc, out, error, deps);
+
+  /* Closing the connection may have freed conn, the stream lives until the
+   * next update. A streamed response kept it open if it was chunked. */
+  if (dyad_getState(stream) == DYAD_STATE_CONNECTED && conn->job == NULL) {
+    if (pg_web_setting_keepalive_timeout > 0) {
+      dyad_setTimeout(conn->stream, pg_web_setting_keepalive_timeout);
+    }
+    pg_web_next_request(conn);
+  }
+}
+
+/*
+ * pg_web_submit_query
+ *
+ * Hand the SQL, or the named endpoint with the request's query string for
+ * its parameters, to the query pool. The response is written as the
+ * result comes in, see pg_web_job_result.
+ */
+static void pg_web_submit_query(PgWebConn *conn, const char *sql,
+                                const char *endpoint,
+                                PgWebQueryFormat format, bool header) {
+  PgWebSlice query = conn->req.query;
+
+  conn->job = pg_web_pool_submit(sql, endpoint,
+                                 conn->buf.data + query.off, query.len,
+                                 format, header, pg_web_job_result, conn);
+  if (conn->job == NULL) {
+    pg_web_query_result(conn, PG_WEB_QUERY_UNAVAILABLE, NULL,
+                        "too many queries waiting", NULL);
+    return;
+  }
+  /* The client isn't idle while it waits for us */
+  dyad_setTimeout(conn->stream, 0);
+}
+
+/*
+ * pg_web_serve_unchanged
+ *
+ * Answer with 304 Not Modified if If-None-Match lists a tag of the result
+ * for the key which the change counters tell is still valid, see
+ * pg_web_cache_tag_valid. The tag must also name the encoding the body
+ * would be sent in now.
+ */
+static bool pg_web_serve_unchanged(PgWebConn *conn, const char *key) {
+  PgWebHeader *header = pg_web_http_get_header(&conn->req, &conn->buf,
+                                               "If-None-Match");
+  PgWebSlice   etag;
+  int          pos = 0;
+
+  if (header == NULL) {
+    return false;
+  }
+  while (pg_web_http_etag_next(&conn->buf, header, &pos, &etag)) {
+    const char *data = conn->buf.data + etag.off;
+    const char *dash = memchr(data, '-', etag.len);
+    int         core_len = dash ? dash - data : etag.len;
+    char        core[PG_WEB_CACHE_TAG_LEN];
+    char        tag[PG_WEB_CACHE_TAG_LEN + 16];
+    int         len;
+
+    if (!pg_web_cache_tag_valid(key, data, core_len, &len)) {
+      continue;
+    }
+    memcpy(core, data, core_len);
+    core[core_len] = '\0';
+    pg_web_format_etag(tag, sizeof(tag), core,
+                       pg_web_response_encoding(conn, len));
+    if (strlen(tag) == (size_t) etag.len + 2 &&
+        memcmp(tag + 1, data, etag.len) == 0) {
+      pg_web_respond_tagged(conn, 304, NULL, tag, NULL, 0);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * pg_web_serve_cached
+ *
+ * Answer a GET without a transaction if the client's ETag of the result in
+ * the given format is still valid, or the result is in the response cache.
+ * Otherwise the key is left in conn->cache_key for pg_web_query_result,
+ * which tags the response and stores it under the key.
+ */
+static bool pg_web_serve_cached(PgWebConn *conn, PgWebQueryFormat format) {
+  PgWebRequest  *req = &conn->req;
+  PgWebCacheHit  hit;
+  char           tag[PG_WEB_CACHE_TAG_LEN];
+  char          *key;
+
+  if (!pg_web_http_slice_equals(&conn->buf, req->method, "GET")) {
+    return false;
+  }
+
+  /* The Accept header chooses the format, the target holds the rest */
+  key = psprintf("%d %.*s", (int) format,
+                 req->target.len, conn->buf.data + req->target.off);
+  if (pg_web_serve_unchanged(conn, key)) {
+    if (MyWebStats != NULL) {
+      MyWebStats->cache_hits++;
+    }
+    pfree(key);
+    return true;
+  }
+  if (pg_web_cache_get(key, &hit)) {
+    if (MyWebStats != NULL) {
+      MyWebStats->cache_hits++;
+    }
+    pg_web_cache_tag(tag, key, hit.etag, hit.len, &hit.deps);
+    pfree(key);
+    pg_web_respond_result(conn, hit.content_type, hit.body, hit.len, tag);
+    return true;
+  }
+
+  if (MyWebStats != NULL && pg_web_cache_enabled()) {
+    MyWebStats->cache_misses++;
+  }
+  conn->cache_key = key;
+  return false;
+}
+
+/*
+ * pg_web_query_deadline
+ *
+ * When a query run for the current request is canceled, or 0 for never,
+ * see pg_web.query_timeout.
+ */
+static TimestampTz pg_web_query_deadline(void) {
+  if (pg_web_setting_query_timeout <= 0) {
+    return 0;
+  }
+  return TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                     pg_web_setting_query_timeout);
+}
+
+/*
+ * pg_web_request_param
+ *
+ * PgWebParamLookup for the query string of the current request.
+ */
+static char *pg_web_request_param(void *arg, const char *name) {
+  PgWebConn *conn = (PgWebConn *) arg;
+
+  return pg_web_http_query_param(&conn->buf, conn->req.query, name);
+}
+
+/*
+ * pg_web_run_query
+ *
+ * Open the SQL, or the named endpoint with its parameters from the query
+ * string, in the shared transaction and start streaming its result.
+ */
+static void pg_web_run_query(PgWebConn *conn, const char *sql,
+                             const char *endpoint, PgWebQueryFormat format,
+                             bool header, TimestampTz deadline) {
+  char *error = NULL;
+
+  if (sql != NULL) {
+    conn->query = pg_web_query_open(sql, format, header, deadline, &error);
+  } else {
+    conn->query = pg_web_query_open_endpoint(endpoint, pg_web_request_param,
+                                             conn, format, deadline, &error);
   }
+  pg_web_start_stream(conn, error);
+}
+
+/*
+ * pg_web_wait_query
+ *
+ * Keep the query until the shared transaction takes it, see
+ * pg_web_run_waiting.
+ */
+static void pg_web_wait_query(PgWebConn *conn, const char *sql,
+                              const char *endpoint, PgWebQueryFormat format,
+                              bool header, TimestampTz deadline) {
+  MemoryContext oldcontext = MemoryContextSwitchTo(PgWebConnContext);
+
+  conn->wait_sql = sql != NULL ? pstrdup(sql) : NULL;
+  conn->wait_endpoint = endpoint != NULL ? pstrdup(endpoint) : NULL;
+  MemoryContextSwitchTo(oldcontext);
+  conn->wait_format = format;
+  conn->wait_header = header;
+  conn->wait_deadline = deadline;
+  conn->waiting = true;
+  dlist_push_tail(&pg_web_waiting, &conn->wait_node);
+  /* The client isn't idle while it waits for us */
+  dyad_setTimeout(conn->stream, 0);
+}
+
+/*
+ * pg_web_unwait_query
+ *
+ * Take the connection off the waiting list.
+ */
+static void pg_web_unwait_query(PgWebConn *conn) {
+  dlist_delete(&conn->wait_node);
+  conn->waiting = false;
+  if (conn->wait_sql != NULL) {
+    pfree(conn->wait_sql);
+    conn->wait_sql = NULL;
+  }
+  if (conn->wait_endpoint != NULL) {
+    pfree(conn->wait_endpoint);
+    conn->wait_endpoint = NULL;
+  }
+}
+
+/*
+ * pg_web_open_query
+ *
+ * Run the SQL, or the named endpoint, and stream its result in the given
+ * format: in the query pool if there is one, otherwise here, as soon as
+ * the shared transaction takes it and the queries before it are open.
+ */
+static void pg_web_open_query(PgWebConn *conn, const char *sql,
+                              const char *endpoint, PgWebQueryFormat format,
+                              bool header) {
+  TimestampTz deadline;
+
+  if (pg_web_pool_enabled()) {
+    pg_web_submit_query(conn, sql, endpoint, format, header);
+    return;
+  }
+  deadline = pg_web_query_deadline();
+  if (!pg_web_query_admits() || !dlist_is_empty(&pg_web_waiting)) {
+    pg_web_wait_query(conn, sql, endpoint, format, header, deadline);
+    return;
+  }
+  pg_web_run_query(conn, sql, endpoint, format, header, deadline);
+}
+
+/*
+ * pg_web_start_query
+ *
+ * Run the query and start streaming its result in the given format, unless
+ * it is answered from the response cache.
+ */
+static void pg_web_start_query(PgWebConn *conn, const char *sql,
+                               PgWebQueryFormat format, bool header,
+                               const char *content_type) {
+  if (pg_web_serve_cached(conn, format)) {
+    return;
+  }
+  conn->content_type = content_type;
+  pg_web_open_query(conn, sql, NULL, format, header);
+}
+
+/*
+ * pg_web_accepts_arrow
+ *
+ * Does the client take the result as an Arrow IPC stream?
+ */
+static bool pg_web_accepts_arrow(PgWebConn *conn) {
+  PgWebHeader *accept = pg_web_http_get_header(&conn->req, &conn->buf,
+                                               "Accept");
+
+  /* "q=0" refuses it, then the result is JSON as usual */
+  return accept != NULL &&
+    pg_web_http_accepts(&conn->buf, accept, PG_WEB_ARROW_STREAM_TYPE);
+}
+
+/*
+ * pg_web_request_sql
+ *
+ * The SQL of a /query or /export request: the body of a POST, or the "q"
+ * parameter of a GET. Returns NULL, after answering, if there is none.
+ */
+static char *pg_web_request_sql(PgWebConn *conn) {
+  PgWebRequest *req = &conn->req;
+  StringInfo    buf = &conn->buf;
+  char         *sql;
+
+  if (pg_web_http_slice_equals(buf, req->method, "POST")) {
+    sql = pnstrdup(buf->data + req->body.off, req->body.len);
+  } else if (pg_web_http_slice_equals(buf, req->method, "GET")) {
+    sql = pg_web_http_query_param(buf, req->query, "q");
+  } else {
+    pg_web_respond_error(conn, 405);
+    return NULL;
+  }
+
+  if (sql == NULL || sql[0] == '\0') {
+    if (sql != NULL) {
+      pfree(sql);
+    }
+    pg_web_respond_json_error(conn, 400, "no query given");
+    return NULL;
+  }
+  return sql;
+}
+
+/*
+ * pg_web_query_allowed
+ *
+ * May SQL from the request be run? Only with pg_web.enable_query, and as
+ * pg_web.query_role. Answers 403 if not.
+ */
+static bool pg_web_query_allowed(PgWebConn *conn) {
+  if (!pg_web_setting_enable_query) {
+    pg_web_respond_error(conn, 403);
+    return false;
+  }
+  if (pg_web_setting_query_role == NULL ||
+      pg_web_setting_query_role[0] == '\0') {
+    pg_web_respond_json_error(conn, 403, "pg_web.query_role is not set");
+    return false;
+  }
+  return true;
+}
+
+/*
+ * pg_web_handle_query
+ *
+ * Run the SQL given in the "q" parameter (GET) or the body (POST) and
+ * stream the rows as a JSON array of objects, or as an Arrow IPC stream if
+ * the client accepts one.
+ */
+static void pg_web_handle_query(PgWebConn *conn) {
+  char *sql;
+
+  if (!pg_web_query_allowed(conn)) {
+    return;
+  }
+
+  sql = pg_web_request_sql(conn);
+  if (sql == NULL) {
+    return;
+  }
+  if (pg_web_accepts_arrow(conn)) {
+    pg_web_start_query(conn, sql, PG_WEB_QUERY_ARROW, false,
+                       PG_WEB_ARROW_STREAM_TYPE);
+  } else {
+    pg_web_start_query(conn, sql, PG_WEB_QUERY_JSON, false, "application/json");
+  }
+  pfree(sql);
+}
+
+/*
+ * pg_web_append_identifier
+ *
+ * Append the name, quoted if needed.
+ */
+static void pg_web_append_identifier(StringInfo out, const char *ident) {
+  const char *quoted = quote_identifier(ident);
+
+  appendStringInfoString(out, quoted);
+  if (quoted != ident) {
+    pfree((char *) quoted);
+  }
+}
+
+/*
+ * pg_web_export_table_sql
+ *
+ * Query reading the whole table named "schema.table" or "table". The names
+ * are taken as they are, without case folding.
+ */
+static char *pg_web_export_table_sql(const char *table) {
+  const char     *dot = strchr(table, '.');
+  StringInfoData  sql;
+
+  initStringInfo(&sql);
+  appendStringInfoString(&sql, "SELECT * FROM ");
+  if (dot != NULL) {
+    char *schema = pnstrdup(table, dot - table);
+
+    pg_web_append_identifier(&sql, schema);
+    appendStringInfoChar(&sql, '.');
+    pfree(schema);
+    table = dot + 1;
+  }
+  pg_web_append_identifier(&sql, table);
+  return sql.data;
+}
+
+/*
+ * pg_web_handle_export
+ *
+ * Stream a table ("table" parameter) or the result of a query (as for
+ * /query) in COPY's CSV or text format or as an Arrow IPC stream, chosen
+ * by the "format" parameter.
+ * With "header=true" the first line has the column names.
+ */
+static void pg_web_handle_export(PgWebConn *conn) {
+  PgWebRequest     *req = &conn->req;
+  StringInfo        buf = &conn->buf;
+  PgWebQueryFormat  format = PG_WEB_QUERY_CSV;
+  const char       *content_type = "text/csv";
+  bool              header = false;
+  char             *param;
+  char             *sql;
+
+  if (!pg_web_query_allowed(conn)) {
+    return;
+  }
+
+  param = pg_web_http_query_param(buf, req->query, "format");
+  if (param != NULL) {
+    if (strcmp(param, "text") == 0) {
+      format = PG_WEB_QUERY_TEXT;
+      content_type = "text/plain";
+    } else if (strcmp(param, "arrow") == 0) {
+      format = PG_WEB_QUERY_ARROW;
+      content_type = PG_WEB_ARROW_STREAM_TYPE;
+    } else if (strcmp(param, "csv") != 0) {
+      pg_web_respond_json_error(conn, 400,
+                                "format must be csv, text or arrow");
+      pfree(param);
+      return;
+    }
+    pfree(param);
+  }
+
+  param = pg_web_http_query_param(buf, req->query, "header");
+  if (param != NULL) {
+    header = strcmp(param, "true") == 0 || strcmp(param, "1") == 0;
+    pfree(param);
+  }
+
+  param = pg_web_http_query_param(buf, req->query, "table");
+  if (param != NULL && param[0] != '\0' &&
+      pg_web_http_slice_equals(buf, req->method, "GET")) {
+    sql = pg_web_export_table_sql(param);
+  } else {
+    sql = pg_web_request_sql(conn);
+  }
+  if (param != NULL) {
+    pfree(param);
+  }
+  if (sql == NULL) {
+    return;
+  }
+
+  pg_web_start_query(conn, sql, format, header, content_type);
+  pfree(sql);
+}
+
+/*
+ * pg_web_handle_endpoint
+ *
+ * Run the endpoint named by the path, /q/<name>, with its parameters from
+ * the query string, and stream the rows as /query does. Endpoints are
+ * defined in the pg_web_endpoints table, so they don't need
+ * pg_web.enable_query.
+ */
+static void pg_web_handle_endpoint(PgWebConn *conn) {
+  PgWebRequest     *req = &conn->req;
+  StringInfo        buf = &conn->buf;
+  PgWebQueryFormat  format = PG_WEB_QUERY_JSON;
+  const char       *content_type = "application/json";
+  char             *name;
+
+  if (!pg_web_http_slice_equals(buf, req->method, "GET")) {
+    pg_web_respond_error(conn, 405);
+    return;
+  }
+  if (pg_web_accepts_arrow(conn)) {
+    format = PG_WEB_QUERY_ARROW;
+    content_type = PG_WEB_ARROW_STREAM_TYPE;
+  }
+
+  if (pg_web_serve_cached(conn, format)) {
+    return;
+  }
+
+  conn->content_type = content_type;
+  name = pnstrdup(buf->data + req->path.off + PG_WEB_ENDPOINT_PREFIX_LEN,
+                  req->path.len - PG_WEB_ENDPOINT_PREFIX_LEN);
+  pg_web_open_query(conn, NULL, name, format, false);
+  pfree(name);
+}
+
+/*
+ * pg_web_handle_static
+ *
+ * Serve a file of pg_web.static_dir, or a precompressed sibling of it if
+ * the client accepts that encoding. The body is sent from the file itself,
+ * which stays open until it is.
+ */
+static void pg_web_handle_static(PgWebConn *conn) {
+  PgWebRequest    *req = &conn->req;
+  StringInfo       buf = &conn->buf;
+  PgWebHeader     *accept_encoding;
+  PgWebStaticFile *file;
+  char            *path;
+  char             extra[64];
+  int              accept = 0;
+  int              status = 200;
+  bool             vary;
+  bool             keep_alive;
+
+  if (!pg_web_http_slice_equals(buf, req->method, "GET") &&
+      !pg_web_http_slice_equals(buf, req->method, "HEAD")) {
+    pg_web_respond_error(conn, 405);
+    return;
+  }
+
+  accept_encoding = pg_web_http_get_header(req, buf, "Accept-Encoding");
+  if (accept_encoding != NULL) {
+    if (pg_web_http_accepts(buf, accept_encoding, "gzip")) {
+      accept |= PG_WEB_STATIC_GZIP;
+    }
+    if (pg_web_http_accepts(buf, accept_encoding, "br")) {
+      accept |= PG_WEB_STATIC_BROTLI;
+    }
+  }
+
+  path = pnstrdup(buf->data + req->path.off + PG_WEB_STATIC_PREFIX_LEN,
+                  req->path.len - PG_WEB_STATIC_PREFIX_LEN);
+  file = pg_web_static_open(path, accept, &vary);
+  if (file == NULL) {
+    pfree(path);
+    pg_web_respond_error(conn, 404);
+    return;
+  }
+
+  extra[0] = '\0';
+  if (file->encoding != NULL) {
+    snprintf(extra, sizeof(extra), "Content-Encoding: %s\r\n",
+             file->encoding);
+  }
+  if (vary) {
+    strlcat(extra, "Vary: Accept-Encoding\r\n", sizeof(extra));
+  }
+  if (pg_web_not_modified(conn, file->etag)) {
+    status = 304;
+  }
+
+  keep_alive = pg_web_respond_head(conn, status,
+                                   pg_web_static_content_type(path),
+                                   file->etag, extra, file->size);
+  if (pg_web_has_body(conn, status)) {
+    /* the file's reference is released once it is sent */
+    dyad_writeFile(conn->stream, file->fd, 0, file->size,
+                   pg_web_static_release, file);
+  } else {
+    pg_web_static_release(file);
+  }
+  pg_web_respond_end(conn, status, keep_alive);
+  pfree(path);
+}
+
+/*
+ * pg_web_handle_request
+ *
+ * Route a completely received request.
+ */
+static void pg_web_handle_request(PgWebConn *conn) {
+  PgWebRequest   *req = &conn->req;
+  StringInfo      buf = &conn->buf;
+  StringInfoData  body;
+  const char     *content_type = "text/html; charset=utf-8";
+
+  elog(DEBUG1, "%s %.*s %.*s", dyad_getAddress(conn->stream),
+       req->method.len, buf->data + req->method.off,
+       req->target.len, buf->data + req->target.off);
+
+  if (pg_web_http_slice_equals(buf, req->path, "/query")) {
+    conn->route = PG_WEB_ROUTE_QUERY;
+    pg_web_handle_query(conn);
+    return;
+  }
+  if (pg_web_http_slice_equals(buf, req->path, "/export")) {
+    conn->route = PG_WEB_ROUTE_EXPORT;
+    pg_web_handle_export(conn);
+    return;
+  }
+  if (req->path.len > PG_WEB_ENDPOINT_PREFIX_LEN &&
+      memcmp(buf->data + req->path.off, PG_WEB_ENDPOINT_PREFIX,
+             PG_WEB_ENDPOINT_PREFIX_LEN) == 0) {
+    conn->route = PG_WEB_ROUTE_ENDPOINT;
+    pg_web_handle_endpoint(conn);
+    return;
+  }
+  if (req->path.len > PG_WEB_STATIC_PREFIX_LEN &&
+      memcmp(buf->data + req->path.off, PG_WEB_STATIC_PREFIX,
+             PG_WEB_STATIC_PREFIX_LEN) == 0) {
+    conn->route = PG_WEB_ROUTE_STATIC;
+    pg_web_handle_static(conn);
+    return;
+  }
+
+  conn->route = PG_WEB_ROUTE_OTHER;
+  if (!pg_web_http_slice_equals(buf, req->method, "GET") &&
+      !pg_web_http_slice_equals(buf, req->method, "HEAD")) {
+    pg_web_respond_error(conn, 405);
+    return;
+  }
+
+  initStringInfo(&body);
+
+  if (pg_web_http_slice_equals(buf, req->path, "/")) {
+    conn->route = PG_WEB_ROUTE_INDEX;
+    appendStringInfoString(&body, "<html><body><pre>"
+                                  "<a href='/date'>date</a><br>"
+                                  "<a href='/count'>count</a><br>"
+                                  "<a href='/ip'>ip</a><br>"
+                                  "<a href='/metrics'>metrics</a>"
+                                  "</pre></body></html>");
+
+  } else if (pg_web_http_slice_equals(buf, req->path, "/date")) {
+    time_t t = time(0);
+    conn->route = PG_WEB_ROUTE_DATE;
+    appendStringInfoString(&body, ctime(&t));
+
+  } else if (pg_web_http_slice_equals(buf, req->path, "/count")) {
+    conn->route = PG_WEB_ROUTE_COUNT;
+    appendStringInfo(&body, "%d", ++count);
+
+  } else if (pg_web_http_slice_equals(buf, req->path, "/ip")) {
+    conn->route = PG_WEB_ROUTE_IP;
+    appendStringInfoString(&body, dyad_getAddress(conn->stream));
+
+  } else if (pg_web_http_slice_equals(buf, req->path, "/metrics")) {
+    conn->route = PG_WEB_ROUTE_METRICS;
+    content_type = "text/plain; version=0.0.4; charset=utf-8";
+    pg_web_stats_metrics(&body);
+
+  } else {
+    pfree(body.data);
+    pg_web_respond_error(conn, 404);
+    return;
+  }
+
+  pg_web_respond(conn, 200, content_type, body.data, body.len);
+  pfree(body.data);
+}
+
+/*
+ * pg_web_compact_buffer
+ *
+ * Drop the requests which were already handled from the receive buffer.
+ * This is only done between requests, when no slices point into the buffer.
+ */
+static void pg_web_compact_buffer(PgWebConn *conn) {
+  PgWebRequest *req = &conn->req;
+  StringInfo    buf = &conn->buf;
+  int           left;
+
+  if (req->state != PG_WEB_HTTP_REQUEST_LINE || req->start == 0) {
+    return;
+  }
+
+  pg_web_input_bytes -= req->start;
+  left = buf->len - req->start;
+  if (left > 0) {
+    memmove(buf->data, buf->data + req->start, left);
+  }
+  buf->len = left;
+  buf->data[left] = '\0';
+  req->pos -= req->start;
+  req->scan -= req->start;
+  req->start = 0;
+
+  /* Give back the memory of an unusually large request */
+  if (left == 0 && buf->maxlen > PG_WEB_CONN_BUFFER_KEEP) {
+    MemoryContext oldcontext = MemoryContextSwitchTo(PgWebConnContext);
+
+    pfree(buf->data);
+    initStringInfo(buf);
+    MemoryContextSwitchTo(oldcontext);
+  }
+}
+
+/*
+ * pg_web_throttle_input
+ *
+ * Stop reading from a client which sent more than PG_WEB_CONN_BUFFER_MAX
+ * of requests we aren't answering yet, because a query runs or its
+ * responses aren't read, and read again once they were answered. The rest
+ * waits in the socket, and the client stops sending when that fills up.
+ */
+static void pg_web_throttle_input(PgWebConn *conn) {
+  bool waiting = conn->query != NULL || conn->job != NULL ||
+                 conn->waiting || conn->paused;
+  bool full = waiting &&
+              conn->buf.len - conn->req.start > PG_WEB_CONN_BUFFER_MAX;
+
+  if (full != conn->read_paused) {
+    conn->read_paused = full;
+    dyad_setReadPaused(conn->stream, full);
+  }
+}
+
+/*
+ * pg_web_process_requests
+ *
+ * Handle every complete request in the receive buffer. Pipelined requests
+ * are answered one after another, so the responses go out in order.
+ */
+static void pg_web_process_requests(PgWebConn *conn) {
+  for (;;) {
+    int rc;
+
+    if (conn->req.pos < conn->buf.len && dyad_isFull(conn->stream)) {
+      /* The client doesn't read its responses as fast as it asks for them,
+       * the rest is answered once they drained (see onWebReady) */
+      conn->paused = true;
+      break;
+    }
+
+    if (!conn->timing && conn->req.pos < conn->buf.len) {
+      /* The request's latency is counted from when its first byte is seen */
+      INSTR_TIME_SET_CURRENT(conn->started);
+      conn->out_start = dyad_getBytesSent(conn->stream) +
+                        dyad_getBytesPending(conn->stream);
+      conn->timing = true;
+    }
+
+    rc = pg_web_http_parse(&conn->req, &conn->buf);
+    if (rc == PG_WEB_HTTP_PARSE_ERROR) {
+      /* We can't tell where the next request would start */
+      conn->req.keep_alive = false;
+      conn->route = PG_WEB_ROUTE_OTHER;
+      pg_web_respond_error(conn, conn->req.status);
+      return;
+    }
+
+    if (rc == PG_WEB_HTTP_PARSE_AGAIN) {
+      if (conn->req.expect_continue && !conn->continue_sent) {
+        /* The client waits for a go-ahead before sending the body */
+        dyad_writef(conn->stream, "HTTP/1.1 100 Continue\r\n\r\n");
+        conn->continue_sent = true;
+      }
+      break;
+    }
+
+    pg_web_handle_request(conn);
+    if (dyad_getState(conn->stream) != DYAD_STATE_CONNECTED) {
+      return;
+    }
+    if (conn->query != NULL || conn->job != NULL || conn->waiting) {
+      /* The next request waits until the result is answered */
+      pg_web_throttle_input(conn);
+      return;
+    }
+
+    /* The next request starts right after this one */
+    conn->continue_sent = false;
+    pg_web_http_request_init(&conn->req, conn->req.pos);
+  }
+
+  pg_web_compact_buffer(conn);
+  pg_web_throttle_input(conn);
+}
+
+void onWebData(dyad_Event *e) {
+  PgWebConn *conn = (PgWebConn *) e->udata;
+
+  if (conn->streaming && !conn->keep_alive) {
+    /* The connection is closed after the result, nothing more is answered */
+    return;
+  }
+  appendBinaryStringInfo(&conn->buf, e->data, e->size);
+  pg_web_input_bytes += e->size;
+  if (conn->query != NULL || conn->job != NULL || conn->waiting) {
+    /* Pipelined requests are handled once the query is answered */
+    pg_web_throttle_input(conn);
+    return;
+  }
+  pg_web_process_requests(conn);
+}
+
+void onWebReady(dyad_Event *e) {
+  PgWebConn *conn = (PgWebConn *) e->udata;
+  bool       waiting = conn->query != NULL || conn->paused ||
+                       (conn->job != NULL && conn->streaming);
+
+  if (!waiting || dyad_isFull(e->stream)) {
+    /* While the write buffers are over their limit nothing more is made,
+     * READY comes again once they are not */
+    return;
+  }
+  if (conn->query != NULL) {
+    pg_web_stream_query(conn);
+    if (dyad_getState(e->stream) == DYAD_STATE_CONNECTED &&
+        conn->query == NULL) {
+      /* The chunked response is complete, the connection goes on */
+      pg_web_next_request(conn);
+    }
+  } else if (conn->job != NULL && conn->streaming) {
+    pg_web_pool_resume(conn->job);
+  } else if (conn->paused) {
+    conn->paused = false;
+    pg_web_process_requests(conn);
+  }
+}
+
+void onWebClose(dyad_Event *e) {
+  PgWebConn *conn = (PgWebConn *) e->udata;
+
+  if (conn->query != NULL) {
+    /* The client went away before the whole result was sent */
+    pg_web_query_close(conn->query);
+    pg_web_request_done(conn, 200);
+  }
+  if (conn->job != NULL) {
+    /* Or before it was answered at all, 499 as nginx counts that */
+    pg_web_pool_abandon(conn->job);
+    pg_web_request_done(conn, conn->streaming ? 200 : 499);
+  }
+  if (conn->waiting) {
+    pg_web_unwait_query(conn);
+    pg_web_request_done(conn, 499);
+  }
+  if (conn->cache_key != NULL) {
+    pfree(conn->cache_key);
+  }
+  if (conn->compressor != NULL) {
+    pg_web_compress_end(conn->compressor);
+  }
+  if (conn->pending.data != NULL) {
+    pfree(conn->pending.data);
+  }
+  if (MyWebStats != NULL) {
+    MyWebStats->connections_active--;
+  }
+  pg_web_input_bytes -= conn->buf.len;
+  pfree(conn->buf.data);
+  pfree(conn);
 }
 
 void onWebAccept(dyad_Event *e) {
-  dyad_addListener(e->remote, DYAD_EVENT_LINE, onWebLine, NULL);
+  MemoryContext  oldcontext;
+  PgWebConn     *conn;
+
+  if (PgWebConnContext == NULL)
+    PgWebConnContext = AllocSetContextCreate(TopMemoryContext,
+                                             "pg_web connections",
+                                             ALLOCSET_DEFAULT_MINSIZE,
+                                             ALLOCSET_DEFAULT_INITSIZE,
+                                             ALLOCSET_DEFAULT_MAXSIZE);
+
+  oldcontext = MemoryContextSwitchTo(PgWebConnContext);
+  conn = palloc0(sizeof(PgWebConn));
+  conn->stream = e->remote;
+  initStringInfo(&conn->buf);
+  pg_web_http_request_init(&conn->req, 0);
+  MemoryContextSwitchTo(oldcontext);
+
+  if (MyWebStats != NULL) {
+    MyWebStats->connections_active++;
+    MyWebStats->connections_total++;
+  }
+
+  dyad_addListener(e->remote, DYAD_EVENT_DATA,  onWebData,  conn);
+  dyad_addListener(e->remote, DYAD_EVENT_READY, onWebReady, conn);
+  dyad_addListener(e->remote, DYAD_EVENT_CLOSE, onWebClose, conn);
+  /* Producers wait once this much is unsent, see dyad_isFull */
+  dyad_setHighWatermark(e->remote,
+                        pg_web_setting_write_buffer_high_water * 1024);
+  /* Idle (and slow) connections are closed after the keep-alive timeout */
+  if (pg_web_setting_keepalive_timeout > 0) {
+    dyad_setTimeout(e->remote, pg_web_setting_keepalive_timeout);
+  }
+}
+
+/*
+ * pg_web_input_buffered
+ *
+ * Bytes of requests held in the receive buffers of the connections.
+ */
+uint64 pg_web_input_buffered(void) {
+  return pg_web_input_bytes;
+}
+
+/*
+ * pg_web_run_waiting
+ *
+ * Open the queries waiting for the shared transaction as long as it takes
+ * them, and answer the ones which waited past their deadline with 503.
+ * Called from the event loop.
+ */
+void pg_web_run_waiting(void) {
+  TimestampTz now = 0;
+
+  while (!dlist_is_empty(&pg_web_waiting)) {
+    PgWebConn   *conn = dlist_container(PgWebConn, wait_node,
+                                        dlist_head_node(&pg_web_waiting));
+    dyad_Stream *stream = conn->stream;
+    char        *sql = conn->wait_sql;
+    char        *endpoint = conn->wait_endpoint;
+    bool         admitted = pg_web_query_admits();
+
+    if (!admitted) {
+      if (now == 0) {
+        now = GetCurrentTimestamp();
+      }
+      /* Queries wait in the order they time out */
+      if (conn->wait_deadline == 0 || conn->wait_deadline > now) {
+        break;
+      }
+    }
+
+    conn->wait_sql = NULL;
+    conn->wait_endpoint = NULL;
+    pg_web_unwait_query(conn);
+    if (pg_web_setting_keepalive_timeout > 0) {
+      dyad_setTimeout(stream, pg_web_setting_keepalive_timeout);
+    }
+    if (admitted) {
+      pg_web_run_query(conn, sql, endpoint, conn->wait_format,
+                       conn->wait_header, conn->wait_deadline);
+    } else {
+      pg_web_query_result(conn, PG_WEB_QUERY_UNAVAILABLE, NULL,
+                          "no transaction could take the query in time",
+                          NULL);
+    }
+    if (sql != NULL) {
+      pfree(sql);
+    }
+    if (endpoint != NULL) {
+      pfree(endpoint);
+    }
+
+    /* Closing the connection may have freed conn, the stream lives until
+     * the next update */
+    if (dyad_getState(stream) == DYAD_STATE_CONNECTED &&
+        conn->query == NULL && !conn->waiting) {
+      pg_web_next_request(conn);
+    }
+  }
+}
+
+/*
+ * pg_web_waiting_next_timeout
+ *
+ * Milliseconds until the first query waiting for the shared transaction
+ * times out, or -1.
+ */
+long pg_web_waiting_next_timeout(void) {
+  PgWebConn *conn;
+  long       secs;
+  int        usecs;
+
+  if (dlist_is_empty(&pg_web_waiting)) {
+    return -1;
+  }
+  conn = dlist_container(PgWebConn, wait_node,
+                         dlist_head_node(&pg_web_waiting));
+  if (conn->wait_deadline == 0) {
+    return -1;
+  }
+  TimestampDifference(GetCurrentTimestamp(), conn->wait_deadline,
+                      &secs, &usecs);
+  return secs * 1000 + (usecs + 999) / 1000;
 }
 
 void onWebListen(dyad_Event *e) {
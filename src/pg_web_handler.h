@@ -11,12 +11,68 @@
  * Software; see the LICENSE file for the license conditions.
  */
 
+#ifndef PG_WEB_HANDLER_H
+#define PG_WEB_HANDLER_H
+
 #include <stdio.h>
 #include <time.h>
 #include "postgres.h"
+#include "lib/ilist.h"
+#include "lib/stringinfo.h"
+#include "portability/instr_time.h"
 #include "dyad.h"
+#include "pg_web_compress.h"
+#include "pg_web_http.h"
+#include "pg_web_pool.h"
+#include "pg_web_query.h"
+#include "pg_web_static.h"
+#include "pg_web_stats.h"
+
+/* state of one HTTP connection */
+typedef struct PgWebConn
+{
+  dyad_Stream    *stream;
+  StringInfoData  buf;            /* receive buffer, requests are parsed in it */
+  PgWebRequest    req;
+  bool            continue_sent;  /* answered "Expect: 100-continue" */
+  PgWebQuery     *query;          /* query whose result is being streamed */
+  PgWebJob       *job;            /* or the query run by the pool */
+  bool            waiting;        /* or the query waits to be opened, */
+  dlist_node      wait_node;      /* see pg_web_wait_query */
+  char           *wait_sql;       /* its SQL, or */
+  char           *wait_endpoint;  /* the endpoint it runs */
+  PgWebQueryFormat wait_format;
+  bool            wait_header;
+  TimestampTz     wait_deadline;
+  bool            streaming;      /* its first batch was sent */
+  const char     *content_type;   /* of its result */
+  PgWebCompressor *compressor;    /* its body goes through, if compressed */
+  bool            chunked;        /* its body is sent in chunks */
+  bool            keep_alive;     /* the connection is kept open after it */
+  StringInfoData  pending;        /* output held back for the next chunk */
+  bool            paused;         /* pipelined requests wait for READY */
+  bool            read_paused;    /* too many of them, nothing is read */
+  char           *cache_key;      /* of its result, see pg_web_serve_cached */
+  /* accounting of the current request, see pg_web_request_done */
+  PgWebRoute      route;
+  bool            timing;         /* a request was started */
+  instr_time      started;
+  uint64          out_start;      /* bytes written before the response */
+} PgWebConn;
 
-void onWebLine(dyad_Event *e);
+/* GUC variables, see pg_web.c */
+extern int pg_web_setting_keepalive_timeout;
+extern bool pg_web_setting_enable_query;
+extern int pg_web_setting_write_buffer_high_water;
+
+void onWebData(dyad_Event *e);
+void onWebReady(dyad_Event *e);
+void onWebClose(dyad_Event *e);
 void onWebAccept(dyad_Event *e);
 void onWebListen(dyad_Event *e);
 void onWebError(dyad_Event *e);
+uint64 pg_web_input_buffered(void);
+void pg_web_run_waiting(void);
+long pg_web_waiting_next_timeout(void);
+
+#endif
@@ -0,0 +1,778 @@
+/*
+ * pg_web_http.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_http.h"
+
+#include <string.h>
+
+/* longest chunk size line (size and extensions) we accept */
+#define PG_WEB_HTTP_MAX_CHUNK_LINE 1024
+
+/*
+ * pg_web_http_is_tchar
+ *
+ * Is the character allowed in a token (method, header name)?
+ */
+static bool
+pg_web_http_is_tchar(char c)
+{
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+      (c >= '0' && c <= '9'))
+    return true;
+  return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/*
+ * pg_web_http_fail
+ *
+ * Put the parser into the failed state, answering with the given status.
+ */
+static int
+pg_web_http_fail(PgWebRequest *req, int status)
+{
+  req->state = PG_WEB_HTTP_FAILED;
+  req->status = status;
+  return PG_WEB_HTTP_PARSE_ERROR;
+}
+
+/*
+ * pg_web_http_reject
+ *
+ * Same as pg_web_http_fail, for the helpers returning bool.
+ */
+static bool
+pg_web_http_reject(PgWebRequest *req, int status)
+{
+  pg_web_http_fail(req, status);
+  return false;
+}
+
+/*
+ * pg_web_http_next_line
+ *
+ * Find the end of the line which starts at req->pos. The search continues
+ * from where the previous call stopped, so a line arriving in many small
+ * pieces is scanned only once. Returns the line length without the line
+ * terminator and sets *next to the offset of the following line, or returns
+ * -1 if the line is not complete yet.
+ */
+static int
+pg_web_http_next_line(PgWebRequest *req, StringInfo buf, int *next)
+{
+  char *nl;
+  int   len;
+
+  nl = memchr(buf->data + req->scan, '\n', buf->len - req->scan);
+  if (nl == NULL)
+  {
+    req->scan = buf->len;
+    return -1;
+  }
+
+  len = nl - (buf->data + req->pos);
+  *next = req->pos + len + 1;
+  if (len > 0 && buf->data[req->pos + len - 1] == '\r')
+    len--;
+  return len;
+}
+
+/*
+ * pg_web_http_parse_request_line
+ *
+ * Parse "METHOD SP request-target SP HTTP-version".
+ */
+static bool
+pg_web_http_parse_request_line(PgWebRequest *req, StringInfo buf, int len)
+{
+  const char *line = buf->data + req->pos;
+  const char *p = line;
+  const char *end = line + len;
+  const char *q;
+
+  /* method */
+  while (p < end && pg_web_http_is_tchar(*p))
+    p++;
+  if (p == line || p == end || *p != ' ')
+    return pg_web_http_reject(req, 400);
+  req->method.off = req->pos;
+  req->method.len = p - line;
+
+  /* request target, we only take the origin form */
+  q = ++p;
+  while (p < end && *p != ' ')
+    p++;
+  if (p == q || p == end || *q != '/')
+    return pg_web_http_reject(req, 400);
+  req->target.off = req->pos + (q - line);
+  req->target.len = p - q;
+  req->path = req->target;
+  req->query.off = req->target.off + req->target.len;
+  req->query.len = 0;
+  {
+    const char *mark = memchr(q, '?', p - q);
+
+    if (mark != NULL)
+    {
+      req->path.len = mark - q;
+      req->query.off = req->path.off + req->path.len + 1;
+      req->query.len = req->target.len - req->path.len - 1;
+    }
+  }
+
+  /* version */
+  p++;
+  if (end - p != 8 || strncmp(p, "HTTP/", 5) != 0 ||
+      p[5] < '0' || p[5] > '9' || p[6] != '.' || p[7] < '0' || p[7] > '9')
+    return pg_web_http_reject(req, 400);
+  if (p[5] != '1')
+    return pg_web_http_reject(req, 505);
+  req->http_minor = p[7] - '0';
+
+  return true;
+}
+
+/*
+ * pg_web_http_parse_header
+ *
+ * Parse "field-name ':' OWS field-value OWS".
+ */
+static bool
+pg_web_http_parse_header(PgWebRequest *req, StringInfo buf, int len)
+{
+  const char  *line = buf->data + req->pos;
+  const char  *p = line;
+  const char  *end = line + len;
+  PgWebHeader *header;
+
+  /* obsolete line folding is not supported (RFC 7230, 3.2.4) */
+  if (*p == ' ' || *p == '\t')
+    return pg_web_http_reject(req, 400);
+
+  while (p < end && pg_web_http_is_tchar(*p))
+    p++;
+  if (p == line || p == end || *p != ':')
+    return pg_web_http_reject(req, 400);
+
+  if (req->nheaders >= PG_WEB_HTTP_MAX_HEADERS)
+    return pg_web_http_reject(req, 431);
+  header = &req->headers[req->nheaders++];
+  header->name.off = req->pos;
+  header->name.len = p - line;
+
+  p++;
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+  header->value.off = req->pos + (p - line);
+  header->value.len = end - p;
+
+  return true;
+}
+
+/*
+ * pg_web_http_parse_length
+ *
+ * Parse a non-negative decimal (Content-Length) or hexadecimal (chunk size)
+ * number at the start of the slice. Returns -1 on overflow or if there are
+ * no digits; *len is set to the number of characters used.
+ */
+static int64
+pg_web_http_parse_length(const char *p, int size, int base, int *len)
+{
+  int64 value = 0;
+  int   i;
+
+  for (i = 0; i < size; i++)
+  {
+    int digit;
+
+    if (p[i] >= '0' && p[i] <= '9')
+      digit = p[i] - '0';
+    else if (base == 16 && p[i] >= 'a' && p[i] <= 'f')
+      digit = p[i] - 'a' + 10;
+    else if (base == 16 && p[i] >= 'A' && p[i] <= 'F')
+      digit = p[i] - 'A' + 10;
+    else
+      break;
+
+    /* anything this large is over the body limit anyway */
+    if (value > PG_WEB_HTTP_MAX_BODY_SIZE)
+    {
+      *len = i;
+      return -1;
+    }
+    value = value * base + digit;
+  }
+
+  *len = i;
+  return i == 0 ? -1 : value;
+}
+
+/*
+ * pg_web_http_finish_headers
+ *
+ * Work out how the body is framed once the empty line after the headers has
+ * been seen.
+ */
+static bool
+pg_web_http_finish_headers(PgWebRequest *req, StringInfo buf)
+{
+  PgWebHeader *te = pg_web_http_get_header(req, buf, "Transfer-Encoding");
+  PgWebHeader *expect = pg_web_http_get_header(req, buf, "Expect");
+  PgWebHeader *connection = pg_web_http_get_header(req, buf, "Connection");
+  int          i;
+
+  req->content_length = -1;
+  for (i = 0; i < req->nheaders; i++)
+  {
+    PgWebHeader *header = &req->headers[i];
+    int64        value;
+    int          used;
+
+    if (!pg_web_http_slice_iequals(buf, header->name, "Content-Length"))
+      continue;
+
+    value = pg_web_http_parse_length(buf->data + header->value.off,
+                                     header->value.len, 10, &used);
+    if (value < 0 && used > 0)
+      return pg_web_http_reject(req, 413);
+    if (value < 0 || used != header->value.len ||
+        (req->content_length >= 0 && req->content_length != value))
+      return pg_web_http_reject(req, 400);
+    req->content_length = value;
+  }
+
+  if (te != NULL)
+  {
+    /* a request with both is a classic smuggling vector, refuse it */
+    if (req->content_length >= 0)
+      return pg_web_http_reject(req, 400);
+    if (!pg_web_http_slice_iequals(buf, te->value, "chunked"))
+      return pg_web_http_reject(req, 501);
+    req->chunked = true;
+  }
+
+  if (req->content_length > PG_WEB_HTTP_MAX_BODY_SIZE)
+    return pg_web_http_reject(req, 413);
+
+  if (expect != NULL && req->http_minor >= 1 &&
+      pg_web_http_slice_iequals(buf, expect->value, "100-continue"))
+    req->expect_continue = true;
+
+  /* persistent connections are the default since HTTP/1.1 */
+  if (req->http_minor >= 1)
+    req->keep_alive = connection == NULL ||
+      !pg_web_http_has_token(buf, connection, "close");
+  else
+    req->keep_alive = connection != NULL &&
+      pg_web_http_has_token(buf, connection, "keep-alive");
+
+  req->body.off = req->pos;
+  req->body.len = 0;
+
+  if (req->chunked)
+    req->state = PG_WEB_HTTP_CHUNK_SIZE;
+  else if (req->content_length > 0)
+  {
+    req->remaining = req->content_length;
+    req->state = PG_WEB_HTTP_BODY;
+  }
+  else
+    req->state = PG_WEB_HTTP_DONE;
+
+  return true;
+}
+
+/*
+ * pg_web_http_request_init
+ *
+ * Prepare the parser for a request starting at the given offset of the
+ * buffer (pipelined requests follow each other in the same buffer).
+ */
+void
+pg_web_http_request_init(PgWebRequest *req, int start)
+{
+  memset(req, 0, sizeof(*req));
+  req->state = PG_WEB_HTTP_REQUEST_LINE;
+  req->start = req->pos = req->scan = start;
+  req->content_length = -1;
+}
+
+/*
+ * pg_web_http_parse
+ *
+ * Continue parsing the request in buf. Returns PG_WEB_HTTP_PARSE_DONE when the
+ * whole request (including its body) is in the buffer, PG_WEB_HTTP_PARSE_AGAIN
+ * if more data is needed and PG_WEB_HTTP_PARSE_ERROR if the request is
+ * malformed or over the limits, in which case req->status is the HTTP status
+ * to answer with.
+ *
+ * Nothing is copied out of the buffer: the request line, headers and body are
+ * slices of it. The only data ever moved is a chunked body, which is decoded
+ * in place so that it ends up contiguous.
+ */
+int
+pg_web_http_parse(PgWebRequest *req, StringInfo buf)
+{
+  for (;;)
+  {
+    int len;
+    int next = 0;
+
+    switch (req->state)
+    {
+      case PG_WEB_HTTP_REQUEST_LINE:
+      case PG_WEB_HTTP_HEADERS:
+        len = pg_web_http_next_line(req, buf, &next);
+        if ((len < 0 ? buf->len : next) - req->start >
+            PG_WEB_HTTP_MAX_HEADER_SIZE)
+          return pg_web_http_fail(req,
+            req->state == PG_WEB_HTTP_REQUEST_LINE ? 414 : 431);
+        if (len < 0)
+          return PG_WEB_HTTP_PARSE_AGAIN;
+
+        if (req->state == PG_WEB_HTTP_REQUEST_LINE)
+        {
+          /* empty lines before the request line are ignored */
+          if (len > 0)
+          {
+            if (!pg_web_http_parse_request_line(req, buf, len))
+              return PG_WEB_HTTP_PARSE_ERROR;
+            req->state = PG_WEB_HTTP_HEADERS;
+          }
+          req->pos = req->scan = next;
+        }
+        else if (len > 0)
+        {
+          if (!pg_web_http_parse_header(req, buf, len))
+            return PG_WEB_HTTP_PARSE_ERROR;
+          req->pos = req->scan = next;
+        }
+        else
+        {
+          req->pos = req->scan = next;
+          if (!pg_web_http_finish_headers(req, buf))
+            return PG_WEB_HTTP_PARSE_ERROR;
+        }
+        break;
+
+      case PG_WEB_HTTP_BODY:
+        len = (int) Min(req->remaining, (int64) (buf->len - req->pos));
+        if (len == 0)
+          return PG_WEB_HTTP_PARSE_AGAIN;
+        req->body.len += len;
+        req->pos += len;
+        req->scan = req->pos;
+        req->remaining -= len;
+        if (req->remaining == 0)
+          req->state = PG_WEB_HTTP_DONE;
+        break;
+
+      case PG_WEB_HTTP_CHUNK_SIZE:
+        len = pg_web_http_next_line(req, buf, &next);
+        if (len < 0)
+        {
+          if (buf->len - req->pos > PG_WEB_HTTP_MAX_CHUNK_LINE)
+            return pg_web_http_fail(req, 400);
+          return PG_WEB_HTTP_PARSE_AGAIN;
+        }
+        {
+          const char *line = buf->data + req->pos;
+          int64       size;
+          int         used;
+
+          size = pg_web_http_parse_length(line, len, 16, &used);
+          if (size < 0 && used > 0)
+            return pg_web_http_fail(req, 413);
+          /* only chunk extensions may follow the size */
+          if (size < 0 || (used < len && line[used] != ';' &&
+                           line[used] != ' ' && line[used] != '\t'))
+            return pg_web_http_fail(req, 400);
+          if (req->body.len + size > PG_WEB_HTTP_MAX_BODY_SIZE)
+            return pg_web_http_fail(req, 413);
+
+          req->remaining = size;
+          req->state = size > 0 ? PG_WEB_HTTP_CHUNK_DATA
+                                : PG_WEB_HTTP_TRAILERS;
+        }
+        req->pos = req->scan = next;
+        break;
+
+      case PG_WEB_HTTP_CHUNK_DATA:
+        len = (int) Min(req->remaining, (int64) (buf->len - req->pos));
+        if (len == 0)
+          return PG_WEB_HTTP_PARSE_AGAIN;
+        /* move the chunk data down so the decoded body is contiguous */
+        if (req->body.off + req->body.len != req->pos)
+          memmove(buf->data + req->body.off + req->body.len,
+                  buf->data + req->pos, len);
+        req->body.len += len;
+        req->pos += len;
+        req->scan = req->pos;
+        req->remaining -= len;
+        if (req->remaining == 0)
+          req->state = PG_WEB_HTTP_CHUNK_END;
+        break;
+
+      case PG_WEB_HTTP_CHUNK_END:
+        len = pg_web_http_next_line(req, buf, &next);
+        if (len < 0)
+        {
+          if (buf->len - req->pos > 2)
+            return pg_web_http_fail(req, 400);
+          return PG_WEB_HTTP_PARSE_AGAIN;
+        }
+        if (len != 0)
+          return pg_web_http_fail(req, 400);
+        req->state = PG_WEB_HTTP_CHUNK_SIZE;
+        req->pos = req->scan = next;
+        break;
+
+      case PG_WEB_HTTP_TRAILERS:
+        /* trailer fields are read and dropped */
+        len = pg_web_http_next_line(req, buf, &next);
+        if (len < 0)
+        {
+          if (buf->len - req->pos > PG_WEB_HTTP_MAX_HEADER_SIZE)
+            return pg_web_http_fail(req, 431);
+          return PG_WEB_HTTP_PARSE_AGAIN;
+        }
+        if (len == 0)
+          req->state = PG_WEB_HTTP_DONE;
+        req->pos = req->scan = next;
+        break;
+
+      case PG_WEB_HTTP_DONE:
+        return PG_WEB_HTTP_PARSE_DONE;
+
+      case PG_WEB_HTTP_FAILED:
+        return PG_WEB_HTTP_PARSE_ERROR;
+    }
+  }
+}
+
+/*
+ * pg_web_http_slice_equals
+ *
+ * Compare a slice of the buffer with a string.
+ */
+bool
+pg_web_http_slice_equals(StringInfo buf, PgWebSlice slice, const char *str)
+{
+  return strlen(str) == (size_t) slice.len &&
+    memcmp(buf->data + slice.off, str, slice.len) == 0;
+}
+
+/*
+ * pg_web_http_slice_iequals
+ *
+ * Compare a slice of the buffer with a string, ignoring case.
+ */
+bool
+pg_web_http_slice_iequals(StringInfo buf, PgWebSlice slice, const char *str)
+{
+  return strlen(str) == (size_t) slice.len &&
+    pg_strncasecmp(buf->data + slice.off, str, slice.len) == 0;
+}
+
+/*
+ * pg_web_http_get_header
+ *
+ * Find the first header with the given name (case-insensitive).
+ */
+PgWebHeader *
+pg_web_http_get_header(PgWebRequest *req, StringInfo buf, const char *name)
+{
+  int i;
+
+  for (i = 0; i < req->nheaders; i++)
+  {
+    if (pg_web_http_slice_iequals(buf, req->headers[i].name, name))
+      return &req->headers[i];
+  }
+  return NULL;
+}
+
+/*
+ * pg_web_http_has_token
+ *
+ * Does the comma separated header value contain the token (ignoring case)?
+ * Parameters after a ';', as in "text/html;q=0.9", are not compared.
+ */
+bool
+pg_web_http_has_token(StringInfo buf, PgWebHeader *header, const char *token)
+{
+  const char *p = buf->data + header->value.off;
+  const char *end = p + header->value.len;
+  size_t      len = strlen(token);
+
+  while (p < end)
+  {
+    const char *comma = memchr(p, ',', end - p);
+    const char *stop = comma ? comma : end;
+    const char *semicolon = memchr(p, ';', stop - p);
+    const char *last = semicolon ? semicolon : stop;
+
+    while (p < stop && (*p == ' ' || *p == '\t'))
+      p++;
+    while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+      last--;
+    if ((size_t) (last - p) == len && pg_strncasecmp(p, token, len) == 0)
+      return true;
+
+    p = stop + 1;
+  }
+  return false;
+}
+
+/*
+ * pg_web_http_accepts
+ *
+ * Does the comma separated header value, like Accept-Encoding, list the
+ * token (ignoring case) without declining it with "q=0"?
+ */
+bool
+pg_web_http_accepts(StringInfo buf, PgWebHeader *header, const char *token)
+{
+  const char *p = buf->data + header->value.off;
+  const char *end = p + header->value.len;
+  size_t      len = strlen(token);
+
+  while (p < end)
+  {
+    const char *comma = memchr(p, ',', end - p);
+    const char *stop = comma ? comma : end;
+    const char *semicolon = memchr(p, ';', stop - p);
+    const char *last = semicolon ? semicolon : stop;
+
+    while (p < stop && (*p == ' ' || *p == '\t'))
+      p++;
+    while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+      last--;
+    if ((size_t) (last - p) == len && pg_strncasecmp(p, token, len) == 0)
+    {
+      const char *q = semicolon;
+
+      /* a quality of zero, with any number of zero decimals, declines it */
+      while (q != NULL && q < stop)
+      {
+        q++;
+        while (q < stop && (*q == ' ' || *q == '\t'))
+          q++;
+        if (stop - q >= 2 && (*q == 'q' || *q == 'Q') && q[1] == '=')
+        {
+          q += 2;
+          if (q >= stop || *q != '0')
+            return true;
+          q++;
+          if (q < stop && *q == '.')
+            q++;
+          while (q < stop && *q == '0')
+            q++;
+          while (q < stop && (*q == ' ' || *q == '\t'))
+            q++;
+          return q < stop && *q != ';';
+        }
+        q = memchr(q, ';', stop - q);
+      }
+      return true;
+    }
+
+    p = stop + 1;
+  }
+  return false;
+}
+
+/*
+ * pg_web_http_hex_value
+ *
+ * Value of the hex digit, or -1.
+ */
+static int
+pg_web_http_hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * pg_web_http_url_decode
+ *
+ * Decode a %XX and '+' encoded form value. Malformed escapes are kept as
+ * they are.
+ */
+static char *
+pg_web_http_url_decode(const char *p, int len)
+{
+  char *result = palloc(len + 1);
+  char *out = result;
+  int   i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (p[i] == '+')
+      *out++ = ' ';
+    else if (p[i] == '%' && i + 2 < len &&
+             pg_web_http_hex_value(p[i + 1]) >= 0 &&
+             pg_web_http_hex_value(p[i + 2]) >= 0)
+    {
+      *out++ = (char) (pg_web_http_hex_value(p[i + 1]) * 16 +
+                       pg_web_http_hex_value(p[i + 2]));
+      i += 2;
+    }
+    else
+      *out++ = p[i];
+  }
+  *out = '\0';
+  return result;
+}
+
+/*
+ * pg_web_http_etag_matches
+ *
+ * Does the If-None-Match header list the entity tag (quotes included), or
+ * is it "*"? Tags are compared weakly, that is without their "W/".
+ */
+bool
+pg_web_http_etag_matches(StringInfo buf, PgWebHeader *header,
+                         const char *etag)
+{
+  const char *p = buf->data + header->value.off;
+  const char *end = p + header->value.len;
+  size_t      len = strlen(etag);
+
+  while (p < end)
+  {
+    const char *comma = memchr(p, ',', end - p);
+    const char *stop = comma ? comma : end;
+    const char *last = stop;
+
+    while (p < stop && (*p == ' ' || *p == '\t'))
+      p++;
+    while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+      last--;
+    if (last - p == 1 && *p == '*')
+      return true;
+    if (last - p > 2 && p[0] == 'W' && p[1] == '/')
+      p += 2;
+    if ((size_t) (last - p) == len && memcmp(p, etag, len) == 0)
+      return true;
+
+    p = stop + 1;
+  }
+  return false;
+}
+
+/*
+ * pg_web_http_etag_next
+ *
+ * The next entity tag the If-None-Match header lists from *pos on, which
+ * starts at 0, as a slice of the buffer without "W/" and the quotes.
+ * Returns false after the last one.
+ */
+bool
+pg_web_http_etag_next(StringInfo buf, PgWebHeader *header, int *pos,
+                      PgWebSlice *tag)
+{
+  const char *start = buf->data + header->value.off;
+  const char *end = start + header->value.len;
+  const char *p = start + *pos;
+
+  while (p < end)
+  {
+    const char *comma = memchr(p, ',', end - p);
+    const char *stop = comma ? comma : end;
+    const char *last = stop;
+
+    while (p < stop && (*p == ' ' || *p == '\t'))
+      p++;
+    while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+      last--;
+    if (last - p > 2 && p[0] == 'W' && p[1] == '/')
+      p += 2;
+    *pos = (stop < end ? stop + 1 : end) - start;
+    if (last - p >= 2 && p[0] == '"' && last[-1] == '"')
+    {
+      tag->off = p + 1 - buf->data;
+      tag->len = last - p - 2;
+      return true;
+    }
+    p = start + *pos;
+  }
+  return false;
+}
+
+/*
+ * pg_web_http_query_param
+ *
+ * Decoded value of the first parameter with the given name in the query
+ * string, or NULL if there is none.
+ */
+char *
+pg_web_http_query_param(StringInfo buf, PgWebSlice query, const char *name)
+{
+  const char *p = buf->data + query.off;
+  const char *end = p + query.len;
+  size_t      len = strlen(name);
+
+  while (p < end)
+  {
+    const char *amp = memchr(p, '&', end - p);
+    const char *stop = amp ? amp : end;
+    const char *eq = memchr(p, '=', stop - p);
+    const char *key_end = eq ? eq : stop;
+
+    if ((size_t) (key_end - p) == len && memcmp(p, name, len) == 0)
+      return eq ? pg_web_http_url_decode(eq + 1, stop - eq - 1)
+                : pstrdup("");
+
+    p = stop + 1;
+  }
+  return NULL;
+}
+
+/*
+ * pg_web_http_status_text
+ *
+ * Reason phrase for the status code.
+ */
+const char *
+pg_web_http_status_text(int status)
+{
+  switch (status)
+  {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+  }
+  return "Unknown";
+}
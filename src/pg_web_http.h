@@ -0,0 +1,105 @@
+/*
+ * pg_web_http.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_HTTP_H
+#define PG_WEB_HTTP_H
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+/* request size limits */
+#define PG_WEB_HTTP_MAX_HEADERS      64
+#define PG_WEB_HTTP_MAX_HEADER_SIZE  (16 * 1024)  /* request line + headers */
+#define PG_WEB_HTTP_MAX_BODY_SIZE    (1024 * 1024)
+
+/*
+ * Part of the connection's receive buffer. Offsets are used instead of
+ * pointers because the buffer may be moved when it grows.
+ */
+typedef struct PgWebSlice
+{
+  int off;
+  int len;
+} PgWebSlice;
+
+typedef struct PgWebHeader
+{
+  PgWebSlice name;
+  PgWebSlice value;
+} PgWebHeader;
+
+typedef enum PgWebHttpState
+{
+  PG_WEB_HTTP_REQUEST_LINE,
+  PG_WEB_HTTP_HEADERS,
+  PG_WEB_HTTP_BODY,
+  PG_WEB_HTTP_CHUNK_SIZE,
+  PG_WEB_HTTP_CHUNK_DATA,
+  PG_WEB_HTTP_CHUNK_END,
+  PG_WEB_HTTP_TRAILERS,
+  PG_WEB_HTTP_DONE,
+  PG_WEB_HTTP_FAILED
+} PgWebHttpState;
+
+/* results of pg_web_http_parse */
+#define PG_WEB_HTTP_PARSE_DONE   0
+#define PG_WEB_HTTP_PARSE_AGAIN  1
+#define PG_WEB_HTTP_PARSE_ERROR  2
+
+typedef struct PgWebRequest
+{
+  /* parser state, kept between calls so nothing is scanned twice */
+  PgWebHttpState state;
+  int         start;        /* offset of the request in the buffer */
+  int         pos;          /* first byte which is not parsed yet */
+  int         scan;         /* where to continue looking for end of line */
+  int64       remaining;    /* bytes left in the body or current chunk */
+  int         status;       /* HTTP status to answer a bad request with */
+
+  /* the parsed request, as slices of the receive buffer */
+  PgWebSlice  method;
+  PgWebSlice  target;
+  PgWebSlice  path;
+  PgWebSlice  query;
+  int         http_minor;   /* HTTP/1.x */
+  PgWebHeader headers[PG_WEB_HTTP_MAX_HEADERS];
+  int         nheaders;
+  int64       content_length;
+  bool        chunked;
+  bool        expect_continue;
+  bool        keep_alive;
+  PgWebSlice  body;
+} PgWebRequest;
+
+void pg_web_http_request_init(PgWebRequest *req, int start);
+int pg_web_http_parse(PgWebRequest *req, StringInfo buf);
+
+bool pg_web_http_slice_equals(StringInfo buf, PgWebSlice slice,
+                              const char *str);
+bool pg_web_http_slice_iequals(StringInfo buf, PgWebSlice slice,
+                               const char *str);
+PgWebHeader *pg_web_http_get_header(PgWebRequest *req, StringInfo buf,
+                                    const char *name);
+bool pg_web_http_has_token(StringInfo buf, PgWebHeader *header,
+                           const char *token);
+bool pg_web_http_accepts(StringInfo buf, PgWebHeader *header,
+                         const char *token);
+bool pg_web_http_etag_matches(StringInfo buf, PgWebHeader *header,
+                              const char *etag);
+bool pg_web_http_etag_next(StringInfo buf, PgWebHeader *header, int *pos,
+                           PgWebSlice *tag);
+char *pg_web_http_query_param(StringInfo buf, PgWebSlice query,
+                              const char *name);
+const char *pg_web_http_status_text(int status);
+
+#endif
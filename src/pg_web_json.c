@@ -0,0 +1,705 @@
+/*
+ * pg_web_json.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_json.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/json.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 120000
+#include "common/shortest_dec.h"
+#include "utils/float.h"
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define PG_WEB_JSON_SSE2
+#define PG_WEB_JSON_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PG_WEB_JSON_SSE2
+#endif
+
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+#if PG_VERSION_NUM < 110000
+#define DatumGetJsonbP(d) DatumGetJsonb(d)
+#endif
+
+PG_FUNCTION_INFO_V1(pg_web_json_bench);
+
+Datum pg_web_json_bench(PG_FUNCTION_ARGS);
+
+/* does the byte have to be escaped in a JSON string? */
+#define PG_WEB_JSON_SPECIAL(c) \
+  ((unsigned char) (c) < 0x20 || (c) == '"' || (c) == '\\')
+
+/*
+ * pg_web_json_scan_scalar
+ *
+ * Length of the prefix of str which can be copied as it is.
+ */
+static int
+pg_web_json_scan_scalar(const char *str, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (PG_WEB_JSON_SPECIAL(str[i]))
+      break;
+  }
+  return i;
+}
+
+#ifdef PG_WEB_JSON_SSE2
+/*
+ * pg_web_json_scan_sse2
+ *
+ * As pg_web_json_scan_scalar, 16 bytes at a time. A byte is below 0x20 if
+ * the unsigned minimum of it and 0x1F is the byte itself.
+ */
+static int
+pg_web_json_scan_sse2(const char *str, int len)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  int           i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (str + i));
+    __m128i special;
+    int     mask;
+
+    special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                           _mm_cmpeq_epi8(chunk, backslash));
+    special = _mm_or_si128(special,
+                           _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    mask = _mm_movemask_epi8(special);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + pg_web_json_scan_scalar(str + i, len - i);
+}
+#endif
+
+#ifdef PG_WEB_JSON_AVX2
+/*
+ * pg_web_json_scan_avx2
+ *
+ * As pg_web_json_scan_sse2, 32 bytes at a time. Only called if the CPU
+ * supports AVX2.
+ */
+__attribute__((target("avx2")))
+static int
+pg_web_json_scan_avx2(const char *str, int len)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1F);
+  int           i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+  {
+    __m256i  chunk = _mm256_loadu_si256((const __m256i *) (str + i));
+    __m256i  special;
+    uint32   mask;
+
+    special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                              _mm256_cmpeq_epi8(chunk, backslash));
+    special = _mm256_or_si256(special,
+                              _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control),
+                                                chunk));
+    mask = (uint32) _mm256_movemask_epi8(special);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + pg_web_json_scan_sse2(str + i, len - i);
+}
+#endif
+
+/*
+ * pg_web_json_scan_choose
+ *
+ * Pick the scan function for this CPU on the first call.
+ */
+static int pg_web_json_scan_choose(const char *str, int len);
+
+static int (*pg_web_json_scan)(const char *str, int len) =
+  pg_web_json_scan_choose;
+
+static int
+pg_web_json_scan_choose(const char *str, int len)
+{
+#if defined(PG_WEB_JSON_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    pg_web_json_scan = pg_web_json_scan_avx2;
+  else
+    pg_web_json_scan = pg_web_json_scan_sse2;
+#elif defined(PG_WEB_JSON_SSE2)
+  pg_web_json_scan = pg_web_json_scan_sse2;
+#else
+  pg_web_json_scan = pg_web_json_scan_scalar;
+#endif
+  return pg_web_json_scan(str, len);
+}
+
+/*
+ * pg_web_json_escape
+ *
+ * Append the string quoted and escaped as escape_json() does, copying the
+ * runs of bytes which need no escaping as a whole.
+ */
+void
+pg_web_json_escape(StringInfo out, const char *str, int len)
+{
+  static const char hex[] = "0123456789abcdef";
+  const char       *end = str + len;
+
+  enlargeStringInfo(out, len + 2);
+  appendStringInfoCharMacro(out, '"');
+  while (str < end)
+  {
+    int  run = pg_web_json_scan(str, end - str);
+    char c;
+
+    appendBinaryStringInfo(out, str, run);
+    str += run;
+    if (str == end)
+      break;
+
+    c = *str++;
+    switch (c)
+    {
+      case '\b':
+        appendBinaryStringInfo(out, "\\b", 2);
+        break;
+      case '\f':
+        appendBinaryStringInfo(out, "\\f", 2);
+        break;
+      case '\n':
+        appendBinaryStringInfo(out, "\\n", 2);
+        break;
+      case '\r':
+        appendBinaryStringInfo(out, "\\r", 2);
+        break;
+      case '\t':
+        appendBinaryStringInfo(out, "\\t", 2);
+        break;
+      case '"':
+        appendBinaryStringInfo(out, "\\\"", 2);
+        break;
+      case '\\':
+        appendBinaryStringInfo(out, "\\\\", 2);
+        break;
+      default:
+        {
+          char u[6] = {'\\', 'u', '0', '0', 0, 0};
+
+          u[4] = hex[(c >> 4) & 0xF];
+          u[5] = hex[c & 0xF];
+          appendBinaryStringInfo(out, u, 6);
+        }
+        break;
+    }
+  }
+  appendStringInfoCharMacro(out, '"');
+}
+
+/*
+ * pg_web_json_type
+ *
+ * How values of the type are written.
+ */
+static PgWebJsonType
+pg_web_json_type(Oid typoid)
+{
+  switch (getBaseType(typoid))
+  {
+    case INT2OID:
+      return PG_WEB_JSON_INT2;
+    case INT4OID:
+      return PG_WEB_JSON_INT4;
+    case INT8OID:
+      return PG_WEB_JSON_INT8;
+    case OIDOID:
+      return PG_WEB_JSON_OID;
+    case FLOAT4OID:
+      return PG_WEB_JSON_FLOAT4;
+    case FLOAT8OID:
+      return PG_WEB_JSON_FLOAT8;
+    case BOOLOID:
+      return PG_WEB_JSON_BOOL;
+    case NUMERICOID:
+      return PG_WEB_JSON_NUMERIC;
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+      return PG_WEB_JSON_TEXT;
+    case TIMESTAMPOID:
+      return PG_WEB_JSON_TIMESTAMP;
+    case TIMESTAMPTZOID:
+      return PG_WEB_JSON_TIMESTAMPTZ;
+    case JSONOID:
+      return PG_WEB_JSON_JSON;
+    case JSONBOID:
+      return PG_WEB_JSON_JSONB;
+    default:
+      return PG_WEB_JSON_OTHER;
+  }
+}
+
+/*
+ * pg_web_json_create
+ *
+ * Set up the writer for rows of tupdesc. The output functions are used
+ * for numeric and the types without a fast path; they must live as long
+ * as the writer.
+ */
+PgWebJson *
+pg_web_json_create(TupleDesc tupdesc, FmgrInfo *outfuncs)
+{
+  PgWebJson      *json = palloc0(sizeof(PgWebJson));
+  StringInfoData  key;
+  int             i;
+
+  json->natts = tupdesc->natts;
+  json->columns = palloc0(sizeof(PgWebJsonColumn) * json->natts);
+  json->values = palloc(sizeof(Datum) * json->natts);
+  json->nulls = palloc(sizeof(bool) * json->natts);
+
+  for (i = 0; i < json->natts; i++)
+  {
+    Form_pg_attribute  attr = TupleDescAttr(tupdesc, i);
+    PgWebJsonColumn   *col = &json->columns[i];
+
+    initStringInfo(&key);
+    pg_web_json_escape(&key, NameStr(attr->attname),
+                       strlen(NameStr(attr->attname)));
+    appendStringInfoChar(&key, ':');
+    col->key = key.data;
+    col->key_len = key.len;
+    col->type = pg_web_json_type(attr->atttypid);
+    col->outfunc = &outfuncs[i];
+  }
+
+  return json;
+}
+
+/*
+ * pg_web_json_int
+ *
+ * Append the integer, without going through a string.
+ */
+static void
+pg_web_json_int(StringInfo out, int64 value)
+{
+  char    buf[24];
+  char   *p = buf + sizeof(buf);
+  uint64  u = value < 0 ? -(uint64) value : (uint64) value;
+
+  do
+  {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (value < 0)
+    *--p = '-';
+
+  appendBinaryStringInfo(out, p, buf + sizeof(buf) - p);
+}
+
+/*
+ * pg_web_json_float
+ *
+ * Append the float as float4out/float8out would write it. NaN and the
+ * infinities are not JSON numbers and become strings.
+ */
+static void
+pg_web_json_float(StringInfo out, double num, bool single)
+{
+  char buf[64];
+  int  ndig;
+
+  if (isnan(num))
+  {
+    appendStringInfoString(out, "\"NaN\"");
+    return;
+  }
+  if (isinf(num))
+  {
+    appendStringInfoString(out, num > 0 ? "\"Infinity\"" : "\"-Infinity\"");
+    return;
+  }
+
+#if PG_VERSION_NUM >= 120000
+  /* the shortest exact form, the default since 12 */
+  if (extra_float_digits > 0)
+  {
+    int len = single ? float_to_shortest_decimal_bufn((float) num, buf)
+                     : double_to_shortest_decimal_bufn(num, buf);
+
+    appendBinaryStringInfo(out, buf, len);
+    return;
+  }
+#endif
+
+  ndig = (single ? FLT_DIG : DBL_DIG) + extra_float_digits;
+  if (ndig < 1)
+    ndig = 1;
+  snprintf(buf, sizeof(buf), "%.*g", ndig, num);
+  appendStringInfoString(out, buf);
+}
+
+/*
+ * pg_web_json_timestamp
+ *
+ * Append the timestamp as to_json() does, in ISO 8601.
+ */
+static void
+pg_web_json_timestamp(StringInfo out, Timestamp ts, bool with_tz)
+{
+  struct pg_tm  tm;
+  fsec_t        fsec;
+  int           tz;
+  const char   *tzn = NULL;
+  char          buf[MAXDATELEN + 1];
+
+  if (TIMESTAMP_NOT_FINITE(ts))
+  {
+    appendStringInfoString(out, TIMESTAMP_IS_NOBEGIN(ts) ? "\"-infinity\""
+                                                         : "\"infinity\"");
+    return;
+  }
+
+  if (timestamp2tm(ts, with_tz ? &tz : NULL, &tm, &fsec,
+                   with_tz ? &tzn : NULL, NULL) != 0)
+    ereport(ERROR,
+            (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+             errmsg("timestamp out of range")));
+
+  EncodeDateTime(&tm, fsec, with_tz, tz, tzn, USE_XSD_DATES, buf);
+  appendStringInfoCharMacro(out, '"');
+  appendStringInfoString(out, buf);
+  appendStringInfoCharMacro(out, '"');
+}
+
+/*
+ * pg_web_json_value
+ *
+ * Append a non-null value of the column.
+ */
+static void
+pg_web_json_value(PgWebJsonColumn *col, Datum value, StringInfo out)
+{
+  switch (col->type)
+  {
+    case PG_WEB_JSON_INT2:
+      pg_web_json_int(out, DatumGetInt16(value));
+      break;
+    case PG_WEB_JSON_INT4:
+      pg_web_json_int(out, DatumGetInt32(value));
+      break;
+    case PG_WEB_JSON_INT8:
+      pg_web_json_int(out, DatumGetInt64(value));
+      break;
+    case PG_WEB_JSON_OID:
+      pg_web_json_int(out, DatumGetObjectId(value));
+      break;
+    case PG_WEB_JSON_FLOAT4:
+      pg_web_json_float(out, DatumGetFloat4(value), true);
+      break;
+    case PG_WEB_JSON_FLOAT8:
+      pg_web_json_float(out, DatumGetFloat8(value), false);
+      break;
+    case PG_WEB_JSON_BOOL:
+      if (DatumGetBool(value))
+        appendBinaryStringInfo(out, "true", 4);
+      else
+        appendBinaryStringInfo(out, "false", 5);
+      break;
+    case PG_WEB_JSON_NUMERIC:
+      {
+        char *str = OutputFunctionCall(col->outfunc, value);
+
+        /* digits need no escaping, NaN and infinities are strings */
+        if (str[0] == 'N' || str[0] == 'I' || str[1] == 'I')
+          pg_web_json_escape(out, str, strlen(str));
+        else
+          appendStringInfoString(out, str);
+        pfree(str);
+      }
+      break;
+    case PG_WEB_JSON_TEXT:
+      {
+        text *txt = DatumGetTextPP(value);
+
+        pg_web_json_escape(out, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt));
+        if ((Pointer) txt != DatumGetPointer(value))
+          pfree(txt);
+      }
+      break;
+    case PG_WEB_JSON_TIMESTAMP:
+      pg_web_json_timestamp(out, DatumGetTimestamp(value), false);
+      break;
+    case PG_WEB_JSON_TIMESTAMPTZ:
+      pg_web_json_timestamp(out, DatumGetTimestampTz(value), true);
+      break;
+    case PG_WEB_JSON_JSON:
+      {
+        /* valid JSON already, copied as it is */
+        text *txt = DatumGetTextPP(value);
+
+        appendBinaryStringInfo(out, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt));
+        if ((Pointer) txt != DatumGetPointer(value))
+          pfree(txt);
+      }
+      break;
+    case PG_WEB_JSON_JSONB:
+      {
+        Jsonb *jb = DatumGetJsonbP(value);
+
+#if PG_VERSION_NUM >= 90500
+        JsonbToCString(out, &jb->root, VARSIZE(jb));
+#else
+        JsonbToCString(out, VARDATA(jb), VARSIZE(jb));
+#endif
+        if ((Pointer) jb != DatumGetPointer(value))
+          pfree(jb);
+      }
+      break;
+    default:
+      {
+        char *str = OutputFunctionCall(col->outfunc, value);
+
+        pg_web_json_escape(out, str, strlen(str));
+        pfree(str);
+      }
+      break;
+  }
+}
+
+/*
+ * pg_web_json_row
+ *
+ * Append the row as a JSON object.
+ */
+void
+pg_web_json_row(PgWebJson *json, HeapTuple tuple, TupleDesc tupdesc,
+                StringInfo out)
+{
+  int i;
+
+  heap_deform_tuple(tuple, tupdesc, json->values, json->nulls);
+
+  appendStringInfoCharMacro(out, '{');
+  for (i = 0; i < json->natts; i++)
+  {
+    PgWebJsonColumn *col = &json->columns[i];
+
+    if (i > 0)
+      appendStringInfoCharMacro(out, ',');
+    appendBinaryStringInfo(out, col->key, col->key_len);
+
+    if (json->nulls[i])
+      appendBinaryStringInfo(out, "null", 4);
+    else
+      pg_web_json_value(col, json->values[i], out);
+  }
+  appendStringInfoCharMacro(out, '}');
+}
+
+/*
+ * pg_web_json_row_generic
+ *
+ * Append the row as a JSON object the generic way, through the output
+ * function of every value and escape_json(). Only used as the baseline of
+ * pg_web_json_bench.
+ */
+static void
+pg_web_json_row_generic(PgWebJson *json, HeapTuple tuple, TupleDesc tupdesc,
+                        StringInfo out)
+{
+  int i;
+
+  appendStringInfoChar(out, '{');
+  for (i = 0; i < json->natts; i++)
+  {
+    PgWebJsonColumn *col = &json->columns[i];
+    Datum            value;
+    bool             isnull;
+    char            *str;
+
+    if (i > 0)
+      appendStringInfoChar(out, ',');
+    appendStringInfoString(out, col->key);
+
+    value = SPI_getbinval(tuple, tupdesc, i + 1, &isnull);
+    if (isnull)
+    {
+      appendStringInfoString(out, "null");
+      continue;
+    }
+
+    str = OutputFunctionCall(col->outfunc, value);
+    switch (col->type)
+    {
+      case PG_WEB_JSON_INT2:
+      case PG_WEB_JSON_INT4:
+      case PG_WEB_JSON_INT8:
+      case PG_WEB_JSON_OID:
+      case PG_WEB_JSON_FLOAT4:
+      case PG_WEB_JSON_FLOAT8:
+      case PG_WEB_JSON_NUMERIC:
+        if ((str[0] >= '0' && str[0] <= '9') ||
+            (str[0] == '-' && str[1] >= '0' && str[1] <= '9'))
+          appendStringInfoString(out, str);
+        else
+          escape_json(out, str);
+        break;
+      case PG_WEB_JSON_BOOL:
+        appendStringInfoString(out, str[0] == 't' ? "true" : "false");
+        break;
+      case PG_WEB_JSON_JSON:
+      case PG_WEB_JSON_JSONB:
+        appendStringInfoString(out, str);
+        break;
+      default:
+        escape_json(out, str);
+        break;
+    }
+  }
+  appendStringInfoChar(out, '}');
+}
+
+/*
+ * pg_web_json_bench
+ *
+ * Run the query once and write its rows as JSON the given number of times
+ * with the generic and with the type-specialized writer. Returns the rows
+ * and bytes of one pass and the milliseconds all passes took.
+ */
+Datum
+pg_web_json_bench(PG_FUNCTION_ARGS)
+{
+  char          *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  int32          loops = PG_GETARG_INT32(1);
+  TupleDesc      result_desc;
+  TupleDesc      tupdesc;
+  SPITupleTable *tuptable;
+  MemoryContext  bench_cxt;
+  MemoryContext  oldcontext;
+  FmgrInfo      *outfuncs;
+  PgWebJson     *json;
+  StringInfoData out;
+  instr_time     start;
+  instr_time     duration;
+  double         elapsed[2];
+  int64          bytes = 0;
+  uint64         ntuples;
+  Datum          values[4];
+  bool           nulls[4] = {false, false, false, false};
+  int            pass;
+  int            i;
+
+  if (get_call_result_type(fcinfo, NULL, &result_desc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  if (loops < 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("loops must be at least 1")));
+
+  if (SPI_connect() != SPI_OK_CONNECT)
+    elog(ERROR, "pg_web: SPI_connect failed");
+  if (SPI_execute(sql, true, 0) < 0 || SPI_tuptable == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("query must return rows")));
+  tuptable = SPI_tuptable;
+  tupdesc = tuptable->tupdesc;
+  ntuples = SPI_processed;
+
+  outfuncs = palloc(sizeof(FmgrInfo) * tupdesc->natts);
+  for (i = 0; i < tupdesc->natts; i++)
+  {
+    Oid  outfunc;
+    bool isvarlena;
+
+    getTypeOutputInfo(TupleDescAttr(tupdesc, i)->atttypid, &outfunc,
+                      &isvarlena);
+    fmgr_info(outfunc, &outfuncs[i]);
+  }
+  json = pg_web_json_create(tupdesc, outfuncs);
+
+  /* values written are freed after every pass */
+  bench_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                    "pg_web json bench",
+                                    ALLOCSET_DEFAULT_MINSIZE,
+                                    ALLOCSET_DEFAULT_INITSIZE,
+                                    ALLOCSET_DEFAULT_MAXSIZE);
+  initStringInfo(&out);
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    INSTR_TIME_SET_CURRENT(start);
+    for (i = 0; i < loops; i++)
+    {
+      uint64 row;
+
+      resetStringInfo(&out);
+      oldcontext = MemoryContextSwitchTo(bench_cxt);
+      for (row = 0; row < ntuples; row++)
+      {
+        appendStringInfoString(&out, row == 0 ? "[\n" : ",\n");
+        if (pass == 0)
+          pg_web_json_row_generic(json, tuptable->vals[row], tupdesc, &out);
+        else
+          pg_web_json_row(json, tuptable->vals[row], tupdesc, &out);
+      }
+      appendStringInfoString(&out, ntuples == 0 ? "[]\n" : "\n]\n");
+      MemoryContextSwitchTo(oldcontext);
+      MemoryContextReset(bench_cxt);
+      CHECK_FOR_INTERRUPTS();
+    }
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    elapsed[pass] = INSTR_TIME_GET_MILLISEC(duration);
+    bytes = out.len;
+  }
+
+  SPI_finish();
+
+  values[0] = Int64GetDatum((int64) ntuples);
+  values[1] = Int64GetDatum(bytes);
+  values[2] = Float8GetDatum(elapsed[0]);
+  values[3] = Float8GetDatum(elapsed[1]);
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(result_desc, values,
+                                                    nulls)));
+}
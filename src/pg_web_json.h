@@ -0,0 +1,64 @@
+/*
+ * pg_web_json.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_JSON_H
+#define PG_WEB_JSON_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/htup.h"
+#include "access/tupdesc.h"
+#include "lib/stringinfo.h"
+
+/* how a column's values are written */
+typedef enum PgWebJsonType
+{
+  PG_WEB_JSON_INT2,
+  PG_WEB_JSON_INT4,
+  PG_WEB_JSON_INT8,
+  PG_WEB_JSON_OID,
+  PG_WEB_JSON_FLOAT4,
+  PG_WEB_JSON_FLOAT8,
+  PG_WEB_JSON_BOOL,
+  PG_WEB_JSON_NUMERIC,
+  PG_WEB_JSON_TEXT,           /* text, varchar and bpchar */
+  PG_WEB_JSON_TIMESTAMP,
+  PG_WEB_JSON_TIMESTAMPTZ,
+  PG_WEB_JSON_JSON,
+  PG_WEB_JSON_JSONB,
+  PG_WEB_JSON_OTHER           /* a string from the output function */
+} PgWebJsonType;
+
+typedef struct PgWebJsonColumn
+{
+  char           *key;        /* '"name":' */
+  int             key_len;
+  PgWebJsonType   type;
+  FmgrInfo       *outfunc;
+} PgWebJsonColumn;
+
+/* writer of rows as JSON objects */
+typedef struct PgWebJson
+{
+  int               natts;
+  PgWebJsonColumn  *columns;
+  Datum            *values;     /* of the row being written */
+  bool             *nulls;
+} PgWebJson;
+
+PgWebJson *pg_web_json_create(TupleDesc tupdesc, FmgrInfo *outfuncs);
+void pg_web_json_row(PgWebJson *json, HeapTuple tuple, TupleDesc tupdesc,
+                     StringInfo out);
+void pg_web_json_escape(StringInfo out, const char *str, int len);
+
+#endif
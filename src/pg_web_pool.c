@@ -0,0 +1,896 @@
+/*
+ * pg_web_pool.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_pool.h"
+
+#include "lib/ilist.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+
+#include "pg_web_http.h"
+
+/*
+ * Each HTTP worker runs its queries in a pool of executors, background
+ * workers it starts as they are needed (up to pg_web.query_workers) and
+ * which live as long as it does. An executor shares a DSM segment with its
+ * HTTP worker, holding a queue of jobs to it and a queue of results back.
+ * It runs one job at a time, sending the batches of the result as
+ * messages; when the HTTP worker stops reading them (its client is slow)
+ * the result queue fills up and the executor waits. The HTTP worker only
+ * ever polls the queues, so its event loop never blocks on a query. Jobs
+ * wait in a queue of up to pg_web.query_queue_depth for a free executor.
+ *
+ * When the client goes away the HTTP worker cancels its job: it stores the
+ * job's id in the segment and sends the executor SIGINT, which cancels the
+ * query if it is still running that job.
+ */
+#define PG_WEB_POOL_MAX_WORKERS   64
+#define PG_WEB_POOL_MAGIC         0x70677765
+#define PG_WEB_POOL_JOB_QUEUE     (16 * 1024)
+#define PG_WEB_POOL_RESULT_QUEUE  (64 * 1024)
+
+/* result messages, the first byte says which */
+#define PG_WEB_POOL_MORE   'M'    /* a batch, more follow */
+#define PG_WEB_POOL_DONE   'D'    /* the last batch, then PgWebCacheDeps */
+#define PG_WEB_POOL_ERROR  'E'    /* the error message */
+
+#if PG_VERSION_NUM >= 150000
+#define pg_web_mq_send(mqh, len, data) \
+  shm_mq_send((mqh), (len), (data), true, true)
+#else
+#define pg_web_mq_send(mqh, len, data) \
+  shm_mq_send((mqh), (len), (data), true)
+#endif
+
+/* start of the DSM segment, the two queues follow */
+typedef struct PgWebPoolShared
+{
+  uint32          magic;
+  Size            jobs_offset;
+  Size            results_offset;
+  /* id of the job to cancel, read by the executor's signal handler */
+  volatile uint32 cancel;
+} PgWebPoolShared;
+
+/* a job as sent to the executor, followed by the SQL, name and params */
+typedef struct PgWebJobHeader
+{
+  uint32            id;
+  PgWebQueryFormat  format;
+  bool              header;
+  TimestampTz       deadline;   /* 0 if there is none */
+  int               sql_len;    /* -1 for an endpoint */
+  int               name_len;
+  int               params_len;
+} PgWebJobHeader;
+
+struct PgWebJob
+{
+  dlist_node        node;       /* in the queue while waiting */
+  uint32            id;
+  StringInfoData    msg;        /* the job message, until it is sent */
+  TimestampTz       deadline;
+  PgWebJobCallback  callback;
+  void             *owner;      /* NULL once abandoned */
+  bool              want;       /* the owner takes the next batch */
+};
+
+typedef struct PgWebExecutor
+{
+  bool                    in_use;
+  dsm_segment            *seg;
+  PgWebPoolShared        *shared;
+  BackgroundWorkerHandle *handle;
+  shm_mq_handle          *jobs;
+  shm_mq_handle          *results;
+  PgWebJob               *job;    /* the running job, NULL if idle */
+  bool                    sent;   /* the job message is in the queue */
+} PgWebExecutor;
+
+static PgWebExecutor  pg_web_executors[PG_WEB_POOL_MAX_WORKERS];
+static int            pg_web_nexecutors = 0;
+static dlist_head     pg_web_pool_queue = DLIST_STATIC_INIT(pg_web_pool_queue);
+static int            pg_web_pool_queued = 0;
+static MemoryContext  pg_web_pool_cxt = NULL;
+static ResourceOwner  pg_web_pool_owner = NULL;
+/* a failure to start an executor is only logged once in a row */
+static bool           pg_web_pool_launch_failed = false;
+static uint32         pg_web_pool_next_id = 0;
+
+/* in the executor: its segment, and the job whose query is running */
+static PgWebPoolShared       *pg_web_executor_shared = NULL;
+static volatile uint32        pg_web_executor_job = 0;
+static volatile sig_atomic_t  pg_web_executor_running = false;
+
+/*
+ * pg_web_pool_enabled
+ */
+bool
+pg_web_pool_enabled(void)
+{
+  return pg_web_setting_query_workers > 0;
+}
+
+/*
+ * pg_web_pool_finish
+ *
+ * Hand the last result of the job to its owner, unless it was abandoned,
+ * and free it.
+ */
+static void
+pg_web_pool_finish(PgWebJob *job, int rc, StringInfo out, const char *error,
+                   PgWebCacheDeps *deps)
+{
+  if (job->owner != NULL)
+    job->callback(job->owner, rc, out, error, deps);
+  else if (out != NULL)
+    pfree(out->data);
+  if (job->msg.data != NULL)
+    pfree(job->msg.data);
+  pfree(job);
+}
+
+/*
+ * pg_web_pool_launch
+ *
+ * Start an executor with its DSM segment. Returns NULL if there is no
+ * background worker slot for it.
+ */
+static PgWebExecutor *
+pg_web_pool_launch(void)
+{
+  PgWebExecutor          *executor = NULL;
+  BackgroundWorker        worker;
+  BackgroundWorkerHandle *handle;
+  PgWebPoolShared        *shared;
+  ResourceOwner           oldowner = CurrentResourceOwner;
+  MemoryContext           oldcontext;
+  dsm_segment            *seg;
+  shm_mq                 *jobs;
+  shm_mq                 *results;
+  Size                    size;
+  int                     i;
+
+  for (i = 0; i < PG_WEB_POOL_MAX_WORKERS; i++)
+  {
+    if (!pg_web_executors[i].in_use)
+    {
+      executor = &pg_web_executors[i];
+      break;
+    }
+  }
+  if (executor == NULL)
+    return NULL;
+
+  /* the segment is mapped for as long as this process lives */
+  if (pg_web_pool_owner == NULL)
+    pg_web_pool_owner = ResourceOwnerCreate(NULL, "pg_web pool");
+  CurrentResourceOwner = pg_web_pool_owner;
+  oldcontext = MemoryContextSwitchTo(pg_web_pool_cxt);
+
+  size = MAXALIGN(sizeof(PgWebPoolShared)) + PG_WEB_POOL_JOB_QUEUE +
+    PG_WEB_POOL_RESULT_QUEUE;
+#if PG_VERSION_NUM >= 90500
+  seg = dsm_create(size, 0);
+#else
+  seg = dsm_create(size);
+#endif
+  dsm_pin_mapping(seg);
+  shared = dsm_segment_address(seg);
+  shared->magic = PG_WEB_POOL_MAGIC;
+  shared->jobs_offset = MAXALIGN(sizeof(PgWebPoolShared));
+  shared->results_offset = shared->jobs_offset + PG_WEB_POOL_JOB_QUEUE;
+  shared->cancel = 0;
+  jobs = shm_mq_create((char *) shared + shared->jobs_offset,
+                       PG_WEB_POOL_JOB_QUEUE);
+  results = shm_mq_create((char *) shared + shared->results_offset,
+                          PG_WEB_POOL_RESULT_QUEUE);
+  shm_mq_set_sender(jobs, MyProc);
+  shm_mq_set_receiver(results, MyProc);
+
+  MemSet(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = BGW_NEVER_RESTART;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_web");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_web_executor_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "pg_web executor");
+  worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+  worker.bgw_notify_pid = MyProcPid;
+
+  if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+  {
+    dsm_detach(seg);
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+    if (!pg_web_pool_launch_failed)
+      ereport(LOG,
+              (errmsg("pg_web: could not start a query executor"),
+               errhint("Increase max_worker_processes or lower "
+                       "pg_web.query_workers.")));
+    pg_web_pool_launch_failed = true;
+    return NULL;
+  }
+  pg_web_pool_launch_failed = false;
+
+  /* the handle tells the queues if the executor dies or never starts */
+  executor->seg = seg;
+  executor->shared = shared;
+  executor->handle = handle;
+  executor->jobs = shm_mq_attach(jobs, seg, handle);
+  executor->results = shm_mq_attach(results, seg, handle);
+  executor->job = NULL;
+  executor->sent = false;
+  executor->in_use = true;
+  pg_web_nexecutors++;
+
+  MemoryContextSwitchTo(oldcontext);
+  CurrentResourceOwner = oldowner;
+  return executor;
+}
+
+/*
+ * pg_web_pool_retire
+ *
+ * Let go of the executor, which exits once it sees its queues detached.
+ */
+static void
+pg_web_pool_retire(PgWebExecutor *executor)
+{
+  dsm_detach(executor->seg);
+  executor->in_use = false;
+  executor->job = NULL;
+  pg_web_nexecutors--;
+}
+
+/*
+ * pg_web_pool_lost
+ *
+ * The executor went away. A job it hadn't got yet goes back to the queue,
+ * one it was running fails.
+ */
+static void
+pg_web_pool_lost(PgWebExecutor *executor)
+{
+  PgWebJob *job = executor->job;
+  bool      sent = executor->sent;
+
+  pg_web_pool_retire(executor);
+  if (job == NULL)
+    return;
+
+  if (!sent)
+  {
+    dlist_push_head(&pg_web_pool_queue, &job->node);
+    pg_web_pool_queued++;
+  }
+  else
+    pg_web_pool_finish(job, PG_WEB_QUERY_ERROR, NULL,
+                       "query executor exited", NULL);
+}
+
+/*
+ * pg_web_pool_send
+ *
+ * Continue sending the job to its executor. Returns false if the executor
+ * is gone.
+ */
+static bool
+pg_web_pool_send(PgWebExecutor *executor)
+{
+  PgWebJob      *job = executor->job;
+  shm_mq_result  res;
+
+  if (executor->sent)
+    return true;
+
+  res = pg_web_mq_send(executor->jobs, job->msg.len, job->msg.data);
+  if (res == SHM_MQ_DETACHED)
+  {
+    pg_web_pool_lost(executor);
+    return false;
+  }
+  if (res == SHM_MQ_SUCCESS)
+  {
+    executor->sent = true;
+    pfree(job->msg.data);
+    job->msg.data = NULL;
+  }
+  return true;
+}
+
+/*
+ * pg_web_pool_dispatch
+ *
+ * Give waiting jobs to idle executors, starting new ones if the pool isn't
+ * full yet. Never calls back, jobs which can't be run are failed by
+ * pg_web_pool_poll.
+ */
+static void
+pg_web_pool_dispatch(void)
+{
+  while (!dlist_is_empty(&pg_web_pool_queue))
+  {
+    PgWebExecutor *executor = NULL;
+    PgWebJob      *job;
+    int            i;
+
+    for (i = 0; i < PG_WEB_POOL_MAX_WORKERS; i++)
+    {
+      if (pg_web_executors[i].in_use && pg_web_executors[i].job == NULL)
+      {
+        executor = &pg_web_executors[i];
+        break;
+      }
+    }
+    if (executor == NULL && pg_web_nexecutors < pg_web_setting_query_workers)
+      executor = pg_web_pool_launch();
+    if (executor == NULL)
+      break;
+
+    job = dlist_container(PgWebJob, node,
+                          dlist_pop_head_node(&pg_web_pool_queue));
+    pg_web_pool_queued--;
+    executor->job = job;
+    executor->sent = false;
+    /* a lost executor puts the job back, try again on the next poll */
+    if (!pg_web_pool_send(executor))
+      break;
+  }
+}
+
+/*
+ * pg_web_pool_submit
+ *
+ * Queue the query (the SQL, or the named endpoint with its parameters from
+ * the query string params) to run in an executor. The result comes in
+ * batches through the callback, the first one as soon as there is one.
+ * Returns NULL if too many jobs are waiting already.
+ */
+PgWebJob *
+pg_web_pool_submit(const char *sql, const char *endpoint,
+                   const char *params, int params_len,
+                   PgWebQueryFormat format, bool header,
+                   PgWebJobCallback callback, void *owner)
+{
+  PgWebJobHeader  hdr;
+  PgWebJob       *job;
+  MemoryContext   oldcontext;
+
+  if (pg_web_pool_queued >= pg_web_setting_query_queue_depth)
+    return NULL;
+
+  if (pg_web_pool_cxt == NULL)
+    pg_web_pool_cxt = AllocSetContextCreate(TopMemoryContext,
+                                            "pg_web pool",
+                                            ALLOCSET_DEFAULT_MINSIZE,
+                                            ALLOCSET_DEFAULT_INITSIZE,
+                                            ALLOCSET_DEFAULT_MAXSIZE);
+  oldcontext = MemoryContextSwitchTo(pg_web_pool_cxt);
+
+  job = palloc0(sizeof(PgWebJob));
+  /* 0 is never used, it is what nothing is canceled looks like */
+  if (++pg_web_pool_next_id == 0)
+    pg_web_pool_next_id++;
+  job->id = pg_web_pool_next_id;
+  job->callback = callback;
+  job->owner = owner;
+  job->want = true;
+  if (pg_web_setting_query_timeout > 0)
+    job->deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                pg_web_setting_query_timeout);
+
+  MemSet(&hdr, 0, sizeof(hdr));
+  hdr.id = job->id;
+  hdr.format = format;
+  hdr.header = header;
+  hdr.deadline = job->deadline;
+  hdr.sql_len = sql != NULL ? strlen(sql) : -1;
+  hdr.name_len = endpoint != NULL ? strlen(endpoint) : 0;
+  hdr.params_len = params_len;
+  initStringInfo(&job->msg);
+  appendBinaryStringInfo(&job->msg, (char *) &hdr, sizeof(hdr));
+  if (sql != NULL)
+    appendBinaryStringInfo(&job->msg, sql, hdr.sql_len);
+  if (endpoint != NULL)
+    appendBinaryStringInfo(&job->msg, endpoint, hdr.name_len);
+  appendBinaryStringInfo(&job->msg, params, params_len);
+
+  MemoryContextSwitchTo(oldcontext);
+
+  dlist_push_tail(&pg_web_pool_queue, &job->node);
+  pg_web_pool_queued++;
+  pg_web_pool_dispatch();
+  return job;
+}
+
+/*
+ * pg_web_pool_resume
+ *
+ * The owner is ready for the next batch.
+ */
+void
+pg_web_pool_resume(PgWebJob *job)
+{
+  job->want = true;
+}
+
+/*
+ * pg_web_pool_abandon
+ *
+ * The owner is gone. A waiting job is dropped. A running one is canceled,
+ * and what it still sends is read and thrown away, so that its executor
+ * becomes free.
+ */
+void
+pg_web_pool_abandon(PgWebJob *job)
+{
+  int i;
+
+  job->owner = NULL;
+  for (i = 0; i < PG_WEB_POOL_MAX_WORKERS; i++)
+  {
+    PgWebExecutor *executor = &pg_web_executors[i];
+    pid_t          pid;
+
+    if (!executor->in_use || executor->job != job)
+      continue;
+
+    /* the store is seen before the signal arrives, kill is a system call */
+    executor->shared->cancel = job->id;
+    if (GetBackgroundWorkerPid(executor->handle, &pid) == BGWH_STARTED)
+      kill(pid, SIGINT);
+    return;
+  }
+
+  dlist_delete(&job->node);
+  pg_web_pool_queued--;
+  pg_web_pool_finish(job, PG_WEB_QUERY_ERROR, NULL, NULL, NULL);
+}
+
+/*
+ * pg_web_pool_receive
+ *
+ * Pass on the results the executor has for its job, as long as the owner
+ * takes them.
+ */
+static void
+pg_web_pool_receive(PgWebExecutor *executor)
+{
+  PgWebJob *job = executor->job;
+
+  while (job->want || job->owner == NULL)
+  {
+    shm_mq_result   res;
+    Size            len;
+    void           *data;
+    char            type;
+    StringInfoData  out;
+    PgWebCacheDeps  deps;
+
+    res = shm_mq_receive(executor->results, &len, &data, true);
+    if (res == SHM_MQ_WOULD_BLOCK)
+      return;
+    if (res == SHM_MQ_DETACHED)
+    {
+      pg_web_pool_lost(executor);
+      return;
+    }
+
+    type = ((char *) data)[0];
+    if (type == PG_WEB_POOL_MORE)
+    {
+      if (job->owner == NULL)
+        continue;
+      initStringInfo(&out);
+      appendBinaryStringInfo(&out, (char *) data + 1, len - 1);
+      job->want = false;
+      job->callback(job->owner, PG_WEB_QUERY_MORE, &out, NULL, NULL);
+      continue;
+    }
+
+    /* the executor is free for the next job */
+    executor->job = NULL;
+    executor->sent = false;
+    if (type == PG_WEB_POOL_DONE)
+    {
+      len -= 1 + sizeof(PgWebCacheDeps);
+      memcpy(&deps, (char *) data + 1 + len, sizeof(PgWebCacheDeps));
+      initStringInfo(&out);
+      appendBinaryStringInfo(&out, (char *) data + 1, len);
+      pg_web_pool_finish(job, PG_WEB_QUERY_DONE, &out, NULL, &deps);
+    }
+    else
+      pg_web_pool_finish(job, PG_WEB_QUERY_ERROR, NULL,
+                         (char *) data + 1, NULL);
+    return;
+  }
+}
+
+/*
+ * pg_web_pool_poll
+ *
+ * Move jobs and results between the HTTP worker and its executors. Called
+ * from the event loop, which is woken up by the queues through the latch.
+ */
+void
+pg_web_pool_poll(void)
+{
+  TimestampTz now;
+  int         i;
+
+  for (i = 0; i < PG_WEB_POOL_MAX_WORKERS; i++)
+  {
+    PgWebExecutor *executor = &pg_web_executors[i];
+
+    if (!executor->in_use)
+      continue;
+    if (executor->job == NULL)
+    {
+      /* pg_web.query_workers was lowered */
+      if (pg_web_nexecutors > pg_web_setting_query_workers)
+        pg_web_pool_retire(executor);
+      continue;
+    }
+    if (pg_web_pool_send(executor) && executor->sent)
+      pg_web_pool_receive(executor);
+  }
+
+  pg_web_pool_dispatch();
+  if (dlist_is_empty(&pg_web_pool_queue))
+    return;
+
+  /* jobs which waited too long, or which nothing can run */
+  now = GetCurrentTimestamp();
+  while (!dlist_is_empty(&pg_web_pool_queue))
+  {
+    PgWebJob *job = dlist_container(PgWebJob, node,
+                                    dlist_head_node(&pg_web_pool_queue));
+    const char *error;
+
+    if (pg_web_nexecutors == 0)
+      error = "no background worker available to run the query";
+    else if (job->deadline != 0 && job->deadline <= now)
+      error = "no query executor became free in time";
+    else
+      break;
+
+    dlist_delete(&job->node);
+    pg_web_pool_queued--;
+    pg_web_pool_finish(job, PG_WEB_QUERY_UNAVAILABLE, NULL, error, NULL);
+  }
+}
+
+/*
+ * pg_web_pool_next_timeout
+ *
+ * Milliseconds until the first waiting job times out, or -1.
+ */
+long
+pg_web_pool_next_timeout(void)
+{
+  PgWebJob *job;
+  long      secs;
+  int       usecs;
+
+  if (dlist_is_empty(&pg_web_pool_queue))
+    return -1;
+
+  /* jobs are queued in the order they time out */
+  job = dlist_container(PgWebJob, node, dlist_head_node(&pg_web_pool_queue));
+  if (job->deadline == 0)
+    return -1;
+  TimestampDifference(GetCurrentTimestamp(), job->deadline, &secs, &usecs);
+  return secs * 1000 + (usecs + 999) / 1000;
+}
+
+/*
+ * pg_web_executor_wait
+ *
+ * Sleep until a queue wakes us up.
+ */
+static void
+pg_web_executor_wait(void)
+{
+  int rc;
+
+#if PG_VERSION_NUM >= 100000
+  rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0,
+                 PG_WAIT_EXTENSION);
+#else
+  rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0);
+#endif
+  ResetLatch(&MyProc->procLatch);
+  if (rc & WL_POSTMASTER_DEATH)
+    proc_exit(1);
+  CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * pg_web_executor_send
+ *
+ * Send the message to the HTTP worker, waiting while the queue is full.
+ * Returns false if it is gone.
+ */
+static bool
+pg_web_executor_send(shm_mq_handle *results, StringInfo msg)
+{
+  for (;;)
+  {
+    shm_mq_result res = pg_web_mq_send(results, msg->len, msg->data);
+
+    if (res == SHM_MQ_SUCCESS)
+      return true;
+    if (res == SHM_MQ_DETACHED)
+      return false;
+    pg_web_executor_wait();
+  }
+}
+
+/*
+ * pg_web_executor_sigint
+ *
+ * SIGINT handler: the HTTP worker cancels a job. The query is only
+ * canceled if it is running, and for the job the cancel is meant for.
+ */
+static void
+pg_web_executor_sigint(SIGNAL_ARGS)
+{
+  int save_errno = errno;
+
+  if (pg_web_executor_running &&
+      pg_web_executor_shared->cancel == pg_web_executor_job)
+  {
+    QueryCancelPending = true;
+    InterruptPending = true;
+  }
+  SetLatch(&MyProc->procLatch);
+  errno = save_errno;
+}
+
+/*
+ * pg_web_executor_canceled
+ *
+ * Was the current job canceled?
+ */
+static bool
+pg_web_executor_canceled(void)
+{
+  return pg_web_executor_shared->cancel == pg_web_executor_job;
+}
+
+/*
+ * pg_web_executor_start
+ *
+ * The job's query runs from now on, until pg_web_executor_stop.
+ */
+static void
+pg_web_executor_start(void)
+{
+  pg_web_executor_running = true;
+  /* a cancel which came while it wasn't running */
+  if (pg_web_executor_canceled())
+  {
+    QueryCancelPending = true;
+    InterruptPending = true;
+  }
+}
+
+/*
+ * pg_web_executor_stop
+ */
+static void
+pg_web_executor_stop(void)
+{
+  pg_web_executor_running = false;
+  /* a cancel which came too late would hit whatever we do next */
+  QueryCancelPending = false;
+}
+
+/*
+ * pg_web_executor_param
+ *
+ * PgWebParamLookup for the query string sent with the job.
+ */
+static char *
+pg_web_executor_param(void *arg, const char *name)
+{
+  StringInfo  params = (StringInfo) arg;
+  PgWebSlice  slice;
+
+  slice.off = 0;
+  slice.len = params->len;
+  return pg_web_http_query_param(params, slice, name);
+}
+
+/*
+ * pg_web_executor_error
+ *
+ * Send the error which ended the job.
+ */
+static bool
+pg_web_executor_error(shm_mq_handle *results, const char *error)
+{
+  StringInfoData msg;
+
+  initStringInfo(&msg);
+  appendStringInfoChar(&msg, PG_WEB_POOL_ERROR);
+  appendStringInfoString(&msg, error);
+  appendStringInfoChar(&msg, '\0');
+  return pg_web_executor_send(results, &msg);
+}
+
+/*
+ * pg_web_executor_run
+ *
+ * Run the job and send its result. Returns false if the HTTP worker is
+ * gone.
+ */
+static bool
+pg_web_executor_run(shm_mq_handle *results, const char *data)
+{
+  PgWebJobHeader  hdr;
+  PgWebQuery     *query;
+  StringInfoData  params;
+  char           *error = NULL;
+  bool            ok = true;
+
+  memcpy(&hdr, data, sizeof(hdr));
+  data += sizeof(hdr);
+  pg_web_executor_job = hdr.id;
+
+  /* the client may be gone already */
+  if (pg_web_executor_canceled())
+    return pg_web_executor_error(results, "query canceled");
+
+  pg_web_executor_start();
+  if (hdr.sql_len >= 0)
+  {
+    char *sql = pnstrdup(data, hdr.sql_len);
+
+    query = pg_web_query_open(sql, hdr.format, hdr.header, hdr.deadline,
+                              &error);
+  }
+  else
+  {
+    char *name = pnstrdup(data, hdr.name_len);
+
+    initStringInfo(&params);
+    appendBinaryStringInfo(&params, data + hdr.name_len, hdr.params_len);
+    query = pg_web_query_open_endpoint(name, pg_web_executor_param, &params,
+                                       hdr.format, hdr.deadline, &error);
+  }
+  pg_web_executor_stop();
+  if (query == NULL)
+    return pg_web_executor_error(results, error);
+
+  for (;;)
+  {
+    StringInfoData msg;
+    int            rc;
+
+    /* the batch is written right after the message type */
+    initStringInfo(&msg);
+    appendStringInfoChar(&msg, PG_WEB_POOL_MORE);
+    pg_web_executor_start();
+    rc = pg_web_query_fetch(query, &msg);
+    pg_web_executor_stop();
+
+    if (rc == PG_WEB_QUERY_ERROR)
+    {
+      ok = pg_web_executor_error(results, query->error);
+      break;
+    }
+    if (rc == PG_WEB_QUERY_DONE)
+    {
+      msg.data[0] = PG_WEB_POOL_DONE;
+      appendBinaryStringInfo(&msg, (char *) &query->deps,
+                             sizeof(PgWebCacheDeps));
+    }
+    ok = pg_web_executor_send(results, &msg);
+    pfree(msg.data);
+    if (!ok || rc == PG_WEB_QUERY_DONE)
+      break;
+  }
+
+  pg_web_query_close(query);
+  return ok;
+}
+
+/*
+ * pg_web_executor_main
+ *
+ * Entry point of the executors: run the jobs of our HTTP worker one after
+ * another until it goes away.
+ */
+void
+pg_web_executor_main(Datum main_arg)
+{
+  dsm_segment     *seg;
+  PgWebPoolShared *shared;
+  shm_mq          *jobs;
+  shm_mq          *results;
+  shm_mq_handle   *jobs_handle;
+  shm_mq_handle   *results_handle;
+  MemoryContext    job_cxt;
+
+  pqsignal(SIGTERM, die);
+  pqsignal(SIGINT, pg_web_executor_sigint);
+  BackgroundWorkerUnblockSignals();
+
+  CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_web executor");
+  seg = dsm_attach(DatumGetUInt32(main_arg));
+  if (seg == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("pg_web: could not map the executor's segment")));
+  dsm_pin_mapping(seg);
+  shared = dsm_segment_address(seg);
+  if (shared->magic != PG_WEB_POOL_MAGIC)
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("pg_web: bad magic number in the executor's segment")));
+  pg_web_executor_shared = shared;
+
+  jobs = (shm_mq *) ((char *) shared + shared->jobs_offset);
+  results = (shm_mq *) ((char *) shared + shared->results_offset);
+  shm_mq_set_receiver(jobs, MyProc);
+  shm_mq_set_sender(results, MyProc);
+  jobs_handle = shm_mq_attach(jobs, seg, NULL);
+  results_handle = shm_mq_attach(results, seg, NULL);
+
+  BackgroundWorkerInitializeConnection("postgres", NULL);
+
+  job_cxt = AllocSetContextCreate(TopMemoryContext,
+                                  "pg_web job",
+                                  ALLOCSET_DEFAULT_MINSIZE,
+                                  ALLOCSET_DEFAULT_INITSIZE,
+                                  ALLOCSET_DEFAULT_MAXSIZE);
+  for (;;)
+  {
+    shm_mq_result  res;
+    Size           len;
+    void          *data;
+    MemoryContext  oldcontext;
+    bool           ok;
+
+    res = shm_mq_receive(jobs_handle, &len, &data, true);
+    if (res == SHM_MQ_WOULD_BLOCK)
+    {
+      pgstat_report_activity(STATE_IDLE, NULL);
+      pg_web_executor_wait();
+      continue;
+    }
+    if (res == SHM_MQ_DETACHED)
+      break;
+
+    oldcontext = MemoryContextSwitchTo(job_cxt);
+    ok = pg_web_executor_run(results_handle, data);
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(job_cxt);
+    if (!ok)
+      break;
+  }
+
+  proc_exit(0);
+}
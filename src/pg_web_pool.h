@@ -0,0 +1,52 @@
+/*
+ * pg_web_pool.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_POOL_H
+#define PG_WEB_POOL_H
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+#include "pg_web_cache.h"
+#include "pg_web_query.h"
+
+/*
+ * Called with every batch of a job's result, as pg_web_query_fetch would
+ * return it: rc is PG_WEB_QUERY_MORE, PG_WEB_QUERY_DONE or
+ * PG_WEB_QUERY_ERROR, or PG_WEB_QUERY_UNAVAILABLE if it never ran. out is
+ * palloc'd and belongs to the callback, deps is only set with the last
+ * batch. After any but PG_WEB_QUERY_MORE the job is gone.
+ */
+typedef void (*PgWebJobCallback) (void *owner, int rc, StringInfo out,
+                                  const char *error, PgWebCacheDeps *deps);
+
+typedef struct PgWebJob PgWebJob;
+
+/* GUC variables, see pg_web.c */
+extern int pg_web_setting_query_workers;
+extern int pg_web_setting_query_queue_depth;
+extern int pg_web_setting_query_timeout;
+
+bool pg_web_pool_enabled(void);
+PgWebJob *pg_web_pool_submit(const char *sql, const char *endpoint,
+                             const char *params, int params_len,
+                             PgWebQueryFormat format, bool header,
+                             PgWebJobCallback callback, void *owner);
+void pg_web_pool_resume(PgWebJob *job);
+void pg_web_pool_abandon(PgWebJob *job);
+void pg_web_pool_poll(void);
+long pg_web_pool_next_timeout(void);
+
+void pg_web_executor_main(Datum main_arg);
+
+#endif
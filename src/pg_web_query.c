@@ -0,0 +1,665 @@
+/*
+ * pg_web_query.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_query.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/portal.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/timeout.h"
+
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+/*
+ * Open queries share one read-only transaction (and SPI connection), which
+ * is committed when the last of them is closed. It only takes new queries
+ * for PG_WEB_QUERY_XACT_MAX_AGE, later ones wait until it is committed (see
+ * pg_web_query_admits), so that it ends even while queries keep coming and
+ * the locks of the tables they read are let go. Every query gets its own
+ * snapshot and statement timestamp, and errors are contained in
+ * subtransactions, so the queries don't see or break each other.
+ */
+static int         pg_web_query_active = 0;
+static TimestampTz pg_web_query_xact_start = 0;
+
+/*
+ * Like statement_timeout, a query is canceled through a timer when it runs
+ * past its deadline, see pg_web_query_arm.
+ */
+static TimeoutId             pg_web_query_timeout_id;
+static bool                  pg_web_query_timeout_registered = false;
+static volatile sig_atomic_t pg_web_query_timed_out = false;
+
+/*
+ * pg_web_query_on_timeout
+ *
+ * Timeout handler: cancel the running query.
+ */
+static void
+pg_web_query_on_timeout(void)
+{
+  pg_web_query_timed_out = true;
+  QueryCancelPending = true;
+  InterruptPending = true;
+  SetLatch(&MyProc->procLatch);
+}
+
+/*
+ * pg_web_query_arm
+ *
+ * Start the timer for the query's deadline, if it has one. It only runs
+ * while the query does: a cancel arriving while we are busy with anything
+ * else would hit that instead.
+ */
+static void
+pg_web_query_arm(PgWebQuery *query)
+{
+  if (query->deadline == 0)
+    return;
+
+  if (!pg_web_query_timeout_registered)
+  {
+    pg_web_query_timeout_id = RegisterTimeout(USER_TIMEOUT,
+                                              pg_web_query_on_timeout);
+    pg_web_query_timeout_registered = true;
+  }
+  pg_web_query_timed_out = false;
+  /* a deadline which passed already fires right away */
+  enable_timeout_at(pg_web_query_timeout_id, query->deadline);
+}
+
+/*
+ * pg_web_query_disarm
+ *
+ * Stop the timer started by pg_web_query_arm.
+ */
+static void
+pg_web_query_disarm(PgWebQuery *query)
+{
+  if (query->deadline == 0)
+    return;
+
+  disable_timeout(pg_web_query_timeout_id, false);
+  /* it may have fired just after the query was done */
+  QueryCancelPending = false;
+}
+
+/*
+ * pg_web_query_admits
+ *
+ * May a query be opened now? Not once the shared transaction is older than
+ * PG_WEB_QUERY_XACT_MAX_AGE, until it is committed.
+ */
+bool
+pg_web_query_admits(void)
+{
+  return pg_web_query_active == 0 ||
+    !TimestampDifferenceExceeds(pg_web_query_xact_start,
+                                GetCurrentTimestamp(),
+                                PG_WEB_QUERY_XACT_MAX_AGE);
+}
+
+/*
+ * pg_web_query_role
+ *
+ * The role SQL from requests runs as, pg_web.query_role. Read-only mode
+ * doesn't keep a superuser from reading files or ending backends, so it
+ * must not be one.
+ */
+static Oid
+pg_web_query_role(void)
+{
+  Oid roleid;
+
+  if (pg_web_setting_query_role == NULL ||
+      pg_web_setting_query_role[0] == '\0')
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+             errmsg("pg_web.query_role is not set")));
+
+  roleid = get_role_oid(pg_web_setting_query_role, false);
+  if (superuser_arg(roleid))
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+             errmsg("pg_web.query_role must not be a superuser")));
+  return roleid;
+}
+
+/*
+ * pg_web_query_set_user
+ *
+ * Become the query's role, if it has one, until the subtransaction ends;
+ * it can't SET ROLE back. The caller restores the user before releasing
+ * the subtransaction, rolling it back does that by itself.
+ */
+static void
+pg_web_query_set_user(PgWebQuery *query, int sec_context)
+{
+  if (OidIsValid(query->userid))
+    SetUserIdAndSecContext(query->userid,
+                           sec_context | SECURITY_LOCAL_USERID_CHANGE);
+}
+
+/*
+ * pg_web_query_begin
+ *
+ * Start the shared transaction if this is the first open query.
+ */
+static void
+pg_web_query_begin(void)
+{
+  MemoryContext oldcontext = CurrentMemoryContext;
+
+  /* statement_timestamp() is the query's own, now() the transaction's */
+  SetCurrentStatementStartTimestamp();
+  if (pg_web_query_active++ > 0)
+    return;
+
+  pg_web_query_xact_start = GetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  /* nothing coming over HTTP may change the database */
+  XactReadOnly = true;
+  if (SPI_connect() != SPI_OK_CONNECT)
+    elog(ERROR, "pg_web: SPI_connect failed");
+
+  MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * pg_web_query_end
+ *
+ * Commit the shared transaction once the last query is closed.
+ */
+static void
+pg_web_query_end(void)
+{
+  MemoryContext oldcontext = CurrentMemoryContext;
+
+  if (--pg_web_query_active > 0)
+    return;
+
+  SPI_finish();
+  CommitTransactionCommand();
+  pgstat_report_activity(STATE_IDLE, NULL);
+
+  MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * pg_web_query_catch
+ *
+ * Remember the current error as the query's error and roll back the
+ * subtransaction it happened in. Must be called from PG_CATCH.
+ */
+static void
+pg_web_query_catch(PgWebQuery *query, MemoryContext oldcontext,
+                   ResourceOwner oldowner)
+{
+  ErrorData *edata;
+
+  MemoryContextSwitchTo(query->mcxt);
+  edata = CopyErrorData();
+  FlushErrorState();
+
+  RollbackAndReleaseCurrentSubTransaction();
+  MemoryContextSwitchTo(oldcontext);
+  CurrentResourceOwner = oldowner;
+#if PG_VERSION_NUM < 100000
+  SPI_restore_connection();
+#endif
+
+  if (pg_web_query_timed_out)
+    query->error = MemoryContextStrdup(query->mcxt,
+                                       "canceling query due to pg_web.query_timeout");
+  else
+    query->error = edata->message;
+}
+
+/*
+ * pg_web_query_csv_value
+ *
+ * Append the value as COPY writes it in CSV: quoted if it contains the
+ * delimiter, a quote or a line break, or could be mistaken for a NULL or
+ * the end-of-data marker.
+ */
+static void
+pg_web_query_csv_value(StringInfo out, const char *str)
+{
+  const char *start = str;
+  const char *p;
+
+  if (str[0] != '\0' && strcmp(str, "\\.") != 0 &&
+      strpbrk(str, ",\"\n\r") == NULL)
+  {
+    appendStringInfoString(out, str);
+    return;
+  }
+
+  appendStringInfoChar(out, '"');
+  for (p = str; *p != '\0'; p++)
+  {
+    if (*p == '"')
+    {
+      /* quotes are doubled */
+      appendBinaryStringInfo(out, start, p - start + 1);
+      start = p;
+    }
+  }
+  appendBinaryStringInfo(out, start, p - start);
+  appendStringInfoChar(out, '"');
+}
+
+/*
+ * pg_web_query_text_value
+ *
+ * Append the value as COPY writes it in text format, with backslashes,
+ * tabs and the other control characters escaped.
+ */
+static void
+pg_web_query_text_value(StringInfo out, const char *str)
+{
+  const char *start = str;
+  const char *p;
+
+  for (p = str; *p != '\0'; p++)
+  {
+    char c = *p;
+
+    if ((unsigned char) c < 0x20)
+    {
+      switch (c)
+      {
+        case '\b': c = 'b'; break;
+        case '\f': c = 'f'; break;
+        case '\n': c = 'n'; break;
+        case '\r': c = 'r'; break;
+        case '\t': c = 't'; break;
+        case '\v': c = 'v'; break;
+        default:
+          /* other control characters are written as they are */
+          continue;
+      }
+    }
+    else if (c != '\\')
+      continue;
+
+    appendBinaryStringInfo(out, start, p - start);
+    appendStringInfoChar(out, '\\');
+    appendStringInfoChar(out, c);
+    start = p + 1;
+  }
+  appendBinaryStringInfo(out, start, p - start);
+}
+
+/*
+ * pg_web_query_prepare_columns
+ *
+ * Look up the output functions of the result columns, and set up the JSON
+ * writer, the header line or the Arrow schema, depending on the format.
+ */
+static void
+pg_web_query_prepare_columns(PgWebQuery *query, TupleDesc tupdesc,
+                             bool header)
+{
+  MemoryContext  oldcontext = MemoryContextSwitchTo(query->mcxt);
+  StringInfoData line;
+  int            i;
+
+  query->natts = tupdesc->natts;
+  query->outfuncs = palloc(sizeof(FmgrInfo) * query->natts);
+
+  initStringInfo(&line);
+  for (i = 0; i < query->natts; i++)
+  {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+    Oid               outfunc;
+    bool              isvarlena;
+
+    switch (query->format)
+    {
+      case PG_WEB_QUERY_CSV:
+        if (i > 0)
+          appendStringInfoChar(&line, ',');
+        pg_web_query_csv_value(&line, NameStr(attr->attname));
+        break;
+      case PG_WEB_QUERY_TEXT:
+        if (i > 0)
+          appendStringInfoChar(&line, '\t');
+        pg_web_query_text_value(&line, NameStr(attr->attname));
+        break;
+      case PG_WEB_QUERY_JSON:
+      case PG_WEB_QUERY_ARROW:
+        break;
+    }
+
+    getTypeOutputInfo(attr->atttypid, &outfunc, &isvarlena);
+    fmgr_info_cxt(outfunc, &query->outfuncs[i], query->mcxt);
+  }
+  if (query->format == PG_WEB_QUERY_JSON)
+    query->json = pg_web_json_create(tupdesc, query->outfuncs);
+  else if (query->format == PG_WEB_QUERY_ARROW)
+  {
+    /* a stream always starts with its schema */
+    query->arrow = pg_web_arrow_create(tupdesc, query->outfuncs);
+    pg_web_arrow_schema(query->arrow, &line);
+    query->header = line.data;
+    query->header_len = line.len;
+  }
+  else if (header && query->format != PG_WEB_QUERY_JSON)
+  {
+    appendStringInfoChar(&line, '\n');
+    query->header = line.data;
+    query->header_len = line.len;
+  }
+  else
+    pfree(line.data);
+
+  MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * pg_web_query_json_row
+ *
+ * Append the row as an element of the JSON array.
+ */
+static void
+pg_web_query_json_row(PgWebQuery *query, HeapTuple tuple, TupleDesc tupdesc,
+                      StringInfo out)
+{
+  appendStringInfoString(out, query->rows++ == 0 ? "[\n" : ",\n");
+  pg_web_json_row(query->json, tuple, tupdesc, out);
+}
+
+/*
+ * pg_web_query_copy_row
+ *
+ * Append the row as a line of COPY's CSV or text format.
+ */
+static void
+pg_web_query_copy_row(PgWebQuery *query, HeapTuple tuple, TupleDesc tupdesc,
+                      StringInfo out)
+{
+  bool csv = query->format == PG_WEB_QUERY_CSV;
+  int  i;
+
+  for (i = 0; i < query->natts; i++)
+  {
+    Datum  value;
+    bool   isnull;
+    char  *str;
+
+    if (i > 0)
+      appendStringInfoChar(out, csv ? ',' : '\t');
+
+    value = SPI_getbinval(tuple, tupdesc, i + 1, &isnull);
+    if (isnull)
+    {
+      /* an unquoted empty string in CSV */
+      if (!csv)
+        appendStringInfoString(out, "\\N");
+      continue;
+    }
+
+    str = OutputFunctionCall(&query->outfuncs[i], value);
+    if (csv)
+      pg_web_query_csv_value(out, str);
+    else
+      pg_web_query_text_value(out, str);
+  }
+  appendStringInfoChar(out, '\n');
+  query->rows++;
+}
+
+/*
+ * pg_web_query_start
+ *
+ * Open a cursor for the SQL, or for the named endpoint if sql is NULL, see
+ * pg_web_query_open and pg_web_query_open_endpoint.
+ */
+static PgWebQuery *
+pg_web_query_start(const char *sql, const char *endpoint,
+                   PgWebParamLookup lookup, void *arg,
+                   PgWebQueryFormat format, bool header,
+                   TimestampTz deadline, char **error)
+{
+  MemoryContext oldcontext = CurrentMemoryContext;
+  ResourceOwner oldowner;
+  MemoryContext mcxt;
+  PgWebQuery   *query;
+  Oid           save_userid;
+  int           save_sec_context;
+
+  mcxt = AllocSetContextCreate(TopMemoryContext,
+                               "pg_web query",
+                               ALLOCSET_DEFAULT_MINSIZE,
+                               ALLOCSET_DEFAULT_INITSIZE,
+                               ALLOCSET_DEFAULT_MAXSIZE);
+  query = MemoryContextAllocZero(mcxt, sizeof(PgWebQuery));
+  query->mcxt = mcxt;
+  query->format = format;
+  query->deadline = deadline;
+  query->batch_cxt = AllocSetContextCreate(mcxt,
+                                           "pg_web query batch",
+                                           ALLOCSET_DEFAULT_MINSIZE,
+                                           ALLOCSET_DEFAULT_INITSIZE,
+                                           ALLOCSET_DEFAULT_MAXSIZE);
+
+  pg_web_query_begin();
+  pgstat_report_activity(STATE_RUNNING, sql != NULL ? sql : endpoint);
+  oldowner = CurrentResourceOwner;
+
+  pg_web_query_arm(query);
+  BeginInternalSubTransaction(NULL);
+  MemoryContextSwitchTo(oldcontext);
+  GetUserIdAndSecContext(&save_userid, &save_sec_context);
+
+  PG_TRY();
+  {
+    Portal portal;
+
+    /* SQL from the request runs as pg_web.query_role, an endpoint's query
+     * as the worker's user */
+    if (sql != NULL)
+      query->userid = pg_web_query_role();
+    pg_web_query_set_user(query, save_sec_context);
+
+    pg_web_cache_deps_begin(&query->deps);
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (sql != NULL)
+      portal = SPI_cursor_open_with_args(NULL, sql, 0, NULL, NULL, NULL,
+                                         true, CURSOR_OPT_NO_SCROLL);
+    else
+      portal = pg_web_endpoint_open(endpoint, lookup, arg);
+    PopActiveSnapshot();
+    pg_web_cache_deps_add(&query->deps, portal);
+
+    query->portal_name = MemoryContextStrdup(mcxt, portal->name);
+    pg_web_query_prepare_columns(query, portal->tupDesc, header);
+
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+    ReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+  }
+  PG_CATCH();
+  {
+    pg_web_query_catch(query, oldcontext, oldowner);
+  }
+  PG_END_TRY();
+  pg_web_query_disarm(query);
+
+  if (query->error != NULL)
+  {
+    *error = pstrdup(query->error);
+    pg_web_query_close(query);
+    return NULL;
+  }
+
+  return query;
+}
+
+/*
+ * pg_web_query_open
+ *
+ * Open a cursor for the read-only query, run as pg_web.query_role, whose
+ * rows are written in the given format; for CSV and text a line with the
+ * column names comes first if header is set. Arrow streams always start
+ * with the schema. Opening and fetching are canceled once they run past the
+ * deadline, unless it is 0. Returns NULL if the query can't be run, with
+ * the error message in *error (allocated in the caller's memory context).
+ */
+PgWebQuery *
+pg_web_query_open(const char *sql, PgWebQueryFormat format, bool header,
+                  TimestampTz deadline, char **error)
+{
+  return pg_web_query_start(sql, NULL, NULL, NULL, format, header, deadline,
+                            error);
+}
+
+/*
+ * pg_web_query_open_endpoint
+ *
+ * As pg_web_query_open, for the query of the named endpoint with its
+ * parameters taken from the request through lookup.
+ */
+PgWebQuery *
+pg_web_query_open_endpoint(const char *name, PgWebParamLookup lookup,
+                           void *arg, PgWebQueryFormat format,
+                           TimestampTz deadline, char **error)
+{
+  return pg_web_query_start(NULL, name, lookup, arg, format, false, deadline,
+                            error);
+}
+
+/*
+ * pg_web_query_fetch
+ *
+ * Fetch the next batch of rows from the cursor and append them to out in
+ * the query's format. Returns PG_WEB_QUERY_MORE if there may be more rows,
+ * PG_WEB_QUERY_DONE after the last batch (the JSON array or Arrow stream is
+ * complete then) and PG_WEB_QUERY_ERROR if the query failed, see
+ * query->error.
+ */
+int
+pg_web_query_fetch(PgWebQuery *query, StringInfo out)
+{
+  MemoryContext oldcontext = CurrentMemoryContext;
+  ResourceOwner oldowner = CurrentResourceOwner;
+  volatile int  result = PG_WEB_QUERY_MORE;
+  Oid           save_userid;
+  int           save_sec_context;
+
+  pg_web_query_arm(query);
+  BeginInternalSubTransaction(NULL);
+  MemoryContextSwitchTo(query->batch_cxt);
+  GetUserIdAndSecContext(&save_userid, &save_sec_context);
+
+  PG_TRY();
+  {
+    Portal portal = SPI_cursor_find(query->portal_name);
+    uint64 i;
+
+    /* functions of the query check the privileges as they run */
+    pg_web_query_set_user(query, save_sec_context);
+
+    if (portal == NULL)
+      elog(ERROR, "pg_web: cursor \"%s\" does not exist", query->portal_name);
+
+    if (query->header != NULL)
+    {
+      appendBinaryStringInfo(out, query->header, query->header_len);
+      pfree(query->header);
+      query->header = NULL;
+    }
+
+    SPI_cursor_fetch(portal, true, PG_WEB_QUERY_BATCH_ROWS);
+    if (query->format == PG_WEB_QUERY_ARROW)
+    {
+      /* the batch becomes one record batch */
+      if (SPI_processed > 0)
+        pg_web_arrow_batch(query->arrow, SPI_tuptable->vals,
+                           (int) SPI_processed, SPI_tuptable->tupdesc, out);
+      query->rows += SPI_processed;
+    }
+    else
+    {
+      for (i = 0; i < SPI_processed; i++)
+      {
+        if (query->format == PG_WEB_QUERY_JSON)
+          pg_web_query_json_row(query, SPI_tuptable->vals[i],
+                                SPI_tuptable->tupdesc, out);
+        else
+          pg_web_query_copy_row(query, SPI_tuptable->vals[i],
+                                SPI_tuptable->tupdesc, out);
+      }
+    }
+    if (SPI_processed < PG_WEB_QUERY_BATCH_ROWS)
+    {
+      if (query->format == PG_WEB_QUERY_JSON)
+        appendStringInfoString(out, query->rows == 0 ? "[]\n" : "\n]\n");
+      else if (query->format == PG_WEB_QUERY_ARROW)
+        pg_web_arrow_end(out);
+      result = PG_WEB_QUERY_DONE;
+    }
+    SPI_freetuptable(SPI_tuptable);
+
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+    ReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+  }
+  PG_CATCH();
+  {
+    pg_web_query_catch(query, oldcontext, oldowner);
+    result = PG_WEB_QUERY_ERROR;
+  }
+  PG_END_TRY();
+  pg_web_query_disarm(query);
+
+  MemoryContextReset(query->batch_cxt);
+  return result;
+}
+
+/*
+ * pg_web_query_close
+ *
+ * Close the cursor and free the query.
+ */
+void
+pg_web_query_close(PgWebQuery *query)
+{
+  if (query->portal_name != NULL)
+  {
+    Portal portal = SPI_cursor_find(query->portal_name);
+
+    if (portal != NULL)
+      SPI_cursor_close(portal);
+  }
+  MemoryContextDelete(query->mcxt);
+
+  pg_web_query_end();
+}
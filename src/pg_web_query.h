@@ -0,0 +1,82 @@
+/*
+ * pg_web_query.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_QUERY_H
+#define PG_WEB_QUERY_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "lib/stringinfo.h"
+#include "utils/timestamp.h"
+
+#include "pg_web_arrow.h"
+#include "pg_web_cache.h"
+#include "pg_web_endpoint.h"
+#include "pg_web_json.h"
+
+/* rows fetched from the cursor at a time */
+#define PG_WEB_QUERY_BATCH_ROWS 1000
+
+/* queries join the shared transaction while it is younger than this, ms */
+#define PG_WEB_QUERY_XACT_MAX_AGE 1000
+
+/* results of pg_web_query_fetch */
+#define PG_WEB_QUERY_MORE   0
+#define PG_WEB_QUERY_DONE   1
+#define PG_WEB_QUERY_ERROR  2
+/* nothing took the query in time, see pg_web_pool.c and pg_web_run_waiting */
+#define PG_WEB_QUERY_UNAVAILABLE 3
+
+/* how the rows are written */
+typedef enum PgWebQueryFormat
+{
+  PG_WEB_QUERY_JSON,          /* an array of objects */
+  PG_WEB_QUERY_CSV,           /* as COPY ... (FORMAT csv) */
+  PG_WEB_QUERY_TEXT,          /* as COPY ... (FORMAT text) */
+  PG_WEB_QUERY_ARROW          /* an Arrow IPC stream */
+} PgWebQueryFormat;
+
+typedef struct PgWebQuery
+{
+  MemoryContext mcxt;         /* everything belonging to the query */
+  MemoryContext batch_cxt;    /* reset after every batch */
+  char         *portal_name;
+  PgWebQueryFormat format;
+  char         *header;       /* column names line or Arrow schema, sent */
+  int           header_len;   /* before the rows */
+  int           natts;
+  FmgrInfo     *outfuncs;
+  PgWebJson    *json;
+  PgWebArrow   *arrow;
+  int64         rows;         /* rows sent so far */
+  PgWebCacheDeps deps;        /* what the result depends on */
+  Oid           userid;       /* role it runs as, or InvalidOid */
+  TimestampTz   deadline;     /* canceled when running after it, or 0 */
+  char         *error;        /* message of the error which stopped us */
+} PgWebQuery;
+
+/* GUC variables, see pg_web.c */
+extern char *pg_web_setting_query_role;
+
+bool pg_web_query_admits(void);
+PgWebQuery *pg_web_query_open(const char *sql, PgWebQueryFormat format,
+                              bool header, TimestampTz deadline,
+                              char **error);
+PgWebQuery *pg_web_query_open_endpoint(const char *name,
+                                       PgWebParamLookup lookup, void *arg,
+                                       PgWebQueryFormat format,
+                                       TimestampTz deadline, char **error);
+int pg_web_query_fetch(PgWebQuery *query, StringInfo out);
+void pg_web_query_close(PgWebQuery *query);
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ * pg_web_static.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_static.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miscadmin.h"
+#include "lib/ilist.h"
+#include "storage/fd.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+/* files whose state is kept, each with its precompressed siblings */
+#define PG_WEB_STATIC_INDEX_SIZE  256
+
+/* the plain file and the siblings in the order they are preferred */
+#define PG_WEB_STATIC_PLAIN     0
+#define PG_WEB_STATIC_VARIANTS  3
+
+static const struct
+{
+  const char *suffix;
+  const char *encoding;
+  int         flag;
+} pg_web_static_variants[PG_WEB_STATIC_VARIANTS] = {
+  {"", NULL, 0},
+  {".gz", "gzip", PG_WEB_STATIC_GZIP},
+  {".br", "br", PG_WEB_STATIC_BROTLI}
+};
+
+static const struct
+{
+  const char *extension;
+  const char *content_type;
+} pg_web_static_types[] = {
+  {"html", "text/html; charset=utf-8"},
+  {"htm", "text/html; charset=utf-8"},
+  {"css", "text/css; charset=utf-8"},
+  {"js", "text/javascript; charset=utf-8"},
+  {"mjs", "text/javascript; charset=utf-8"},
+  {"json", "application/json"},
+  {"map", "application/json"},
+  {"txt", "text/plain; charset=utf-8"},
+  {"csv", "text/csv; charset=utf-8"},
+  {"xml", "application/xml"},
+  {"svg", "image/svg+xml"},
+  {"png", "image/png"},
+  {"jpg", "image/jpeg"},
+  {"jpeg", "image/jpeg"},
+  {"gif", "image/gif"},
+  {"webp", "image/webp"},
+  {"ico", "image/x-icon"},
+  {"woff", "font/woff"},
+  {"woff2", "font/woff2"},
+  {"wasm", "application/wasm"},
+  {"pdf", "application/pdf"}
+};
+
+/*
+ * What is known about a path of the static directory, including that
+ * nothing is there, so requests for missing files don't touch the disk
+ * either.
+ */
+typedef struct PgWebStaticEntry
+{
+  char             path[MAXPGPATH];  /* hash key, relative to the directory */
+  PgWebStaticFile *files[PG_WEB_STATIC_VARIANTS];  /* NULL if missing */
+  time_t           checked;          /* when they were last looked at */
+  dlist_node       lru_node;         /* most recently used first */
+} PgWebStaticEntry;
+
+static HTAB          *pg_web_static_index = NULL;
+static dlist_head     pg_web_static_lru;
+static int            pg_web_static_count = 0;
+static MemoryContext  pg_web_static_cxt = NULL;
+/* pg_web.static_dir the index was built for, and where it points to */
+static char          *pg_web_static_dir_seen = NULL;
+static char           pg_web_static_root[MAXPGPATH];
+
+/*
+ * pg_web_static_enabled
+ *
+ * Is pg_web.static_dir set?
+ */
+bool
+pg_web_static_enabled(void)
+{
+  return pg_web_setting_static_dir != NULL &&
+         pg_web_setting_static_dir[0] != '\0';
+}
+
+/*
+ * pg_web_static_content_type
+ *
+ * Content-Type of a file, from its extension.
+ */
+const char *
+pg_web_static_content_type(const char *path)
+{
+  const char *dot = strrchr(path, '.');
+  int         i;
+
+  if (dot != NULL && strchr(dot, '/') == NULL)
+  {
+    for (i = 0; i < lengthof(pg_web_static_types); i++)
+    {
+      if (pg_strcasecmp(dot + 1, pg_web_static_types[i].extension) == 0)
+        return pg_web_static_types[i].content_type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+/*
+ * pg_web_static_release
+ *
+ * Drop a reference to the file, closing it with the last one. This is
+ * also the release callback of dyad_writeFile.
+ */
+void
+pg_web_static_release(void *arg)
+{
+  PgWebStaticFile *file = (PgWebStaticFile *) arg;
+
+  if (--file->refs > 0)
+    return;
+  close(file->fd);
+  pfree(file);
+}
+
+/*
+ * pg_web_static_forget
+ *
+ * Drop the entry from the index.
+ */
+static void
+pg_web_static_forget(PgWebStaticEntry *entry)
+{
+  int i;
+
+  for (i = 0; i < PG_WEB_STATIC_VARIANTS; i++)
+  {
+    if (entry->files[i] != NULL)
+      pg_web_static_release(entry->files[i]);
+  }
+  dlist_delete(&entry->lru_node);
+  hash_search(pg_web_static_index, entry->path, HASH_REMOVE, NULL);
+  pg_web_static_count--;
+}
+
+/*
+ * pg_web_static_init
+ *
+ * Create the index on first use, and empty it when pg_web.static_dir has
+ * changed since.
+ */
+static void
+pg_web_static_init(void)
+{
+  HASHCTL ctl;
+  int     flags = HASH_ELEM | HASH_CONTEXT;
+
+  if (pg_web_static_index == NULL)
+  {
+    pg_web_static_cxt = AllocSetContextCreate(TopMemoryContext,
+                                              "pg_web static files",
+                                              ALLOCSET_DEFAULT_MINSIZE,
+                                              ALLOCSET_DEFAULT_INITSIZE,
+                                              ALLOCSET_DEFAULT_MAXSIZE);
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = MAXPGPATH;
+    ctl.entrysize = sizeof(PgWebStaticEntry);
+    ctl.hcxt = pg_web_static_cxt;
+#if PG_VERSION_NUM >= 140000
+    flags |= HASH_STRINGS;
+#endif
+    pg_web_static_index = hash_create("pg_web static files",
+                                      PG_WEB_STATIC_INDEX_SIZE, &ctl, flags);
+    dlist_init(&pg_web_static_lru);
+  }
+
+  if (pg_web_static_dir_seen != NULL &&
+      strcmp(pg_web_static_dir_seen, pg_web_setting_static_dir) == 0)
+    return;
+
+  while (!dlist_is_empty(&pg_web_static_lru))
+    pg_web_static_forget(dlist_container(PgWebStaticEntry, lru_node,
+                                         dlist_head_node(&pg_web_static_lru)));
+  if (pg_web_static_dir_seen != NULL)
+    pfree(pg_web_static_dir_seen);
+  pg_web_static_dir_seen = MemoryContextStrdup(pg_web_static_cxt,
+                                               pg_web_setting_static_dir);
+
+  /* a relative directory is taken to be in the share directory */
+  if (is_absolute_path(pg_web_setting_static_dir))
+  {
+    strlcpy(pg_web_static_root, pg_web_setting_static_dir, MAXPGPATH);
+  }
+  else
+  {
+    char share_path[MAXPGPATH];
+
+    get_share_path(my_exec_path, share_path);
+    join_path_components(pg_web_static_root, share_path,
+                         pg_web_setting_static_dir);
+  }
+  canonicalize_path(pg_web_static_root);
+}
+
+/*
+ * pg_web_static_valid_path
+ *
+ * Only plain names are looked up: no empty segments, no segment starting
+ * with a dot, which also rules out "." and "..", and nothing which would
+ * have to be decoded.
+ */
+static bool
+pg_web_static_valid_path(const char *path)
+{
+  const char *p = path;
+
+  for (;;)
+  {
+    if (*p == '/' || *p == '.' || *p == '\0')
+      return false;
+    while (*p != '/' && *p != '\0')
+    {
+      if (*p == '\\' || *p == '%' || (unsigned char) *p < 0x20)
+        return false;
+      p++;
+    }
+    if (*p == '\0')
+      return true;
+    p++;
+  }
+}
+
+/*
+ * pg_web_static_inside
+ *
+ * Resolve the symbolic links in name into real, and tell whether that is
+ * still inside the directory. Links may point elsewhere in it, not out.
+ */
+static bool
+pg_web_static_inside(const char *name, char *real)
+{
+  char   root[PATH_MAX];
+  size_t len;
+
+  if (realpath(pg_web_static_root, root) == NULL ||
+      realpath(name, real) == NULL)
+    return false;
+  len = strlen(root);
+  return strncmp(real, root, len) == 0 && real[len] == '/';
+}
+
+/*
+ * pg_web_static_load
+ *
+ * Open the file of one variant, or return NULL if it is not a regular file
+ * inside the directory we can serve.
+ */
+static PgWebStaticFile *
+pg_web_static_load(const char *name, int variant)
+{
+  PgWebStaticFile *file;
+  struct stat      st;
+  char             real[PATH_MAX];
+  int              fd;
+
+  if (!pg_web_static_inside(name, real))
+    return NULL;
+  /* the file can't be replaced by a link since it was resolved */
+#if PG_VERSION_NUM >= 110000
+  fd = BasicOpenFile(real, O_RDONLY | O_NOFOLLOW | PG_BINARY);
+#else
+  fd = BasicOpenFile(real, O_RDONLY | O_NOFOLLOW | PG_BINARY, 0);
+#endif
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > INT_MAX)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  file = MemoryContextAlloc(pg_web_static_cxt, sizeof(PgWebStaticFile));
+  file->fd = fd;
+  file->size = (int) st.st_size;
+  file->mtime = st.st_mtime;
+  file->ino = st.st_ino;
+  file->encoding = pg_web_static_variants[variant].encoding;
+  /* the encodings are different entities, with different tags */
+  snprintf(file->etag, sizeof(file->etag), "\"%lx-%x%s%s\"",
+           (unsigned long) file->mtime, (unsigned int) file->size,
+           file->encoding != NULL ? "-" : "",
+           file->encoding != NULL ? file->encoding : "");
+  file->refs = 1;
+  return file;
+}
+
+/*
+ * pg_web_static_refresh
+ *
+ * Check the entry's files against the directory, reopening those which
+ * were changed, replaced, created or removed.
+ */
+static void
+pg_web_static_refresh(PgWebStaticEntry *entry)
+{
+  char name[MAXPGPATH];
+  int  i;
+
+  for (i = 0; i < PG_WEB_STATIC_VARIANTS; i++)
+  {
+    PgWebStaticFile *file = entry->files[i];
+    struct stat      st;
+    bool             exists;
+
+    snprintf(name, sizeof(name), "%s/%s%s", pg_web_static_root, entry->path,
+             pg_web_static_variants[i].suffix);
+    exists = stat(name, &st) == 0 && S_ISREG(st.st_mode);
+    if (file != NULL && exists && file->ino == st.st_ino &&
+        file->mtime == st.st_mtime && file->size == st.st_size)
+      continue;
+
+    if (file != NULL)
+      pg_web_static_release(file);
+    entry->files[i] = exists ? pg_web_static_load(name, i) : NULL;
+
+    /* without the plain file there is nothing to serve, nor keep open */
+    if (i == PG_WEB_STATIC_PLAIN && entry->files[i] == NULL)
+    {
+      for (i = PG_WEB_STATIC_PLAIN + 1; i < PG_WEB_STATIC_VARIANTS; i++)
+      {
+        if (entry->files[i] != NULL)
+          pg_web_static_release(entry->files[i]);
+        entry->files[i] = NULL;
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * pg_web_static_open
+ *
+ * Open the file at path, relative to pg_web.static_dir. Of the encodings
+ * in accept the client takes, the best precompressed sibling which exists
+ * is served instead; vary is set if there are any, so the response varies
+ * with Accept-Encoding. The file is looked at again at most once a second.
+ * Returns a reference to release with pg_web_static_release, or NULL if
+ * there is no such file.
+ */
+PgWebStaticFile *
+pg_web_static_open(const char *path, int accept, bool *vary)
+{
+  char              key[MAXPGPATH];
+  PgWebStaticEntry *entry;
+  PgWebStaticFile  *file;
+  bool              found;
+  time_t            now;
+  int               i;
+
+  *vary = false;
+  if (!pg_web_static_enabled() || !pg_web_static_valid_path(path))
+    return NULL;
+  pg_web_static_init();
+
+  /* room for the directory and the longest suffix */
+  if (strlen(pg_web_static_root) + strlen(path) + 4 >= MAXPGPATH)
+    return NULL;
+  MemSet(key, 0, sizeof(key));
+  strlcpy(key, path, sizeof(key));
+
+  entry = hash_search(pg_web_static_index, key, HASH_FIND, NULL);
+  if (entry != NULL)
+  {
+    dlist_move_head(&pg_web_static_lru, &entry->lru_node);
+  }
+  else
+  {
+    while (pg_web_static_count >= PG_WEB_STATIC_INDEX_SIZE)
+      pg_web_static_forget(dlist_container(PgWebStaticEntry, lru_node,
+                                           dlist_tail_node(&pg_web_static_lru)));
+    entry = hash_search(pg_web_static_index, key, HASH_ENTER, &found);
+    Assert(!found);
+    MemSet(entry->files, 0, sizeof(entry->files));
+    entry->checked = 0;
+    dlist_push_head(&pg_web_static_lru, &entry->lru_node);
+    pg_web_static_count++;
+  }
+
+  now = time(NULL);
+  if (now != entry->checked)
+  {
+    pg_web_static_refresh(entry);
+    entry->checked = now;
+  }
+
+  file = entry->files[PG_WEB_STATIC_PLAIN];
+  if (file == NULL)
+    return NULL;
+  for (i = PG_WEB_STATIC_VARIANTS - 1; i > PG_WEB_STATIC_PLAIN; i--)
+  {
+    if (entry->files[i] == NULL)
+      continue;
+    *vary = true;
+    if ((accept & pg_web_static_variants[i].flag) != 0 &&
+        file == entry->files[PG_WEB_STATIC_PLAIN])
+      file = entry->files[i];
+  }
+  file->refs++;
+  return file;
+}
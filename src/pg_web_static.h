@@ -0,0 +1,50 @@
+/*
+ * pg_web_static.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_STATIC_H
+#define PG_WEB_STATIC_H
+
+#include "postgres.h"
+
+#include <time.h>
+
+/* encodings of the precompressed siblings, see pg_web_static_open */
+#define PG_WEB_STATIC_GZIP    0x01    /* <file>.gz */
+#define PG_WEB_STATIC_BROTLI  0x02    /* <file>.br */
+
+/*
+ * An open file of the static directory. It stays open while the index or
+ * a response being sent holds a reference, so it is served as it was when
+ * it was opened even if it is replaced meanwhile.
+ */
+typedef struct PgWebStaticFile
+{
+  int          fd;
+  int          size;
+  time_t       mtime;
+  ino_t        ino;
+  const char  *encoding;      /* Content-Encoding, or NULL */
+  char         etag[48];      /* quoted */
+  int          refs;
+} PgWebStaticFile;
+
+/* GUC variables, see pg_web.c */
+extern char *pg_web_setting_static_dir;
+
+bool pg_web_static_enabled(void);
+PgWebStaticFile *pg_web_static_open(const char *path, int accept,
+                                    bool *vary);
+const char *pg_web_static_content_type(const char *path);
+void pg_web_static_release(void *file);
+
+#endif
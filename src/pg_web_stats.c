@@ -0,0 +1,829 @@
+/*
+ * pg_web_stats.c
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#include "pg_web_stats.h"
+
+#include <math.h>
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+PG_FUNCTION_INFO_V1(pg_web_stats);
+PG_FUNCTION_INFO_V1(pg_web_worker_stats);
+PG_FUNCTION_INFO_V1(pg_web_latency_histogram);
+PG_FUNCTION_INFO_V1(pg_web_stats_reset);
+
+Datum pg_web_stats(PG_FUNCTION_ARGS);
+Datum pg_web_worker_stats(PG_FUNCTION_ARGS);
+Datum pg_web_latency_histogram(PG_FUNCTION_ARGS);
+Datum pg_web_stats_reset(PG_FUNCTION_ARGS);
+
+static const char *pg_web_route_names[PG_WEB_NUM_ROUTES] = {
+  "/",
+  "/date",
+  "/count",
+  "/ip",
+  "/query",
+  "/export",
+  "/q/",
+  "/metrics",
+  "/static/",
+  "other"
+};
+
+/* the shared stats area, set up by the postmaster */
+static PgWebStatsShared *pg_web_stats_shared = NULL;
+static int pg_web_stats_nworkers = 0;
+
+PgWebWorkerStats *MyWebStats = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/*
+ * pg_web_stats_shmem_size
+ *
+ * Size of the stats area.
+ */
+static Size
+pg_web_stats_shmem_size(void)
+{
+  return add_size(offsetof(PgWebStatsShared, workers),
+                  mul_size(pg_web_stats_nworkers, sizeof(PgWebWorkerStats)));
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * pg_web_stats_shmem_request
+ *
+ * Ask for the stats area (since 15 this has to be done in this hook).
+ */
+static void
+pg_web_stats_shmem_request(void)
+{
+  if (prev_shmem_request_hook)
+    prev_shmem_request_hook();
+  RequestAddinShmemSpace(pg_web_stats_shmem_size());
+}
+#endif
+
+/*
+ * pg_web_stats_shmem_startup
+ *
+ * Allocate or attach to the stats area.
+ */
+static void
+pg_web_stats_shmem_startup(void)
+{
+  bool found;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  pg_web_stats_shared = ShmemInitStruct("pg_web stats",
+                                        pg_web_stats_shmem_size(),
+                                        &found);
+  if (!found)
+  {
+    memset(pg_web_stats_shared, 0, pg_web_stats_shmem_size());
+    pg_web_stats_shared->nworkers = pg_web_stats_nworkers;
+  }
+  LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * pg_web_stats_init
+ *
+ * Reserve shared memory for the counters of nworkers workers. Must be
+ * called from _PG_init while the library is preloaded.
+ */
+void
+pg_web_stats_init(int nworkers)
+{
+  pg_web_stats_nworkers = nworkers;
+
+#if PG_VERSION_NUM >= 150000
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = pg_web_stats_shmem_request;
+#else
+  RequestAddinShmemSpace(pg_web_stats_shmem_size());
+#endif
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = pg_web_stats_shmem_startup;
+}
+
+/*
+ * pg_web_stats_detach
+ *
+ * Mark the worker as gone when it exits.
+ */
+static void
+pg_web_stats_detach(int code, Datum arg)
+{
+  MyWebStats->pid = 0;
+  MyWebStats->latch = NULL;
+  MyWebStats->connections_active = 0;
+  MyWebStats = NULL;
+}
+
+/*
+ * pg_web_stats_attach
+ *
+ * Start counting in the slot of the given worker. The counters survive a
+ * restart of the worker, but its connections don't.
+ */
+void
+pg_web_stats_attach(int worker_id)
+{
+  if (pg_web_stats_shared == NULL ||
+      worker_id >= pg_web_stats_shared->nworkers)
+    elog(ERROR, "pg_web: no stats slot for worker %d", worker_id);
+
+  MyWebStats = &pg_web_stats_shared->workers[worker_id];
+  MyWebStats->connections_active = 0;
+  MyWebStats->latch = &MyProc->procLatch;
+  MyWebStats->pid = MyProcPid;
+  on_shmem_exit(pg_web_stats_detach, (Datum) 0);
+}
+
+/*
+ * pg_web_stats_check_reset
+ *
+ * Zero our counters if pg_web_stats_reset() was called since we last
+ * looked. Doing it here keeps the worker the only writer of its counters.
+ */
+void
+pg_web_stats_check_reset(void)
+{
+  volatile PgWebStatsShared *shared = pg_web_stats_shared;
+  uint32                     generation;
+
+  if (MyWebStats == NULL)
+    return;
+
+  generation = shared->reset_generation;
+  if (generation == MyWebStats->reset_generation)
+    return;
+
+  MyWebStats->connections_total = 0;
+  memset(MyWebStats->routes, 0, sizeof(MyWebStats->routes));
+  MyWebStats->loop_iterations = 0;
+  MyWebStats->loop_busy = 0;
+  MyWebStats->loop_wait = 0;
+  memset(MyWebStats->loop_busy_hist, 0, sizeof(MyWebStats->loop_busy_hist));
+  MyWebStats->pool_hits = 0;
+  MyWebStats->pool_misses = 0;
+  MyWebStats->cache_hits = 0;
+  MyWebStats->cache_misses = 0;
+  MyWebStats->compress_bytes_in = 0;
+  MyWebStats->compress_bytes_out = 0;
+  MyWebStats->reset_generation = generation;
+}
+
+/*
+ * pg_web_stats_route_name
+ */
+const char *
+pg_web_stats_route_name(PgWebRoute route)
+{
+  return pg_web_route_names[route];
+}
+
+/*
+ * pg_web_stats_latency_bucket
+ *
+ * Histogram bucket of the latency in microseconds.
+ */
+int
+pg_web_stats_latency_bucket(uint64 latency)
+{
+  int msb = 0;
+
+  if (latency < PG_WEB_STATS_SUB_BUCKETS)
+    return (int) latency;
+
+#ifdef HAVE__BUILTIN_CLZ
+  msb = 63 - __builtin_clzll(latency);
+#else
+  {
+    uint64 v = latency;
+
+    while (v >>= 1)
+      msb++;
+  }
+#endif
+
+  /* 2^msb..2^(msb+1) is split by the 3 bits after the leading one */
+  if (msb > 26)
+    return PG_WEB_STATS_LATENCY_BUCKETS - 1;
+  return (msb - 2) * PG_WEB_STATS_SUB_BUCKETS +
+    (int) ((latency >> (msb - 3)) & (PG_WEB_STATS_SUB_BUCKETS - 1));
+}
+
+/*
+ * pg_web_stats_bucket_upper
+ *
+ * Exclusive upper bound of the bucket, in microseconds.
+ */
+uint64
+pg_web_stats_bucket_upper(int bucket)
+{
+  int msb;
+  int sub;
+
+  if (bucket < PG_WEB_STATS_SUB_BUCKETS)
+    return bucket + 1;
+
+  msb = bucket / PG_WEB_STATS_SUB_BUCKETS + 2;
+  sub = bucket % PG_WEB_STATS_SUB_BUCKETS;
+  return (uint64) (PG_WEB_STATS_SUB_BUCKETS + sub + 1) << (msb - 3);
+}
+
+/*
+ * pg_web_stats_request_done
+ *
+ * Account a finished request.
+ */
+void
+pg_web_stats_request_done(PgWebRoute route, int status, uint64 bytes_in,
+                          uint64 bytes_out, uint64 latency)
+{
+  PgWebRouteStats *stats;
+
+  if (MyWebStats == NULL)
+    return;
+
+  stats = &MyWebStats->routes[route];
+  stats->requests++;
+  stats->bytes_in += bytes_in;
+  stats->bytes_out += bytes_out;
+  if (status >= 100 && status < 600)
+    stats->status[status / 100 - 1]++;
+  stats->latency_sum += latency;
+  if (latency > stats->latency_max)
+    stats->latency_max = latency;
+  stats->latency[pg_web_stats_latency_bucket(latency)]++;
+}
+
+/*
+ * pg_web_stats_loop_done
+ *
+ * Account an iteration of the worker's event loop, which spent busy
+ * microseconds handling events and wait microseconds waiting for them.
+ * bytes_buffered are those of the queued ones held in memory, the rest is
+ * sent from files, and the requests in the receive buffers. pool_hits and
+ * pool_misses count the streams and write buffer chunks dyad took from its
+ * free lists or allocated during the iteration.
+ */
+void
+pg_web_stats_loop_done(uint64 busy, uint64 wait, uint64 bytes_queued,
+                       uint64 bytes_buffered, uint64 pool_hits,
+                       uint64 pool_misses)
+{
+  if (MyWebStats == NULL)
+    return;
+
+  MyWebStats->loop_iterations++;
+  MyWebStats->loop_busy += busy;
+  MyWebStats->loop_wait += wait;
+  MyWebStats->loop_busy_hist[pg_web_stats_latency_bucket(busy)]++;
+  MyWebStats->bytes_queued = bytes_queued;
+  MyWebStats->bytes_buffered = bytes_buffered;
+  MyWebStats->pool_hits += pool_hits;
+  MyWebStats->pool_misses += pool_misses;
+}
+
+/*
+ * pg_web_stats_check_available
+ *
+ * Complain if the stats area wasn't set up.
+ */
+static void
+pg_web_stats_check_available(void)
+{
+  if (pg_web_stats_shared == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("pg_web must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * pg_web_stats_sum_route
+ *
+ * Add up the counters of the route over all workers.
+ */
+static void
+pg_web_stats_sum_route(int route, PgWebRouteStats *sum)
+{
+  int i;
+  int j;
+
+  memset(sum, 0, sizeof(PgWebRouteStats));
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+  {
+    volatile PgWebRouteStats *stats;
+
+    stats = &pg_web_stats_shared->workers[i].routes[route];
+
+    sum->requests += stats->requests;
+    sum->bytes_in += stats->bytes_in;
+    sum->bytes_out += stats->bytes_out;
+    for (j = 0; j < 5; j++)
+      sum->status[j] += stats->status[j];
+    sum->latency_sum += stats->latency_sum;
+    if (stats->latency_max > sum->latency_max)
+      sum->latency_max = stats->latency_max;
+    for (j = 0; j < PG_WEB_STATS_LATENCY_BUCKETS; j++)
+      sum->latency[j] += stats->latency[j];
+  }
+}
+
+/*
+ * pg_web_stats_percentile
+ *
+ * Upper bound of the bucket holding the given fraction of the requests,
+ * in milliseconds.
+ */
+static double
+pg_web_stats_percentile(PgWebRouteStats *stats, double fraction)
+{
+  uint64  rank;
+  uint64  seen = 0;
+  int     i;
+
+  rank = (uint64) ceil(stats->requests * fraction);
+  if (rank == 0)
+    rank = 1;
+  for (i = 0; i < PG_WEB_STATS_LATENCY_BUCKETS; i++)
+  {
+    seen += stats->latency[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i == PG_WEB_STATS_LATENCY_BUCKETS)
+    i--;
+  return pg_web_stats_bucket_upper(i) / 1000.0;
+}
+
+/*
+ * Bucket bounds of the histograms in /metrics, in microseconds. The counts
+ * are taken from the finer histogram buckets which end below the bound.
+ */
+static const uint64 pg_web_metrics_latency_bounds[] = {
+  500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000
+};
+static const uint64 pg_web_metrics_loop_bounds[] = {
+  10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+};
+
+/*
+ * pg_web_stats_metrics_header
+ */
+static void
+pg_web_stats_metrics_header(StringInfo out, const char *name,
+                            const char *type, const char *help)
+{
+  appendStringInfo(out, "# HELP %s %s\n# TYPE %s %s\n",
+                   name, help, name, type);
+}
+
+/*
+ * pg_web_stats_metrics_histogram
+ *
+ * Append the series of a histogram with the given labels (which may be
+ * empty) and a sum in microseconds.
+ */
+static void
+pg_web_stats_metrics_histogram(StringInfo out, const char *name,
+                               const char *labels, const uint64 *hist,
+                               uint64 sum, uint64 count,
+                               const uint64 *bounds, int nbounds)
+{
+  const char *sep = labels[0] != '\0' ? "," : "";
+  uint64      cumulative = 0;
+  int         bucket = 0;
+  int         i;
+
+  for (i = 0; i < nbounds; i++)
+  {
+    while (bucket < PG_WEB_STATS_LATENCY_BUCKETS &&
+           pg_web_stats_bucket_upper(bucket) <= bounds[i])
+      cumulative += hist[bucket++];
+    appendStringInfo(out, "%s_bucket{%s%sle=\"%g\"} " UINT64_FORMAT "\n",
+                     name, labels, sep, bounds[i] / 1000000.0, cumulative);
+  }
+  appendStringInfo(out, "%s_bucket{%s%sle=\"+Inf\"} " UINT64_FORMAT "\n",
+                   name, labels, sep, count);
+  if (labels[0] != '\0')
+  {
+    appendStringInfo(out, "%s_sum{%s} %.6f\n", name, labels, sum / 1000000.0);
+    appendStringInfo(out, "%s_count{%s} " UINT64_FORMAT "\n",
+                     name, labels, count);
+  }
+  else
+  {
+    appendStringInfo(out, "%s_sum %.6f\n", name, sum / 1000000.0);
+    appendStringInfo(out, "%s_count " UINT64_FORMAT "\n", name, count);
+  }
+}
+
+/*
+ * pg_web_stats_metrics
+ *
+ * Render the counters of all workers in the Prometheus text format. This
+ * only reads shared memory, so it needs neither SPI nor a transaction.
+ * Request counters are summed over the workers (any of them may answer a
+ * scrape) and routes without requests are left out to keep this short.
+ */
+void
+pg_web_stats_metrics(StringInfo out)
+{
+  static const char *classes[5] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+  PgWebRouteStats    routes[PG_WEB_NUM_ROUTES];
+  uint64             loop_hist[PG_WEB_STATS_LATENCY_BUCKETS];
+  uint64             loop_busy = 0;
+  uint64             loop_iterations = 0;
+  char               labels[64];
+  int                route;
+  int                i;
+  int                j;
+
+  if (pg_web_stats_shared == NULL)
+    return;
+
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+    pg_web_stats_sum_route(route, &routes[route]);
+
+  pg_web_stats_metrics_header(out, "pg_web_requests_total", "counter",
+                              "HTTP requests answered.");
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+    for (j = 0; j < 5; j++)
+      if (routes[route].status[j] > 0)
+        appendStringInfo(out,
+                         "pg_web_requests_total{route=\"%s\",code=\"%s\"} "
+                         UINT64_FORMAT "\n",
+                         pg_web_route_names[route], classes[j],
+                         routes[route].status[j]);
+
+  pg_web_stats_metrics_header(out, "pg_web_request_bytes_total", "counter",
+                              "Bytes of HTTP requests received.");
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+    if (routes[route].requests > 0)
+      appendStringInfo(out, "pg_web_request_bytes_total{route=\"%s\"} "
+                       UINT64_FORMAT "\n",
+                       pg_web_route_names[route], routes[route].bytes_in);
+
+  pg_web_stats_metrics_header(out, "pg_web_response_bytes_total", "counter",
+                              "Bytes of HTTP responses sent.");
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+    if (routes[route].requests > 0)
+      appendStringInfo(out, "pg_web_response_bytes_total{route=\"%s\"} "
+                       UINT64_FORMAT "\n",
+                       pg_web_route_names[route], routes[route].bytes_out);
+
+  pg_web_stats_metrics_header(out, "pg_web_request_duration_seconds",
+                              "histogram",
+                              "Time from a request's first byte until its "
+                              "response is queued.");
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+  {
+    if (routes[route].requests == 0)
+      continue;
+    snprintf(labels, sizeof(labels), "route=\"%s\"",
+             pg_web_route_names[route]);
+    pg_web_stats_metrics_histogram(out, "pg_web_request_duration_seconds",
+                                   labels, routes[route].latency,
+                                   routes[route].latency_sum,
+                                   routes[route].requests,
+                                   pg_web_metrics_latency_bounds,
+                                   lengthof(pg_web_metrics_latency_bounds));
+  }
+
+  pg_web_stats_metrics_header(out, "pg_web_connections", "gauge",
+                              "Open HTTP connections.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_connections{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].connections_active);
+
+  pg_web_stats_metrics_header(out, "pg_web_connections_total", "counter",
+                              "HTTP connections accepted.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_connections_total{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].connections_total);
+
+  pg_web_stats_metrics_header(out, "pg_web_write_buffer_bytes", "gauge",
+                              "Bytes queued to be sent to the clients.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_write_buffer_bytes{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].bytes_queued);
+
+  pg_web_stats_metrics_header(out, "pg_web_buffered_bytes", "gauge",
+                              "Bytes held in memory for the clients: "
+                              "responses not sent from files and requests "
+                              "not answered yet.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_buffered_bytes{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].bytes_buffered);
+
+  pg_web_stats_metrics_header(out, "pg_web_stream_pool_hits_total",
+                              "counter",
+                              "Streams and write buffer chunks reused from "
+                              "the free lists.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_stream_pool_hits_total{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].pool_hits);
+
+  pg_web_stats_metrics_header(out, "pg_web_stream_pool_misses_total",
+                              "counter",
+                              "Streams and write buffer chunks allocated "
+                              "because the free lists were empty.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_stream_pool_misses_total{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].pool_misses);
+
+  pg_web_stats_metrics_header(out, "pg_web_cache_hits_total", "counter",
+                              "Responses served from the response cache, "
+                              "or with 304 from its change counters.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_cache_hits_total{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].cache_hits);
+
+  pg_web_stats_metrics_header(out, "pg_web_cache_misses_total", "counter",
+                              "Cacheable requests not found in the "
+                              "response cache.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_cache_misses_total{worker=\"%d\"} "
+                     UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].cache_misses);
+
+  pg_web_stats_metrics_header(out, "pg_web_compression_input_bytes_total",
+                              "counter",
+                              "Response bytes before they were compressed.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_compression_input_bytes_total"
+                     "{worker=\"%d\"} " UINT64_FORMAT "\n",
+                     i, pg_web_stats_shared->workers[i].compress_bytes_in);
+
+  pg_web_stats_metrics_header(out, "pg_web_compression_saved_bytes_total",
+                              "counter",
+                              "Response bytes saved by compression.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+  {
+    volatile PgWebWorkerStats *worker = &pg_web_stats_shared->workers[i];
+    uint64 in = worker->compress_bytes_in;
+    uint64 compressed = worker->compress_bytes_out;
+
+    /* read apart, the pair may be a request apart too */
+    appendStringInfo(out, "pg_web_compression_saved_bytes_total"
+                     "{worker=\"%d\"} " UINT64_FORMAT "\n",
+                     i, in > compressed ? in - compressed : 0);
+  }
+
+  pg_web_stats_metrics_header(out, "pg_web_loop_wait_seconds_total",
+                              "counter",
+                              "Time the event loop spent waiting for events.");
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+    appendStringInfo(out, "pg_web_loop_wait_seconds_total{worker=\"%d\"} "
+                     "%.6f\n",
+                     i, pg_web_stats_shared->workers[i].loop_wait / 1000000.0);
+
+  /* the iterations of all workers go into one histogram */
+  memset(loop_hist, 0, sizeof(loop_hist));
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+  {
+    volatile PgWebWorkerStats *worker = &pg_web_stats_shared->workers[i];
+
+    loop_iterations += worker->loop_iterations;
+    loop_busy += worker->loop_busy;
+    for (j = 0; j < PG_WEB_STATS_LATENCY_BUCKETS; j++)
+      loop_hist[j] += worker->loop_busy_hist[j];
+  }
+  pg_web_stats_metrics_header(out, "pg_web_loop_iteration_seconds",
+                              "histogram",
+                              "Time an event loop iteration spent handling "
+                              "events, without waiting.");
+  pg_web_stats_metrics_histogram(out, "pg_web_loop_iteration_seconds", "",
+                                 loop_hist, loop_busy, loop_iterations,
+                                 pg_web_metrics_loop_bounds,
+                                 lengthof(pg_web_metrics_loop_bounds));
+}
+
+/*
+ * pg_web_stats_begin_srf
+ *
+ * Set up a materialized set-returning function call.
+ */
+static Tuplestorestate *
+pg_web_stats_begin_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+  ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  MemoryContext    oldcontext;
+  Tuplestorestate *tupstore;
+
+  if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("set-valued function called in context that cannot accept a set")));
+  if (!(rsinfo->allowedModes & SFRM_Materialize))
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("materialize mode required, but it is not allowed in this context")));
+  if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+
+  oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+  *tupdesc = CreateTupleDescCopy(*tupdesc);
+  tupstore = tuplestore_begin_heap(true, false, work_mem);
+  rsinfo->returnMode = SFRM_Materialize;
+  rsinfo->setResult = tupstore;
+  rsinfo->setDesc = *tupdesc;
+  MemoryContextSwitchTo(oldcontext);
+
+  return tupstore;
+}
+
+/*
+ * pg_web_stats
+ *
+ * Request counters and latency summary per route, over all workers.
+ */
+Datum
+pg_web_stats(PG_FUNCTION_ARGS)
+{
+  Tuplestorestate *tupstore;
+  TupleDesc        tupdesc;
+  int              route;
+
+  pg_web_stats_check_available();
+  tupstore = pg_web_stats_begin_srf(fcinfo, &tupdesc);
+
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+  {
+    PgWebRouteStats stats;
+    Datum           values[14];
+    bool            nulls[14];
+    int             i = 0;
+    int             j;
+
+    pg_web_stats_sum_route(route, &stats);
+    memset(nulls, 0, sizeof(nulls));
+
+    values[i++] = CStringGetTextDatum(pg_web_route_names[route]);
+    values[i++] = Int64GetDatum(stats.requests);
+    values[i++] = Int64GetDatum(stats.bytes_in);
+    values[i++] = Int64GetDatum(stats.bytes_out);
+    for (j = 0; j < 5; j++)
+      values[i++] = Int64GetDatum(stats.status[j]);
+    if (stats.requests > 0)
+    {
+      values[i++] = Float8GetDatum(stats.latency_sum / 1000.0 /
+                                   stats.requests);
+      values[i++] = Float8GetDatum(pg_web_stats_percentile(&stats, 0.5));
+      values[i++] = Float8GetDatum(pg_web_stats_percentile(&stats, 0.9));
+      values[i++] = Float8GetDatum(pg_web_stats_percentile(&stats, 0.99));
+      values[i++] = Float8GetDatum(stats.latency_max / 1000.0);
+    }
+    else
+    {
+      for (j = 0; j < 5; j++)
+        nulls[i++] = true;
+    }
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * pg_web_worker_stats
+ *
+ * Connection counters per worker.
+ */
+Datum
+pg_web_worker_stats(PG_FUNCTION_ARGS)
+{
+  Tuplestorestate *tupstore;
+  TupleDesc        tupdesc;
+  int              i;
+
+  pg_web_stats_check_available();
+  tupstore = pg_web_stats_begin_srf(fcinfo, &tupdesc);
+
+  for (i = 0; i < pg_web_stats_shared->nworkers; i++)
+  {
+    volatile PgWebWorkerStats *worker = &pg_web_stats_shared->workers[i];
+    Datum   values[4];
+    bool    nulls[4];
+    pid_t   pid = worker->pid;
+
+    memset(nulls, 0, sizeof(nulls));
+    values[0] = Int32GetDatum(i);
+    if (pid != 0)
+      values[1] = Int32GetDatum(pid);
+    else
+      nulls[1] = true;
+    values[2] = Int64GetDatum(worker->connections_active);
+    values[3] = Int64GetDatum(worker->connections_total);
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * pg_web_latency_histogram
+ *
+ * The non-empty latency buckets of every route, as cumulative counts of
+ * requests faster than the bucket's upper bound in milliseconds.
+ */
+Datum
+pg_web_latency_histogram(PG_FUNCTION_ARGS)
+{
+  Tuplestorestate *tupstore;
+  TupleDesc        tupdesc;
+  int              route;
+
+  pg_web_stats_check_available();
+  tupstore = pg_web_stats_begin_srf(fcinfo, &tupdesc);
+
+  for (route = 0; route < PG_WEB_NUM_ROUTES; route++)
+  {
+    PgWebRouteStats stats;
+    uint64          cumulative = 0;
+    int             i;
+
+    pg_web_stats_sum_route(route, &stats);
+    for (i = 0; i < PG_WEB_STATS_LATENCY_BUCKETS; i++)
+    {
+      Datum values[3];
+      bool  nulls[3] = {false, false, false};
+
+      if (stats.latency[i] == 0)
+        continue;
+      cumulative += stats.latency[i];
+
+      values[0] = CStringGetTextDatum(pg_web_route_names[route]);
+      values[1] = Float8GetDatum(pg_web_stats_bucket_upper(i) / 1000.0);
+      values[2] = Int64GetDatum(cumulative);
+      tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * pg_web_stats_reset
+ *
+ * Ask the workers to zero their counters. The workers do it themselves on
+ * their next loop iteration, which we wake them up for.
+ */
+Datum
+pg_web_stats_reset(PG_FUNCTION_ARGS)
+{
+  volatile PgWebStatsShared *shared = pg_web_stats_shared;
+  int                        i;
+
+  pg_web_stats_check_available();
+
+  shared->reset_generation++;
+  for (i = 0; i < shared->nworkers; i++)
+  {
+    Latch *latch = shared->workers[i].latch;
+
+    if (latch != NULL)
+      SetLatch(latch);
+  }
+
+  PG_RETURN_VOID();
+}
@@ -0,0 +1,110 @@
+/*
+ * pg_web_stats.h
+ *
+ * PostgreSQL extension with web interface
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+#ifndef PG_WEB_STATS_H
+#define PG_WEB_STATS_H
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+#include "storage/latch.h"
+
+/* routes requests are counted under */
+typedef enum PgWebRoute
+{
+  PG_WEB_ROUTE_INDEX,
+  PG_WEB_ROUTE_DATE,
+  PG_WEB_ROUTE_COUNT,
+  PG_WEB_ROUTE_IP,
+  PG_WEB_ROUTE_QUERY,
+  PG_WEB_ROUTE_EXPORT,
+  PG_WEB_ROUTE_ENDPOINT,      /* /q/<name> */
+  PG_WEB_ROUTE_METRICS,
+  PG_WEB_ROUTE_STATIC,        /* /static/<path> */
+  PG_WEB_ROUTE_OTHER,         /* unknown paths and unparsable requests */
+  PG_WEB_NUM_ROUTES
+} PgWebRoute;
+
+/*
+ * Latency histogram in microseconds with HDR-style buckets: values below 8
+ * have a bucket each, above that every power of two is split into 8 linear
+ * sub-buckets, so a bucket's width is at most 1/8 of its lower bound. The
+ * last bucket ends at 2^27us (~134s) and takes everything slower.
+ */
+#define PG_WEB_STATS_SUB_BUCKETS      8
+#define PG_WEB_STATS_LATENCY_BUCKETS  ((27 - 2) * PG_WEB_STATS_SUB_BUCKETS)
+
+typedef struct PgWebRouteStats
+{
+  uint64  requests;
+  uint64  bytes_in;
+  uint64  bytes_out;
+  uint64  status[5];          /* 1xx to 5xx */
+  uint64  latency_sum;        /* microseconds */
+  uint64  latency_max;
+  uint64  latency[PG_WEB_STATS_LATENCY_BUCKETS];
+} PgWebRouteStats;
+
+/*
+ * Counters of one worker. Only the worker itself writes them, so they are
+ * updated without locks or atomics; readers may see a request half
+ * accounted, which is fine for monitoring.
+ */
+typedef struct PgWebWorkerStats
+{
+  pid_t           pid;                /* 0 if the worker isn't running */
+  Latch          *latch;              /* to wake the worker up for a reset */
+  uint32          reset_generation;   /* last reset applied */
+  uint64          connections_active;
+  uint64          connections_total;
+  PgWebRouteStats routes[PG_WEB_NUM_ROUTES];
+
+  /* the event loop, times in microseconds */
+  uint64          loop_iterations;
+  uint64          loop_busy;          /* handling events */
+  uint64          loop_wait;          /* waiting for them */
+  uint64          loop_busy_hist[PG_WEB_STATS_LATENCY_BUCKETS];
+  uint64          bytes_queued;       /* in the write buffers, a gauge */
+  uint64          bytes_buffered;     /* in memory, with the requests */
+  uint64          pool_hits;          /* streams and write buffer chunks */
+  uint64          pool_misses;        /* reused, or allocated anew */
+  uint64          cache_hits;         /* responses served from the cache */
+  uint64          cache_misses;
+  uint64          compress_bytes_in;  /* response bytes compressed */
+  uint64          compress_bytes_out; /* and what they became */
+} PgWebWorkerStats;
+
+typedef struct PgWebStatsShared
+{
+  int               nworkers;
+  uint32            reset_generation; /* bumped to ask for a reset */
+  PgWebWorkerStats  workers[1];       /* VARIABLE LENGTH ARRAY */
+} PgWebStatsShared;
+
+/* stats of this worker, NULL outside of the workers */
+extern PgWebWorkerStats *MyWebStats;
+
+void pg_web_stats_init(int nworkers);
+void pg_web_stats_attach(int worker_id);
+void pg_web_stats_check_reset(void);
+const char *pg_web_stats_route_name(PgWebRoute route);
+void pg_web_stats_request_done(PgWebRoute route, int status,
+                               uint64 bytes_in, uint64 bytes_out,
+                               uint64 latency);
+void pg_web_stats_loop_done(uint64 busy, uint64 wait, uint64 bytes_queued,
+                            uint64 bytes_buffered, uint64 pool_hits,
+                            uint64 pool_misses);
+void pg_web_stats_metrics(StringInfo out);
+int pg_web_stats_latency_bucket(uint64 latency);
+uint64 pg_web_stats_bucket_upper(int bucket);
+
+#endif
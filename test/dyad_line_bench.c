@@ -0,0 +1,263 @@
+/*
+ * dyad_line_bench.c
+ *
+ * Microbenchmark of dyad's line framing (DYAD_EVENT_LINE)
+ *
+ *
+ * Written by Alexey Vasiliev
+ * leopard.not.a@gmail.com
+ *
+ * Copyright 2013 Alexey Vasiliev. This program is Free
+ * Software; see the LICENSE file for the license conditions.
+ */
+
+/*
+ * HTTP request bytes are replayed into a stream the way recv() would hand
+ * them over, in pieces of a fixed or of a varying size, and split into line
+ * events by dyad_emitLines() and by a copy of the framing it replaced, which
+ * pushed the data a byte at a time and searched the whole line buffer after
+ * every read. The requests are a built-in trace, or the raw bytes of the
+ * file given as the argument (a capture of what clients sent, e.g. with
+ * "tcpflow -C"). dyad is included whole, so the static functions can be
+ * called; "make dyad_line_bench" builds it.
+ */
+
+#include "dyad.c"
+
+/* each measurement replays the trace for at least this long, seconds */
+#define BENCH_MIN_TIME  0.3
+
+/* a few clients as they talk to pg_web, repeated to make up the trace */
+static const char *bench_requests[] = {
+  "GET /static/app.js HTTP/1.1\r\n"
+  "Host: db.example.com:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+  "like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+  "Accept: */*\r\n"
+  "Referer: http://db.example.com:8080/static/index.html\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+  "Cookie: _ga=GA1.1.1234567890.1700000000; session=eyJhbGciOiJIUzI1NiIsInR5"
+  "cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0Ijox"
+  "NTE2MjM5MDIyLCJyb2xlcyI6WyJyZWFkZXIiLCJ3cml0ZXIiXSwib3JnIjoiZXhhbXBsZSJ9."
+  "SflKxwRJSMeKKF2QT4fwpMeJf36POk6yJV_adQssw5c; prefs=theme%3Ddark%26rows%3D"
+  "100%26tz%3DEurope%252FBerlin; _gid=GA1.1.987654321.1700000000\r\n"
+  "If-None-Match: \"1700000000-48213-gzip\"\r\n"
+  "\r\n",
+
+  "GET /query?q=select%20id%2C%20name%2C%20email%20from%20users%20where%20"
+  "created_at%20%3E%20now()%20-%20interval%20%271%20day%27 HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/8.5.0\r\n"
+  "Accept: application/json\r\n"
+  "\r\n",
+
+  "POST /query HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: python-requests/2.31.0\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Accept: application/vnd.apache.arrow.stream\r\n"
+  "Connection: keep-alive\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 171\r\n"
+  "\r\n"
+  "select o.id, o.total, c.name\n"
+  "  from orders o\n"
+  "  join customers c on c.id = o.customer_id\n"
+  " where o.created_at >= date_trunc('month', now())\n"
+  " order by o.total desc\n"
+  " limit 1000\n",
+
+  "GET /q/user_by_id?id=48213 HTTP/1.1\r\n"
+  "Host: api.internal\r\n"
+  "User-Agent: Go-http-client/1.1\r\n"
+  "Accept-Encoding: gzip\r\n"
+  "\r\n",
+
+  "GET /metrics HTTP/1.1\r\n"
+  "Host: 10.0.3.17:8080\r\n"
+  "User-Agent: Prometheus/2.48.0\r\n"
+  "Accept: application/openmetrics-text;version=1.0.0,application/"
+  "openmetrics-text;version=0.0.1;q=0.75,text/plain;version=0.0.4;q=0.5,*/*;"
+  "q=0.1\r\n"
+  "Accept-Encoding: gzip\r\n"
+  "X-Prometheus-Scrape-Timeout-Seconds: 10\r\n"
+  "\r\n",
+};
+
+/* line events of a replay, and their bytes */
+static int bench_lines;
+static long long bench_lineBytes;
+
+/*
+ * bench_onLine
+ *
+ * Count the line.
+ */
+static void bench_onLine(dyad_Event *e) {
+  bench_lines++;
+  bench_lineBytes += e->size;
+}
+
+/*
+ * bench_emitLinesBytewise
+ *
+ * The line framing of dyad_handleReceivedData before dyad_emitLines.
+ */
+static void bench_emitLinesBytewise(dyad_Stream *stream, const char *data,
+                                    int size) {
+  int i, start;
+  char *buf;
+  for (i = 0; i < size; i++) {
+    dyad_vectorPush(&stream->lineBuffer, data[i]);
+  }
+  start = 0;
+  buf = stream->lineBuffer.data;
+  for (i = 0; i < stream->lineBuffer.length; i++) {
+    if (buf[i] == '\n') {
+      dyad_Event e;
+      buf[i] = '\0';
+      e = dyad_createEvent(DYAD_EVENT_LINE);
+      e.msg = "received line";
+      e.data = &buf[start];
+      e.size = i - start;
+      /* Check and strip carriage return */
+      if (e.size > 0 && e.data[e.size - 1] == '\r') {
+        e.data[--e.size] = '\0';
+      }
+      dyad_emitEvent(stream, &e);
+      start = i + 1;
+    }
+  }
+  if (start == stream->lineBuffer.length) {
+    dyad_vectorClear(&stream->lineBuffer);
+  } else {
+    dyad_vectorSplice(&stream->lineBuffer, 0, start);
+  }
+}
+
+/*
+ * bench_readSize
+ *
+ * Size of the next read: size, or if it is 0 a pseudo-random one up to what
+ * dyad_handleReceivedData reads at once.
+ */
+static int bench_readSize(int size, unsigned *seed) {
+  if (size > 0) {
+    return size;
+  }
+  *seed = *seed * 1103515245 + 12345;
+  return 1 + (int) ((*seed >> 8) % 8191);
+}
+
+/*
+ * bench_run
+ *
+ * Replay the trace in reads of the given size through the framing function
+ * for BENCH_MIN_TIME, returning MB/s. The line events of one replay are
+ * counted in *lines, with their bytes in *lineBytes.
+ */
+static double bench_run(
+  dyad_Stream *stream, void (*frame)(dyad_Stream*, const char*, int),
+  const char *trace, int len, int size, int *lines, long long *lineBytes
+) {
+  double start = dyad_getTime(), elapsed;
+  long long bytes = 0;
+  do {
+    unsigned seed = 1;
+    int pos = 0;
+    bench_lines = 0;
+    bench_lineBytes = 0;
+    dyad_vectorClear(&stream->lineBuffer);
+    stream->lineScan = 0;
+    while (pos < len) {
+      int n = bench_readSize(size, &seed);
+      if (n > len - pos) n = len - pos;
+      frame(stream, trace + pos, n);
+      pos += n;
+    }
+    bytes += len;
+    elapsed = dyad_getTime() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+  *lines = bench_lines;
+  *lineBytes = bench_lineBytes;
+  return bytes / elapsed / (1024 * 1024);
+}
+
+/*
+ * bench_readTrace
+ *
+ * The bytes of the file, or the built-in requests repeated to about 1MB.
+ */
+static char *bench_readTrace(const char *path, int *len) {
+  char *trace;
+  if (path) {
+    FILE *fp = fopen(path, "rb");
+    long n;
+    if (!fp || fseek(fp, 0, SEEK_END) != 0 || (n = ftell(fp)) <= 0) {
+      fprintf(stderr, "could not read %s\n", path);
+      exit(1);
+    }
+    rewind(fp);
+    trace = malloc(n);
+    if (fread(trace, 1, n, fp) != (size_t) n) {
+      fprintf(stderr, "could not read %s\n", path);
+      exit(1);
+    }
+    fclose(fp);
+    *len = (int) n;
+  } else {
+    int i, n = sizeof(bench_requests) / sizeof(*bench_requests);
+    int cap = 1024 * 1024;
+    trace = malloc(cap + 4096);
+    *len = 0;
+    for (i = 0; *len < cap; i = (i + 1) % n) {
+      int l = strlen(bench_requests[i]);
+      memcpy(trace + *len, bench_requests[i], l);
+      *len += l;
+    }
+  }
+  return trace;
+}
+
+int main(int argc, char **argv) {
+  static const int sizes[] = { 1, 16, 128, 536, 1460, 4096, 8191, 0 };
+  dyad_Stream *stream;
+  char *trace;
+  int i, len;
+
+  trace = bench_readTrace(argc > 1 ? argv[1] : NULL, &len);
+  stream = dyad_newStream();
+  stream->state = DYAD_STATE_CONNECTED;
+  dyad_addListener(stream, DYAD_EVENT_LINE, bench_onLine, NULL);
+
+  printf("%d bytes of requests\n\n", len);
+  printf("%8s %14s %14s %8s\n", "read", "bytewise MB/s", "memchr MB/s",
+         "speedup");
+  for (i = 0; i < (int) (sizeof(sizes) / sizeof(*sizes)); i++) {
+    int linesBefore, linesAfter;
+    long long bytesBefore, bytesAfter;
+    double before = bench_run(stream, bench_emitLinesBytewise, trace, len,
+                              sizes[i], &linesBefore, &bytesBefore);
+    double after = bench_run(stream, dyad_emitLines, trace, len,
+                             sizes[i], &linesAfter, &bytesAfter);
+    char label[16];
+    if (linesBefore != linesAfter || bytesBefore != bytesAfter) {
+      fprintf(stderr, "line events differ: %d before, %d after\n",
+              linesBefore, linesAfter);
+      return 1;
+    }
+    if (sizes[i] > 0) {
+      sprintf(label, "%d", sizes[i]);
+    } else {
+      strcpy(label, "mixed");
+    }
+    printf("%8s %14.1f %14.1f %7.1fx\n", label, before, after, after / before);
+  }
+
+  dyad_close(stream);
+  dyad_shutdown();
+  free(trace);
+  return 0;
+}